@@ -5,8 +5,9 @@
 // EDNS(0):  https://tools.ietf.org/html/rfc6891
 // DNSSEC:   https://tools.ietf.org/html/rfc3225
 // DS:       https://tools.ietf.org/html/rfc4034
+// DNSSEC validation: https://tools.ietf.org/html/rfc4035#section-5
+// DNS over TCP: https://tools.ietf.org/html/rfc7766
 
-#include <thread>
 #include <iterator>
 #include <memory>
 #include <iostream>
@@ -17,562 +18,1455 @@
 #include <tuple>
 #include <bitset>
 #include <cstring>
+#include <cstdlib>
 #include <algorithm>
 #include <unordered_map>
-
-// posix headers
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <unistd.h>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <chrono>
+#include <thread>
 
 // project headers
 #include "haredns_def.hpp"
-//#include "haredns_sec.hpp"
-
-struct dns
+#include "haredns_wire.hpp"
+#include "haredns_cache.hpp"
+#include "haredns_infra.hpp"
+#include "haredns_task.hpp"
+#include "haredns_engine.hpp"
+#include "haredns_server.hpp"
+#include "haredns_sec.hpp"
+
+// Recursive resolver on an engine, written as coroutines: every lookup,
+// including those of glueless nameservers, is a task suspended on the
+// engine while it waits for the network, so one thread interleaves any
+// number of them for the price of a coroutine frame each.
+class dns_resolver
 {
-    struct header
-    {
-        std::uint16_t _id;
-        std::uint16_t _control;
-        std::uint16_t _question;
-        std::uint16_t _answer;
-        std::uint16_t _authority;
-        std::uint16_t _additional;
+public:
+    using result = std::pair<std::set<ipv4>, error_type>;
 
-        void to_htons()
-        {
-            _id        = htons(_id);
-            _control   = htons(_control);
-            _question  = htons(_question);
-            _answer    = htons(_answer);
-            _authority = htons(_authority);
-            _additional= htons(_additional);
-        }
+private:
+    static constexpr int MAX_CNAME_HOPS = 8;
+    static constexpr int MAX_NS_DEPTH   = 4; // lookups of glueless NS or CNAME targets for lookups of...
 
-        void to_ntohs()
-        {
-            _id        = ntohs(_id);
-            _control   = ntohs(_control);
-            _question  = ntohs(_question);
-            _answer    = ntohs(_answer);
-            _authority = ntohs(_authority);
-            _additional= ntohs(_additional);
-        }
-
-        bool ok() const { return get_error_code() == error_type::noerror; }
-        auto get_error_code() const -> error_type { return static_cast<error_type>(0b0000'0000'00001111 & _control); };
-    };
-    header _header{};
-    std::vector<std::uint8_t> _body;
-
-    enum class control_code : std::uint16_t {
-        QR     = 1,      // 1 bit // Query or Response    // 0 -> request, 1 -> response
-        OPCODE = QR + 4, // 4 bits// Message Purpose      // 0 -> QUERY, ...
-        AA,              // 1 bit // Authoritative Answer // 0 -> cache, 1 -> authoritative
-        TC,              // 1 bit // Truncated            // 0 -> false, 1 -> true
-        RD,              // 1 bit // Recursion Desired    // 0 -> iterative, 1 -> recursive
-        RA,              // 1 bit // Recursion Available  // 0 -> not recursive, 1 -> recursive (server support)
-        Z,               // 1 bit // Zeros
-        AD,              // 1 bit // Authenticated data   // DNSSEC
-        CD,              // 1 bit // Checking Disabled    // DNSSEC
-        RCODE = CD + 4   // 4 bits// Error Codes          // See enum class return_code
+    // what an exchange waits on: a response, or the time to hedge
+    struct reply
+    {
+        ipv4 _server = 0;
+        dns_message_view _message;
+        error_type _error = error_type::plain;
+        std::uint32_t _hedge_tick = 0; // non-zero: no response, time to hedge
     };
 
-    dns() = default;
-    dns(std::vector<std::uint8_t> & raw_response)
+    rrset_cache & _cache; // may be shared with resolvers on other threads
+    delegation_cache _delegations;
+    engine _engine;
+    hedge_policy _hedging;
+    std::ostream & _log;
+
+    auto ask(std::shared_ptr<mailbox<reply>> box, ipv4 server, std::string host, query_type query, bool hedge) -> detached
     {
-        std::memcpy(&_header, raw_response.data(), sizeof(header));
-        _header.to_ntohs();
-        raw_response.erase(raw_response.begin(), std::next(raw_response.begin(), sizeof(header)));
-        std::swap(_body, raw_response);
+        auto && [message, error] = co_await _engine.async_query(server, std::move(host), query, hedge);
+        box->send(reply{server, std::move(message), error, 0});
     }
 
-
-    template<typename ... OtherCodes>
-    void set(int val, control_code const & cc, OtherCodes && ... codes)
+    auto hedge_at(std::shared_ptr<mailbox<reply>> box, engine_clock::time_point when, std::uint32_t tick) -> detached
     {
-        _header._control |= val << (16 - static_cast<std::uint16_t>(cc));
-
-        if constexpr (sizeof...(OtherCodes) > 0)
-            set(val, std::forward<OtherCodes>(codes)...);
+        co_await _engine.sleep_until(when);
+        box->send(reply{0, {}, error_type::plain, tick});
     }
 
-    void set_query(std::string const & host, query_type qt)
+    // Sends the question to 'servers[next]' and, while no answer comes back
+    // within about its p90 RTT, hedges to the servers after it as the hedge
+    // policy allows. The first answer wins; the other queries run on only as
+    // RTT samples. A SERVFAIL, REFUSED or NOTIMP is no answer, only a server
+    // that failed, like one that timed out: the others in flight are waited
+    // for. Yields the answer and the server that gave it, or a recoverable
+    // error once every query failed; 'next' is left at the first server not
+    // asked yet.
+    auto exchange(std::string host, query_type query, std::vector<ipv4> const & servers, std::size_t & next)
+        -> task<std::tuple<dns_message_view, error_type, ipv4>>
     {
-        _body = to_dns_format(host);
-        _header._question = 1;
-        _header._id = static_cast<std::uint16_t>(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+        auto box = std::make_shared<mailbox<reply>>();
+        std::size_t outstanding = 0;
+        std::uint32_t tick = 0;
+        auto send = [&] (bool hedge) {
+            ipv4 const server = servers[next++];
+            if (hedge)
+                _log << "[[hedg]] " << host << " @" << ip_to_string(server) << "\n";
+            ask(box, server, host, query, hedge);
+            outstanding++;
+            hedge_at(box, engine_clock::now() + _engine.infra().hedge_after(server), ++tick);
+        };
+
+        send(false);
+        while (outstanding > 0)
+        {
+            reply r = co_await box->receive();
+            if (r._hedge_tick != 0)
+            {
+                if (r._hedge_tick == tick and next < servers.size() and outstanding < _hedging._fan_out
+                    and _engine.hedges() < _hedging._max_outstanding)
+                    send(true);
+                continue;
+            }
 
-        std::size_t size = _body.size();
-        _body.insert(_body.end(), { 0, 0, 0, 0 });
+            outstanding--;
+            if (r._error != error_type::noerror)
+            {
+                _log << "timeout @" << ip_to_string(r._server) << "\n";
+                continue; // the others still in flight keep their chance
+            }
 
-        std::uint8_t * end = _body.data() + size;
-        std::uint16_t query_val = htons(static_cast<std::uint16_t>(qt));
-        std::memcpy(end, &query_val, sizeof query_val);
+            if (not r._message.ok())
+            {
+                // keep the message, an NXDOMAIN carries the SOA to cache it by
+                error_type const rcode = r._message.header().get_error_code();
+                _log << r._message.header();
+                if (rcode == error_type::servfail or rcode == error_type::refused or rcode == error_type::notimp)
+                {
+                    _log << "lame @" << ip_to_string(r._server) << "\n";
+                    continue;
+                }
+                co_return std::make_tuple(std::move(r._message), rcode, r._server);
+            }
+            _log << r._message.header() << "\n";
 
-        end += sizeof query_val;
-        std::uint16_t in_addr = htons(static_cast<std::uint16_t>(1 /* IN */));
-        std::memcpy(end, &in_addr, sizeof in_addr);
+            if (not r._message.complete())
+                co_return std::make_tuple(dns_message_view{}, error_type::plain, r._server);
 
-        // EDNS(0) and OPT pseudo-RR
-        _header._additional = 1;
-        size = _body.size();
-        _body.insert(_body.end(), { 0,          // NAME  -> ROOT
-                                    0, 0,       // TYPE  -> quert_type::OPT
-                                    0, 0,       // CLASS -> sender's UDP payload size
-                                    0, 0, 0, 0, // TTL   -> extended RCODE and flags
-                                    0, 0 });    // RDLEN -> describes RDATA
-        end = _body.data() + size + 1;
+            for (resource_record rr: r._message.answers())
+                _log << "[[log ansr]] " << rr << "\n";
 
-        std::uint16_t opt = htons(static_cast<std::uint16_t>(query_type::OPT));
-        std::memcpy(end, &opt, sizeof opt);
-        end += sizeof opt;
+            for (resource_record rr: r._message.authorities())
+                _log << "[[log auth]] " << rr << "\n";
 
-        std::uint16_t udp_size = htons(MAX_UDP_PAYLOAD_SIZE);
-        std::memcpy(end, &udp_size, sizeof udp_size);
-        end += sizeof udp_size;
+            for (resource_record rr: r._message.additionals())
+                _log << "[[log addi]] " << rr << "\n";
 
-        // set 'extended RCODE and flags'. DO bit is on the first bit of 3rd bytes
-        // see https://tools.ietf.org/html/rfc6891#section-6.1.3
-        end += 2;
-        *end = 1 << 7;
+            co_return std::make_tuple(std::move(r._message), error_type::noerror, r._server);
+        }
+        co_return std::make_tuple(dns_message_view{}, error_type::timeout, ipv4{0});
     }
 
-    auto create_packet() -> std::vector<std::uint8_t>
+    // The end of the CNAME chain from 'name' in the answer of 'message',
+    // followed only through 'zone', the zone of the server that sent it
+    static auto chain_end(dns_message_view const & message, wire_name name, wire_name const & zone) -> wire_name
     {
-        std::vector<std::uint8_t> packet(sizeof(header));
-        header h = _header;
-        h.to_htons();
-        std::memcpy(packet.data(), &h, sizeof(header));
-        std::copy(_body.begin(), _body.end(), std::back_inserter(packet));
-        return packet;
+        for (int hops = 0; hops < MAX_CNAME_HOPS and is_subdomain(name, zone); hops++)
+        {
+            bool followed = false;
+            for (resource_record rr : message.answers())
+                if (wire_name owner; rr.type() == query_type::CNAME and rr.name(owner) and owner == name)
+                {
+                    followed = rr.rd_name(0, name) != 0;
+                    break;
+                }
+            if (not followed)
+                break;
+        }
+        return name;
     }
 
-    bool ok() const { return _header.ok(); }
+    // Caches an NXDOMAIN (type == NXDOMAIN_TYPE) or NODATA response from a
+    // server of 'zone' under the name it is about: the end of the CNAME
+    // chain in the answer, if any.
+    void cache_negative(dns_message_view const & message, wire_name const & name, query_type type, wire_name const & zone)
+    {
+        _cache.insert_negative(chain_end(message, name, zone), type, message.authorities(), zone);
+    }
 
-    static
-    auto to_dns_format(std::string host) -> std::vector<std::uint8_t>
+    static auto to_addresses(rrset const & set) -> std::set<ipv4>
     {
-        if (host.back() != '.')
-            host += '.';
-        std::vector<std::uint8_t> buf;
+        std::set<ipv4> addresses;
+        set.for_each([&addresses](byte_span rd) {
+            if (rd.size() == sizeof(ipv4))
+                addresses.insert(readnet<std::uint32_t>(rd.begin()));
+        });
+        return addresses;
+    }
 
-        for (auto it = host.begin(); it != host.end();)
-        {
-            auto dot = std::find(it, host.end(), '.');
-            buf.push_back(std::distance(it, dot));
-            std::copy(it, dot, std::back_inserter(buf));
-            it = std::next(dot);
-        }
-        buf.push_back('\0');
-        return buf;
+    // the addresses of a glueless nameserver, looked up in the background
+    struct ns_addresses
+    {
+        wire_name _name;
+        std::set<ipv4> _addresses; // empty if the lookup failed
+    };
+
+    auto lookup_ns(std::shared_ptr<mailbox<ns_addresses>> box, wire_name name, int depth) -> detached
+    {
+        auto && [addresses, error] = co_await recursive_resolve(name.to_string(), query_type::A, {}, {}, depth);
+        if (error != error_type::noerror)
+            addresses.clear();
+        box->send(ns_addresses{name, std::move(addresses)});
     }
 
-    auto readptrname(std::size_t raw_offset) const -> std::string
+public:
+    explicit dns_resolver(rrset_cache & cache, hedge_policy hedging = {},
+                          engine_options transport = {}, std::ostream & log = std::cout):
+        _cache{cache}, _engine{transport}, _hedging{hedging}, _log{log} {}
+
+    auto get_engine() -> engine & { return _engine; }
+    auto cache() -> rrset_cache & { return _cache; }
+
+    // Asks every root server for the root NS set at once so the infra table
+    // knows their RTTs before the first real query.
+    void prime_roots()
     {
-        auto it = _body.begin();
-        std::advance(it, (raw_offset - sizeof(_header)));
-        auto [name, _] = readname(it);
-        return name;
+        std::size_t pending = root_dns.size();
+        for (ipv4 root : root_dns)
+            _engine.query(root, ".", query_type::NS, [&pending] (dns_message_view &&, error_type) { pending--; });
+        _engine.run_until([&pending] { return pending == 0; });
+
+        infra_table & infra = _engine.infra();
+        for (ipv4 root : infra.order(root_dns))
+            _log << "[[prim]] " << ip_to_string(root) << "\t"
+                 << infra.srtt(root).count() / 1000.0 << " ms\n";
     }
 
-    template<typename Iterator>
-    auto readname(Iterator it) const -> std::pair<std::string, Iterator>
+    // co_await yields -> std::set<ipv4>, error_type
+    // Without 'dns_servers' the query starts at the closest cached zone cut,
+    // falling back to the root when none of its servers work. 'zone' is the
+    // zone 'dns_servers' are authoritative for: referrals must go below it,
+    // and nothing they say about names outside of it is cached or answered
+    // with. A CNAME out of it is followed from the zone it leads to.
+    // 'depth' counts the lookups, of glueless nameservers and of such CNAME
+    // targets, this one is nested in.
+    auto recursive_resolve(std::string host,
+                           query_type query,
+                           std::set<ipv4> dns_servers = {},
+                           wire_name zone = {},
+                           int depth = 0)
+        -> task<result>
     {
-        static_assert(sizeof (*it) == 1); // expect std::uint8_t
+        if (host.empty() or host.back() != '.')
+            host += '.';
+
+        wire_name qname;
+        if (not parse_name(host, qname))
+            co_return result{{}, error_type::formerr};
 
-        // has compression label
-        if (*it & 0b11000000)
+        // answer from cache, following cached CNAMEs, without touching the network
+        for (int hops = 0; hops < MAX_CNAME_HOPS; hops++)
         {
-            std::uint16_t name_ptr = readnet<std::uint16_t>(it);
-            std::uint16_t offset   = name_ptr & 0b0011'1111'11111111;
-            return {readptrname(offset), it};
+            if (auto nx = _cache.lookup_nxdomain(qname); nx)
+            {
+                _log << "[[cach]] " << qname << "\tNXDOMAIN\t" << nx->_TTL << "\n";
+                co_return result{{}, error_type::nxdomain};
+            }
+
+            if (auto cached = _cache.lookup(qname, query); cached)
+            {
+                std::set<ipv4> rep;
+                if (query == query_type::A)
+                    rep = to_addresses(*cached);
+                _log << "[[cach]] " << qname << "\t" << query << "\t" << cached->_TTL << "\t";
+                if (cached->negative())
+                    _log << "NODATA\n";
+                else
+                    _log << cached->_count << " record(s)\n";
+                co_return result{rep, error_type::noerror};
+            }
+
+            if (query == query_type::CNAME)
+                break;
+            auto alias = _cache.lookup(qname, query_type::CNAME);
+            if (not alias)
+                break;
+
+            _log << "[[cach]] " << qname << "\t" << query_type::CNAME << "\t" << alias->_TTL << "\t";
+            alias->for_each([&qname](byte_span rd) { read_name(rd.data(), rd.size(), 0, qname); });
+            _log << qname << "\n";
+            host = qname.to_string();
         }
-        else if (*it == 0)
-            return {"", std::next(it)};
-        else
+
+        if (dns_servers.empty())
         {
-            using namespace std::literals;
-            std::string hostname, follow;
-            std::uint8_t size = *it;
+            // the DS of a zone lives in its parent (RFC 4035 section 3.1.4.1)
+            wire_name start = qname;
+            if (query == query_type::DS)
+                start.to_parent();
+            if (delegation const * cut = _delegations.closest(start))
+            {
+                _log << "[[zone]] starting at " << cut->_zone << "\n";
+                wire_name const cut_zone = cut->_zone;
+                auto && [ans, error] = co_await recursive_resolve(host, query, cut->addresses(), cut_zone, depth);
+                if (error != error_type::plain)
+                    co_return result{ans, error};
+            }
+            co_return co_await recursive_resolve(host, query, root_dns, wire_name{}, depth);
+        }
 
-            std::copy_n(std::next(it), size, std::back_inserter(hostname));
-            std::advance(it, size + 1);
-            std::tie(follow, it) = readname(it);
+        std::vector<ipv4> const ordered = _engine.infra().order(dns_servers);
+        for (std::size_t next = 0; next < ordered.size(); )
+        {
+            _log << "Query [" << host << "] @" << ip_to_string(ordered[next]) << "\n";
+            auto && [message, error, dns_server] = co_await exchange(host, query, ordered, next);
+            if (error == error_type::nxdomain)
+                cache_negative(message, qname, NXDOMAIN_TYPE, zone);
+            if (is_fatal(error))
+                co_return result{{}, error};
+            else if (error != error_type::noerror)
+                continue;
+
+            _cache.insert(message.answers(), trust::answer, zone);
+
+            // an answer expanded from a wildcard, as its RRSIG's label count
+            // tells, comes with the proof that no closer name exists
+            for (resource_record rr : message.answers())
+                if (wire_name owner; rr.type() == query_type::RRSIG and rr.rd_size() >= 4 and rr.name(owner) and
+                    rr.rd_data().begin()[3] < owner._labels)
+                    _cache.insert_wildcard_proof(owner, rrset_cache::covered_type(rr), message.authorities(), zone);
+
+            {
+                bool is_final = false;
+                for (resource_record rr : message.authorities())
+                {
+                    if (wire_name owner; rr.type() == query_type::SOA and rr.name(owner) and is_subdomain(owner, zone))
+                    {
+                        _log << "[[auth]] " << rr << "\n";
+                        is_final = true;
+                    }
+                }
+                if (is_final)
+                {
+                    cache_negative(message, qname, query, zone);
+                    co_return result{{}, error_type::noerror};
+                }
+            }
 
-            hostname.append("."s + follow);
-            return {hostname, it};
+            _cache.insert(message.authorities(), trust::authority, zone);
+            _cache.insert(message.additionals(), trust::glue, zone);
+
+            if (not message.answers().empty())
+            {
+                // what the chain from the name leads to, as far as it stays in the zone
+                wire_name const end = (query == query_type::CNAME) ? qname : chain_end(message, qname, zone);
+                std::set<ipv4> rep;
+                bool answered = false;
+                for (resource_record rr: message.answers())
+                {
+                    _log << "[[ansr]] " << rr << "\n";
+                    if (wire_name owner; rr.type() == query and rr.name(owner) and owner == end and is_subdomain(owner, zone))
+                    {
+                        answered = true;
+                        if (ipv4 ip; rr.rd_data_as_ip(ip))
+                            rep.insert(ip);
+                    }
+                }
+
+                if (not answered and end != qname and not is_subdomain(end, zone) and depth < MAX_NS_DEPTH)
+                {
+                    _log << "[[cnam]] " << end << " is outside " << zone << "\n";
+                    co_return co_await recursive_resolve(end.to_string(), query, {}, {}, depth + 1);
+                }
+                co_return result{rep, error_type::noerror};
+            }
+
+            auto cut = _delegations.insert(message, zone);
+            if (not cut)
+                continue; // lame or out of bailiwick, ask the next server
+            message = dns_message_view{}; // all cached: its slab goes back to the pool while we descend
+
+            std::vector<delegation::nameserver> nameservers;
+            if (delegation const * d = _delegations.get(*cut))
+                nameservers = d->_servers;
+
+            // all glued servers at once, so the query can hedge among them
+            std::set<ipv4> glued;
+            for (delegation::nameserver const & ns : nameservers)
+                glued.insert(ns._addresses.begin(), ns._addresses.end());
+            if (not glued.empty())
+            {
+                auto && [ans, error] = co_await recursive_resolve(host, query, glued, *cut, depth);
+                if (is_fatal(error))
+                    co_return result{{}, error};
+                else if (error == error_type::noerror)
+                    co_return result{ans, error};
+            }
+
+            // the rest have no glue: look them all up at once and go on
+            // with whichever comes back first
+            auto box = std::make_shared<mailbox<ns_addresses>>();
+            std::size_t waiting = 0;
+            for (delegation::nameserver const & ns : nameservers)
+            {
+                if (not ns._addresses.empty() or is_subdomain(ns._name, *cut))
+                    continue; // already asked, or needs glue we did not get
+
+                if (auto cached = _cache.lookup(ns._name, query_type::A, trust::glue); cached and not cached->negative())
+                    box->send(ns_addresses{ns._name, to_addresses(*cached)});
+                else if (depth < MAX_NS_DEPTH)
+                    lookup_ns(box, ns._name, depth + 1);
+                else
+                    continue;
+                waiting++;
+            }
+
+            for (; waiting > 0; waiting--)
+            {
+                auto [ns_name, next_dns_server] = co_await box->receive();
+                for (ipv4 ip : glued)
+                    next_dns_server.erase(ip); // already asked
+                if (next_dns_server.empty())
+                    continue;
+
+                _log << "using dns: " << ns_name << " [";
+                for (ipv4 ip : next_dns_server)
+                    _log << " " << ip_to_string(ip);
+                _log << " ]\n";
+
+                if (auto addresses = _cache.lookup(ns_name, query_type::A, trust::glue); addresses)
+                    _delegations.insert_addresses(*cut, ns_name, next_dns_server, addresses->_TTL);
+
+                auto && [ans, error] = co_await recursive_resolve(host, query, next_dns_server, *cut, depth);
+                if (is_fatal(error))
+                    co_return result{{}, error};
+                else if (error == error_type::noerror)
+                    co_return result{ans, error};
+            }
         }
+        co_return result{{}, error_type::plain};
     }
 };
 
-auto operator << (std::ostream& os, dns::header const & h) -> std::ostream&
+// Validates what the resolver leaves in the cache against the DNSSEC chain
+// of trust (RFC 4035 section 5): from a trust anchor down through the DS
+// and DNSKEY rrsets at every zone cut above a name, to the RRSIGs over its
+// answer or the NSEC/NSEC3 records that deny it. The DS and DNSKEY rrsets
+// of every ancestor are asked for at once, alongside the answer, so a cold
+// chain costs about the time of its slowest lookup, not one round trip
+// per zone.
+class dns_validator
 {
-    os << "id: "         << h._id         << "\n"
-       << "control: "    << std::bitset<16>(h._control) << "\n"
-       << "question: "   << h._question   << "\n"
-       << "answer: "     << h._answer     << "\n"
-       << "authority: "  << h._authority  << "\n"
-       << "additional: " << h._additional << "\n";
-    return os;
-}
+    static constexpr int MAX_CNAME_HOPS = 8;
+    static constexpr int MAX_POOL_ROUNDS = 4;
 
-struct resource_record
-{
-    std::string   _name;
-    query_type    _query_type;
-    std::uint16_t _class_type;
-    std::uint32_t _TTL;
-    std::uint16_t _rd_size;
-    std::vector<std::uint8_t> _rd_data;
-    std::shared_ptr<dns> _response;
+    // a zone the chain reached, with its keys once they are trusted
+    struct zone
+    {
+        wire_name _name;
+        std::optional<rrset> _keys;
+        security _status = security::indeterminate;
+    };
+
+    using fetched = std::optional<dns_resolver::result>; // only the answer has one
 
-    template<typename Iterator,
-             std::enable_if_t<is_iterator_v<Iterator>, int> =0>
-    resource_record(Iterator & it, std::shared_ptr<dns> response): _response{response}
+    // a signature for the pool to check, and what it found
+    struct pool_check
     {
-        std::tie(_name, it) = response->readname(it);
+        std::shared_ptr<prepared_key const> _key;
+        std::vector<std::uint8_t> _data;
+        std::vector<std::uint8_t> _signature;
+        verified_cache::digest _digest;
+        std::uint32_t _expiration;
+        bool _holds = false;
+    };
 
-        _query_type = readnet<query_type>(it);
-        _class_type = readnet<std::uint16_t>(it);
-        _TTL        = readnet<std::uint32_t>(it);
-        _rd_size    = readnet<std::uint16_t>(it);
+    dns_resolver & _resolver;
+    std::vector<trust_anchor> _anchors;
+    // chain lookups in flight, by rrset key, with the boxes waiting on each:
+    // queries for the same zones start together and would ask alike
+    std::unordered_map<std::string, std::vector<std::shared_ptr<mailbox<fetched>>>> _fetching;
+    mutable key_cache _keys;
+    mutable verified_cache _verified;
+    mutable denial_cache _denials;
+    work_pool * _pool; // nullptr: signatures are checked inline
+    mutable std::vector<pool_check> * _gathering = nullptr; // a dry run is on
+
+    static auto spans(rrset const & set) -> std::vector<byte_span>
+    {
+        std::vector<byte_span> parts;
+        set.for_each([&parts] (byte_span rd) { parts.push_back(rd); });
+        return parts;
+    }
 
-        std::copy_n (it, _rd_size, std::back_inserter(_rd_data));
-        std::advance(it, _rd_size);
+    static auto now() -> std::uint32_t
+    {
+        return static_cast<std::uint32_t>(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
     }
 
-    auto show_rd_data(std::ostream & os = std::cout) const -> std::ostream&
+    auto fetch_answer(std::shared_ptr<mailbox<fetched>> box, std::string host, query_type type) -> detached
     {
-        switch(_query_type)
-        {
-        case query_type::A:
+        box->send(co_await _resolver.recursive_resolve(std::move(host), type));
+    }
+
+    auto fetch(std::shared_ptr<mailbox<fetched>> box, wire_name name, query_type type) -> detached
+    {
+        std::string const key = make_rrset_key(name, type, 1);
+        if (auto it = _fetching.find(key); it != _fetching.end())
         {
-            std::uint32_t ip = readnet<std::uint32_t>(_rd_data.begin()); // the IP
-            os << ip_to_string(ip);
-            break;
+            it->second.push_back(std::move(box));
+            co_return;
         }
-        case query_type::NS:
+        _fetching[key].push_back(std::move(box));
+        co_await _resolver.recursive_resolve(name.to_string(), type);
+        auto waiting = _fetching.extract(key);
+        for (auto & b : waiting.mapped())
+            b->send(std::nullopt);
+    }
+
+    // Starts the lookups of the DNSKEY and DS rrsets at 'name' and above
+    // that are not cached yet: all a chain down to it can be made of.
+    // Returns how many it started.
+    auto fetch_chain(std::shared_ptr<mailbox<fetched>> const & box, wire_name name) -> std::size_t
+    {
+        rrset_cache & cache = _resolver.cache();
+        std::size_t started = 0;
+        for (;; name.to_parent())
         {
-            auto [name, _] = _response->readname(_rd_data.begin());
-            os << name;
-            break;
+            // no cut at an alias or a name that does not exist
+            if (not cache.lookup_nxdomain(name) and not cache.lookup(name, query_type::CNAME))
+                for (query_type type : {query_type::DNSKEY, query_type::DS})
+                    if ((type != query_type::DS or not name.is_root()) and not cache.lookup(name, type))
+                    {
+                        fetch(box, name, type);
+                        started++;
+                    }
+            if (name.is_root())
+                return started;
         }
-        case query_type::CNAME:
+    }
+
+    // verify_rrset by a key of 'zone', whose DNSKEY rrset has 'key_ttl'
+    // left; keys made and signatures checked are remembered. In a dry run a
+    // signature not checked yet is gathered for the pool and taken to hold.
+    bool verify(wire_name const & zone, std::uint32_t key_ttl, wire_name const & owner, query_type type,
+                std::vector<byte_span> const & rdatas, rrsig const & sig, byte_span sig_rdata, dnskey const & key) const
+    {
+        std::uint32_t const at = now();
+        if (not rrsig_applies(owner, type, sig, key, at))
+            return false;
+        std::vector<std::uint8_t> data = signed_data(sig, sig_rdata, owner, type, 1, rdatas);
+        verified_cache::digest d = verified_cache::make_digest(key, data, sig._signature);
+        if (auto known = _verified.find(d, at); known)
+            return *known;
+        auto const prepared = _keys.get(zone, key, key_ttl, at);
+        if (not prepared)
+            return false;
+
+        if (_gathering)
         {
-            os << "CNAME";
-            break;
+            if (std::none_of(_gathering->begin(), _gathering->end(), [&d] (pool_check const & c) { return c._digest == d; }))
+                _gathering->push_back({prepared, std::move(data), {sig._signature.begin(), sig._signature.end()},
+                                       std::move(d), sig._expiration});
+            return true;
         }
-        case query_type::AAAA:
+        bool const holds = verify_signature(*prepared, data, sig._signature);
+        _verified.insert(std::move(d), holds, sig._expiration, at);
+        return holds;
+    }
+
+    // whether an RRSIG by 'z' over the 'type' rrset of 'owner' holds; its
+    // label count goes to 'labels'
+    bool signed_by(zone const & z, wire_name const & owner, query_type type, std::vector<byte_span> const & rdatas,
+                   std::uint8_t * labels = nullptr) const
+    {
+        auto sigs = _resolver.cache().lookup_signatures(owner, type);
+        if (not sigs or not z._keys)
+            return false;
+
+        std::vector<byte_span> const keys = spans(*z._keys);
+        for (byte_span sig_rdata : spans(*sigs))
         {
-            if constexpr (is_big_endian())
-                for (auto it = _rd_data.begin(); it != _rd_data.end(); std::advance(it, 1))
-                    os << std::dec << std::setw(1) << static_cast<int>(*it) << ":";
-            else
-                for (auto it = _rd_data.rbegin(); it != _rd_data.rend(); std::advance(it, 1))
-                    os << std::dec << std::setw(1) << static_cast<int>(*it) << ":";
-            break;
+            rrsig sig;
+            if (not parse_rrsig(sig_rdata, sig) or sig._signer != z._name)
+                continue;
+            for (byte_span key_rdata : keys)
+                if (dnskey key; parse_dnskey(key_rdata, key) and key._tag == sig._key_tag and
+                    verify(z._name, z._keys->_TTL, owner, type, rdatas, sig, sig_rdata, key))
+                {
+                    if (labels)
+                        *labels = sig._labels;
+                    return true;
+                }
         }
-        case query_type::SOA:
+        return false;
+    }
+
+    // The DNSKEYs of 'name', trusted if a DS in 'ds' matches one of them that
+    // signed them all. Only DS records of algorithms we do not know make the
+    // zone insecure (RFC 4035 section 5.2).
+    auto trust_keys(wire_name const & name, std::vector<byte_span> const & ds) const -> zone
+    {
+        zone z{name, std::nullopt, security::bogus};
+        if (std::none_of(ds.begin(), ds.end(), usable_ds))
         {
-            auto [m_name, it2] = _response->readname(_rd_data.begin());
-            os << m_name << " ";
-            auto [r_name, it]  = _response->readname(it2);
-            os << r_name << " ";
-            for (int i = 0; i < 5; i++)
-                os << readnet<std::uint32_t>(it) << " ";
-            break;
+            z._status = security::insecure;
+            return z;
         }
-        case query_type::MX:
+
+        rrset_cache & cache = _resolver.cache();
+        auto keys = cache.lookup(name, query_type::DNSKEY);
+        auto sigs = cache.lookup_signatures(name, query_type::DNSKEY);
+        if (not keys)
+            z._status = security::indeterminate;
+        if (not keys or keys->negative() or not sigs)
+            return z;
+
+        std::vector<byte_span> const rdatas = spans(*keys);
+        for (byte_span key_rdata : rdatas)
         {
-            auto it = _rd_data.begin();
-            os << readnet<std::uint16_t>(it) << "\t";
-            auto [mailname, _]  = _response->readname(it);
-            os << mailname;
-            break;
+            dnskey key;
+            if (not parse_dnskey(key_rdata, key) or
+                std::none_of(ds.begin(), ds.end(), [&] (byte_span d) { return usable_ds(d) and ds_matches(name, key_rdata, d); }))
+                continue;
+            for (byte_span sig_rdata : spans(*sigs))
+                if (rrsig sig; parse_rrsig(sig_rdata, sig) and sig._signer == name and
+                    verify(name, keys->_TTL, name, query_type::DNSKEY, rdatas, sig, sig_rdata, key))
+                {
+                    z._keys = std::move(keys);
+                    z._status = security::secure;
+                    return z;
+                }
         }
-        case query_type::OPT:
+        return z;
+    }
+
+    // the records and the RRSIGs among the parts of 'set' from 'first' on,
+    // laid out as a negative entry keeps them after its SOA
+    static void split_parts(rrset const & set, std::size_t first,
+                            std::vector<denial_record> & records, std::vector<denial_record> & signatures)
+    {
+        std::vector<byte_span> const parts = spans(set);
+        for (std::size_t i = first; i < parts.size(); i++)
+            if (denial_record r; parse_negative_part(parts[i], r))
+                (r._type == query_type::RRSIG ? signatures : records).push_back(r);
+    }
+
+    // whether one of 'signatures' by 'z' over the single record 'r' holds
+    bool part_signed(zone const & z, denial_record const & r, std::vector<denial_record> const & signatures) const
+    {
+        std::vector<byte_span> const keys = z._keys ? spans(*z._keys) : std::vector<byte_span>{};
+        for (denial_record const & s : signatures)
         {
-            os << "exRCODE & flags: " << std::bitset<32>(_TTL);
-            break;
+            rrsig sig;
+            if (s._owner != r._owner or not parse_rrsig(s._rdata, sig) or sig._covered != r._type or sig._signer != z._name)
+                continue;
+            for (byte_span key_rdata : keys)
+                if (dnskey key; parse_dnskey(key_rdata, key) and key._tag == sig._key_tag and
+                    verify(z._name, z._keys->_TTL, r._owner, r._type, {r._rdata}, sig, s._rdata, key))
+                    return true;
         }
-        case query_type::DS:
-        {
-            auto it      = _rd_data.begin();
-            auto key_tag = readnet<std::uint16_t>(it);
-            auto algo    = readnet<dnssec_algorithm>(it);
-            auto digest_type = readnet<std::uint8_t>(it); // 0 -> Reserved, 1 -> SHA-1, other: NotIMP
+        return false;
+    }
 
-            os << key_tag << " " << +algo << " " << +digest_type << " ";
-            os << "size: " << std::distance(it, _rd_data.end()) << " ";
-            break;
+    // the NSEC and NSEC3 records kept in 'set' (a negative entry, or a
+    // wildcard proof with 'first' 0) whose RRSIGs by 'z' hold
+    auto checked_proof(zone const & z, rrset const & set, std::size_t first = 2) const -> std::vector<denial_record>
+    {
+        std::vector<denial_record> records, signatures, checked;
+        split_parts(set, first, records, signatures);
+        for (denial_record const & r : records)
+            if (part_signed(z, r, signatures))
+                checked.push_back(r);
+        return checked;
+    }
+
+    // whether the SOA a negative entry starts with is signed by 'z': only
+    // then is its owner the zone the denial comes from
+    bool soa_signed(zone const & z, rrset const & negative) const
+    {
+        std::vector<byte_span> const parts = spans(negative);
+        denial_record soa;
+        if (parts.size() < 2 or read_name(parts[0].data(), parts[0].size(), 0, soa._owner) == 0)
+            return false;
+        soa._type  = query_type::SOA;
+        soa._rdata = parts[1];
+
+        std::vector<denial_record> records, signatures;
+        split_parts(negative, 2, records, signatures);
+        return part_signed(z, soa, signatures);
+    }
+
+    // A positive answer: signed by 'z', and when its RRSIG shows it was
+    // expanded from a wildcard, kept with the proof that no closer name
+    // exists, so no record that does was hidden behind the wildcard
+    auto check_positive(zone const & z, wire_name const & name, query_type type, rrset const & set) const -> security
+    {
+        std::uint8_t labels = 0;
+        if (not signed_by(z, name, type, spans(set), &labels))
+            return security::bogus;
+        bool const literal = name._data[0] == 1 and name._data[1] == '*'; // the wildcard itself was asked for
+        if (labels >= name._labels or (literal and labels + 1 == name._labels))
+            return security::secure;
+
+        auto proof = _resolver.cache().lookup_wildcard_proof(name, type);
+        if (not proof)
+            return security::bogus;
+        switch (prove_no_closer(z._name, name, labels, checked_proof(z, *proof, 0)))
+        {
+        case denial::nxdomain:   return security::secure;
+        case denial::too_costly: return security::insecure;
+        default:                 return security::bogus;
         }
-        case query_type::RRSIG:
+    }
+
+    // The zone 'name' is in, walking down from the deepest trust anchor
+    // above it: its keys when every link holds, or where and why the chain
+    // stops. What it needs must be cached (fetch_chain).
+    auto find_zone(wire_name const & name) const -> zone
+    {
+        rrset_cache & cache = _resolver.cache();
+        std::vector<wire_name> path{name};
+        while (not path.back().is_root())
         {
-            auto it      = _rd_data.begin();
-            auto covered = readnet<query_type>(it);
-            auto algo    = readnet<dnssec_algorithm>(it);
-            auto labels  = readnet<std::uint8_t> (it);
-            auto oTTL    = readnet<std::uint32_t>(it);
-
-            auto sig_exp = readnet<std::uint32_t>(it);
-            auto sig_inc = readnet<std::uint32_t>(it);
-            auto key_tag = readnet<std::uint16_t>(it);
-
-            std::string signer_name;
-            std::tie(signer_name, it) = _response->readname(it);
-
-            os << +covered << " "
-               << +algo << " "
-               << std::bitset<8>(labels)  << " "
-               << oTTL << " "
-               << sig_exp << " "
-               << sig_inc << " "
-               << key_tag << " "
-               << signer_name;
-            std::vector<std::uint8_t> sig;
-            std::copy(it, _rd_data.end(), std::back_inserter(sig));
-            os << " size: " << std::distance(it, _rd_data.end()) << " ";
-            break;
+            path.push_back(path.back());
+            path.back().to_parent();
         }
-        case query_type::DNSKEY:
+
+        zone z{{}, std::nullopt, security::insecure}; // no anchor above
+        for (auto it = path.rbegin(); it != path.rend(); ++it)
         {
-            // https://tools.ietf.org/html/rfc4034#section-2.1
-            auto it       = _rd_data.begin();
-            auto flags    = readnet<std::uint16_t>(it);
-            auto protocal = readnet<std::uint8_t>(it); // must be 3
-            auto algo     = readnet<dnssec_algorithm>(it);
-
-            os << std::bitset<16>(flags) << " "
-               << +protocal << " "
-               << +algo << " ";
-            std::vector<std::uint8_t> exponent, modulus;
-            std::uint16_t length = 0;
-            if (*it == 0)
-                length = readnet<std::uint16_t>(it);
-            else
+            wire_name const & at = *it;
+            std::vector<byte_span> anchored;
+            for (trust_anchor const & anchor : _anchors)
+                if (anchor._zone == at)
+                    anchored.push_back({anchor._ds.data(), anchor._ds.size()});
+            if (not anchored.empty())
             {
-                length = *it;
-                std::advance(it, 1);
+                z = trust_keys(at, anchored);
+                if (z._status != security::secure)
+                    return z;
+                continue;
             }
-            std::copy_n(it, length, std::back_inserter(exponent));
-            std::advance(it, length);
-            std::copy(it, _rd_data.end(), std::back_inserter(modulus));
-            break;
+            if (z._status != security::secure)
+                continue;
+
+            if (auto nx = cache.lookup_nxdomain(at); nx)
+            {
+                // nothing from here down, no cut either
+                switch (prove_denial(z._name, at, NXDOMAIN_TYPE, checked_proof(z, *nx)))
+                {
+                case denial::nxdomain:   return z;
+                case denial::opt_out:
+                case denial::too_costly: return {at, std::nullopt, security::insecure};
+                default:                 return {z._name, std::nullopt, security::bogus};
+                }
+            }
+
+            auto ds = cache.lookup(at, query_type::DS);
+            if (not ds)
+            {
+                if (cache.lookup(at, query_type::CNAME))
+                    return z; // an alias is no cut, and has nothing below it
+                return {at, std::nullopt, security::indeterminate};
+            }
+            if (ds->negative())
+            {
+                bool cut = false;
+                switch (prove_denial(z._name, at, query_type::DS, checked_proof(z, *ds), &cut))
+                {
+                case denial::nodata:
+                    if (cut)
+                        return {at, std::nullopt, security::insecure};
+                    continue;
+                case denial::nxdomain:   return z;
+                case denial::opt_out:
+                case denial::too_costly: return {at, std::nullopt, security::insecure};
+                default:                 return {z._name, std::nullopt, security::bogus};
+                }
+            }
+
+            std::vector<byte_span> const records = spans(*ds);
+            if (not signed_by(z, at, query_type::DS, records))
+                return {z._name, std::nullopt, security::bogus};
+            z = trust_keys(at, records);
+            if (z._status != security::secure)
+                return z;
         }
-        default:
-            os << "enum: [" << _query_type << "] Not Impl";
-            break;
+        return z;
+    }
+
+    // The zone the 'type' answer at 'name' claims to come from: the signer of
+    // its RRSIGs, or the owner of the SOA of a denial; 'name' without either
+    auto signer_of(wire_name const & name, query_type type) const -> wire_name
+    {
+        rrset_cache & cache = _resolver.cache();
+        auto set = cache.lookup_nxdomain(name);
+        if (not set)
+            set = cache.lookup(name, type);
+        if (set and set->negative())
+        {
+            wire_name owner;
+            std::vector<byte_span> const parts = spans(*set);
+            if (read_name(parts.front().data(), parts.front().size(), 0, owner) != 0 and is_subdomain(name, owner))
+                return owner;
         }
-        return os;
+        else if (set)
+            if (auto sigs = cache.lookup_signatures(name, type); sigs)
+                for (byte_span sig_rdata : spans(*sigs))
+                    if (rrsig sig; parse_rrsig(sig_rdata, sig) and is_subdomain(name, sig._signer))
+                        return sig._signer;
+        return name;
     }
 
-    auto rd_data_as_ip() const -> ipv4
+    // the names of the CNAME chain from 'name', as the server follows it, with
+    // the type asked for at each
+    auto cname_chain(wire_name name, query_type type) const -> std::vector<std::pair<wire_name, query_type>>
     {
-        if (_query_type == query_type::A)
-            return readnet<std::uint32_t>(_rd_data.begin());
+        rrset_cache & cache = _resolver.cache();
+        std::vector<std::pair<wire_name, query_type>> chain;
+        for (int hops = 0; hops < MAX_CNAME_HOPS; hops++)
+        {
+            if (type == query_type::CNAME or cache.lookup_nxdomain(name) or cache.lookup(name, type))
+                break;
+            auto alias = cache.lookup(name, query_type::CNAME);
+            if (not alias or alias->negative())
+                break;
+            chain.emplace_back(name, query_type::CNAME);
+            alias->for_each([&name] (byte_span rd) { read_name(rd.data(), rd.size(), 0, name); });
+        }
+        chain.emplace_back(name, type);
+        return chain;
+    }
 
-        std::cerr << "Warning: query A on rd_data_as_ip\n";
-        return 0;
+    // RFC 8198: caches the denial of 'type' at 'name' that the NSEC or NSEC3
+    // records of denials proven before make, so it is answered without
+    // asking, and validated like one that was asked for. Not for DS, which
+    // the zone above a cut denies, while the spans are those of the zone
+    // below when both are known.
+    void synthesize(wire_name const & name, query_type type) const
+    {
+        rrset_cache & cache = _resolver.cache();
+        if (type == query_type::DS or cache.lookup_nxdomain(name) or cache.lookup(name, type) or
+            cache.lookup(name, query_type::CNAME))
+            return;
+        denial_cache::proof const p = _denials.prove(name, type, now());
+        if (p._result == denial::nxdomain)
+            cache.insert_negative(name, NXDOMAIN_TYPE, p._TTL, p._parts);
+        else if (p._result == denial::nodata)
+            cache.insert_negative(name, type, p._TTL, p._parts);
     }
 
-    auto rd_data_as_hostname() const -> std::string
+    // One link of check_answer: 'set', what the cache holds for 'asked' at
+    // 'name' on the way to 'type' (NXDOMAIN_TYPE when the name is denied)
+    auto check_link(wire_name const & name, query_type type, query_type asked, rrset const & set) const -> security
     {
-        auto [name, _] = _response->readname(_rd_data.begin());
-        return name;
+        wire_name const signer = signer_of(name, type);
+        zone const z = find_zone(signer);
+        if (z._status != security::secure)
+            return z._status;
+        if (z._name != signer)
+            return security::bogus; // signed by, or denied from, something that is no zone
+        if (not set.negative())
+            return check_positive(z, name, asked, set);
+
+        // a denial that holds is kept to deny other names with, unless this
+        // is a dry run, which only takes its signatures to hold
+        if (not soa_signed(z, set))
+            return security::bogus;
+        std::vector<denial_record> const checked = checked_proof(z, set);
+        denial const d = prove_denial(z._name, name, asked, checked);
+        if (d == denial::opt_out or d == denial::too_costly)
+            return security::insecure;
+        if (d != (asked == NXDOMAIN_TYPE ? denial::nxdomain : denial::nodata))
+            return security::bogus;
+        if (not _gathering)
+            _denials.insert(z._name, set, checked, now());
+        return security::secure;
     }
-};
 
-auto operator << (std::ostream& os, resource_record const & h) -> std::ostream&
-{
-    os << h._name << "\t" << h._query_type << "\t" << h._TTL << "\t";
-    return h.show_rd_data(os);
-}
+    // Validates what the cache holds for 'type' at 'name', following CNAMEs
+    // as the server answers: each rrset with the keys of the zone that signed
+    // it, a denial with its NSEC or NSEC3 proof. The worst of them all.
+    // Outside a dry run each rrset checked is marked with what it proved to
+    // be, on the very entry that was checked; a bogus one is dropped, so
+    // the next query fetches it again.
+    auto check_answer(wire_name const & name, query_type type) const -> security
+    {
+        rrset_cache & cache = _resolver.cache();
+        for (auto const & [at, t] : cname_chain(name, type))
+        {
+            query_type asked = NXDOMAIN_TYPE;
+            std::optional<rrset> set = cache.lookup_nxdomain(at);
+            if (not set)
+                set = cache.lookup(at, asked = t);
+            if (not set)
+                return security::indeterminate;
+
+            security const status = check_link(at, t, asked, *set);
+            if (not _gathering)
+            {
+                std::string const key = make_rrset_key(at, asked, 1);
+                if (status == security::secure)
+                    cache.validated(key, *set, validation::secure);
+                else if (status == security::insecure)
+                    cache.validated(key, *set, validation::insecure);
+                else if (status == security::bogus)
+                    cache.validated(key, *set, std::nullopt);
+            }
+            if (status != security::secure)
+                return status;
+        }
+        return security::secure;
+    }
 
-class dns_resolver
-{
-    std::unordered_map<std::string, std::set<ipv4>> _dns_cache;
-    int _socket_fd;
 public:
-
-    dns_resolver()
+    explicit dns_validator(dns_resolver & resolver, std::vector<trust_anchor> anchors = root_trust_anchors(),
+                           work_pool * pool = nullptr):
+        _resolver{resolver}, _anchors{std::move(anchors)}, _pool{pool} {}
+
+    // co_await yields -> dns_resolver::result, security
+    // Resolves like dns_resolver::recursive_resolve, then validates the
+    // answer left in the cache. A name the spans of earlier denials prove
+    // absent is denied from them without asking. The chain above the name
+    // is looked up along with the answer; what else the zones that signed
+    // it need (a name that is a zone apex, a CNAME into another zone) once
+    // the answer shows them.
+    // With a pool, the signatures are checked on it, off this thread:
+    // check_answer is dry run to gather those it needs, each taken to hold.
+    // One found not to may send the next dry run elsewhere, with checks of
+    // its own; once one gathers none, check_answer finds every outcome in
+    // _verified.
+    auto resolve(std::string host, query_type type) -> task<std::pair<dns_resolver::result, security>>
     {
-        _socket_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-        timeval tv {
-            .tv_sec  = 5 /* second */,
-            .tv_usec = 0,
-        };
-        setsockopt(_socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        if (host.empty() or host.back() != '.')
+            host += '.';
+        wire_name name;
+        if (not parse_name(host, name))
+            co_return std::make_pair(dns_resolver::result{{}, error_type::formerr}, security::indeterminate);
+
+        synthesize(name, type);
+        auto box = std::make_shared<mailbox<fetched>>();
+        fetch_answer(box, host, type);
+        wire_name above = name;
+        above.to_parent();
+        dns_resolver::result r;
+        for (std::size_t waiting = 1 + fetch_chain(box, above); waiting > 0; waiting--)
+            if (fetched f = co_await box->receive(); f)
+                r = std::move(*f);
+
+        std::size_t waiting = 0;
+        for (auto const & [at, t] : cname_chain(name, type))
+            if (wire_name const signer = signer_of(at, t); find_zone(signer)._status == security::indeterminate)
+                waiting += fetch_chain(box, signer);
+        for (; waiting > 0; waiting--)
+            co_await box->receive();
+
+        for (int round = 0; _pool and round < MAX_POOL_ROUNDS; round++)
+        {
+            std::vector<pool_check> checks;
+            _gathering = &checks;
+            check_answer(name, type);
+            _gathering = nullptr;
+            if (checks.empty())
+                break;
+
+            std::vector<work_pool::job> jobs;
+            for (pool_check & c : checks)
+                jobs.push_back([&c] { c._holds = verify_signature(*c._key, c._data, {c._signature.data(), c._signature.size()}); });
+            co_await _resolver.get_engine().offload(*_pool, std::move(jobs));
+            for (pool_check & c : checks)
+                _verified.insert(std::move(c._digest), c._holds, c._expiration, now());
+        }
+        co_return std::make_pair(std::move(r), check_answer(name, type));
     }
+};
 
-    ~dns_resolver() { close(_socket_fd); }
+// One worker of the server: a resolver, so an engine, of its own and its own
+// SO_REUSEPORT UDP and TCP sockets on the listening address, all run from
+// one thread; the rrset cache is shared with the other workers. Queries are
+// answered from the cache when they can, otherwise once the resolver has
+// iterated to the answer, which it leaves in the cache. Each response is
+// also kept whole in a packet cache of the worker's own, which answers the
+// same question next time without building anything.
+class dns_server
+{
+    // a TCP client: what it sent that is not a whole query yet, and what is
+    // not written back yet
+    struct connection
+    {
+        int _fd;
+        std::vector<std::uint8_t> _in;
+        std::vector<std::uint8_t> _out;
+        std::size_t _answering = 0;
+        bool _writing = false;  // waiting for EPOLLOUT
+        bool _paused = false;   // not reading, MAX_PIPELINED queries in hand
+        bool _finished = false; // the client is done sending
+        timer_wheel::timer_id _idle = 0;
+    };
 
-    auto resolve(std::string host, query_type query, ipv4 dnsserver)
-        -> std::tuple<std::vector<resource_record>, std::vector<resource_record>, std::vector<resource_record>, error_type>
+    static constexpr int MAX_CNAME_HOPS = 8;
+    static constexpr std::size_t MAX_CONNECTIONS = 256; // per worker
+    static constexpr std::size_t MAX_PIPELINED = 16;    // queries answered at once per connection
+    static constexpr std::chrono::seconds TCP_IDLE{10};
+
+    std::ostream _quiet{nullptr};
+    dns_resolver _resolver;
+    dns_validator _validator;
+    packet_cache _packets;
+    std::vector<std::uint8_t> _hit; // a packet_cache answer, reused
+    std::array<std::uint8_t, MAX_TCP_MESSAGE_SIZE> _response; // built here, then sent
+    int _udp = -1;
+    int _tcp = -1;
+    std::uint64_t _last_connection = 0;
+    std::unordered_map<std::uint64_t, connection> _connections;
+
+    static void add_negative(message_builder & out, rrset const & set)
     {
-        sockaddr_in addr{}; // for g++ convention. wait until c++20. No nested designated initialization yet.
-        addr.sin_family = AF_INET;
-        addr.sin_port   = htons(53);
-        addr.sin_addr.s_addr = htonl(dnsserver);
+        std::vector<byte_span> parts; // owner of the SOA, its RDATA, the proof
+        set.for_each([&parts] (byte_span rd) { parts.push_back(rd); });
+        if (parts.size() < 2)
+            return;
+        wire_name owner;
+        if (read_name(parts[0].data(), parts[0].size(), 0, owner) != 0)
+            out.add(message_builder::section::authority, owner, query_type::SOA, 1, set._TTL, parts[1]);
+    }
 
-        {
-            dns d;
-            d.set_query(host, query);
-            d.set(1, dns::control_code::AD, dns::control_code::CD, dns::control_code::RD);
-            std::cout << d._header << "\n";
-            std::vector<std::uint8_t> p {d.create_packet()};
+    // Resolves 'request', validating the answer unless the client does that
+    // itself (CD)
+    auto resolve(dns_request const & request) -> task<std::pair<dns_resolver::result, security>>
+    {
+        if (request.checking_disabled())
+            co_return std::make_pair(co_await _resolver.recursive_resolve(request._name.to_string(), request._type),
+                                     security::indeterminate);
+        co_return co_await _validator.resolve(request._name.to_string(), request._type);
+    }
 
-            if (sendto(_socket_fd, p.data(), p.size(), 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
-            {
-                perror("sendto failed: ");
-                return {{}, {}, {}, error_type::plain};
-            }
-        }
+    // The response to 'request' from the cache, following CNAMEs; from
+    // 'r' itself where nothing could be cached. AD is set for a client that
+    // asked for DNSSEC (DO or AD) when every rrset served was validated
+    // secure, as the entries looked up here say, whatever other workers did
+    // to the cache since 'status' was found. A bogus answer is a SERVFAIL
+    // (RFC 4035 section 5.5). Built in _response, no larger than 'limit';
+    // returns its size.
+    auto respond(dns_request const & request, dns_resolver::result const & r, security status, std::size_t limit)
+        -> std::size_t
+    {
+        if (status == security::bogus)
+            return start_response(request, error_type::servfail, _response.data(), limit).finish();
+
+        rrset_cache & cache = _resolver.cache();
+        bool authentic = request._dnssec_ok or request.authentic_data();
+        message_builder out = start_response(request, error_type::noerror, _response.data(), limit);
+        auto finish = [&] (rrset const & served) {
+            out.set_authentic(authentic and served._validation == validation::secure);
+            return out.finish();
+        };
 
-        std::shared_ptr<dns> response {nullptr};
+        wire_name name = request._name;
+        for (int hops = 0; hops < MAX_CNAME_HOPS; hops++)
         {
-            std::vector<std::uint8_t> buf(MAX_UDP_PAYLOAD_SIZE);
-            socklen_t len = sizeof addr;
-
-            if (recvfrom(_socket_fd, buf.data(), buf.size(), 0, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+            if (auto nx = cache.lookup_nxdomain(name); nx)
             {
-                perror("recvfrom failed: ");
-                return {{}, {}, {}, error_type::timeout};
+                out.set_rcode(error_type::nxdomain);
+                add_negative(out, *nx);
+                return finish(*nx);
             }
-
-            // parsing dns packet
-            response = std::make_shared<dns>(buf);
-            if (not response->ok())
+            if (auto set = cache.lookup(name, request._type); set)
             {
-                std::cout << response->_header;
-                return {{}, {}, {}, response->_header.get_error_code()};
+                if (set->negative())
+                    add_negative(out, *set);
+                else
+                    set->for_each([&] (byte_span rd) {
+                        out.add(message_builder::section::answer, name, request._type, 1, set->_TTL, rd);
+                    });
+                return finish(*set);
             }
-            std::cout << response->_header << "\n";
+            if (request._type == query_type::CNAME)
+                break;
+            auto alias = cache.lookup(name, query_type::CNAME);
+            if (not alias or alias->negative())
+                break;
+
+            authentic = authentic and alias->_validation == validation::secure;
+            wire_name target;
+            alias->for_each([&] (byte_span rd) {
+                out.add(message_builder::section::answer, name, query_type::CNAME, 1, alias->_TTL, rd);
+                read_name(rd.data(), rd.size(), 0, target);
+            });
+            name = target;
         }
 
-        // read questions
-        auto it = response->_body.begin();
-        for (int i = 0; i < response->_header._question; i++)
+        switch (r.second)
         {
-            std::tie(std::ignore, it) = response->readname(it); // read name and update 'it'
-            readnet<std::uint16_t>(it); // query_type
-            readnet<std::uint16_t>(it); // class
+        case error_type::noerror:
+            for (ipv4 ip : r.first)
+            {
+                std::uint32_t const rd = htonl(ip);
+                out.add(message_builder::section::answer, name, query_type::A, 1, 0,
+                        byte_span{reinterpret_cast<std::uint8_t const *>(&rd), sizeof rd});
+            }
+            break;
+        case error_type::nxdomain:
+            out.set_rcode(error_type::nxdomain);
+            break;
+        default:
+            out.set_rcode(error_type::servfail);
         }
+        return out.finish();
+    }
 
-        // read answers
-        std::vector<resource_record> answers;
-        for (int i = 0; i < response->_header._answer; i++)
-            answers.emplace_back(it, response);
-
-        // read authorities
-        std::vector<resource_record> authorities;
-        for (int i = 0; i < response->_header._authority; i++)
-            authorities.emplace_back(it, response);
+    // Requests answered without resolving anything: the response in
+    // _response and its size, or 0.
+    auto refuse(dns_request const & request, error_type parsed, std::size_t limit) -> std::size_t
+    {
+        if (parsed == error_type::noerror and request._class == 1 and
+            request._type != query_type::AXFR and request._type != query_type::IXFR)
+            return 0;
+        error_type const rcode = (parsed == error_type::noerror) ? error_type::notimp : parsed;
+        return start_response(request, rcode, _response.data(), limit).finish();
+    }
 
-        // read additionals
-        std::vector<resource_record> additional;
-        for (int i = 0; i < response->_header._additional; i++)
-            additional.emplace_back(it, response);
+    auto answer_udp(dns_request request, sockaddr_in from) -> detached
+    {
+        auto [r, status] = co_await resolve(request);
+        std::size_t size = respond(request, r, status, MAX_TCP_MESSAGE_SIZE);
+        _packets.store(request, {_response.data(), size}); // whole, for TCP and larger payload sizes
+        if (size > request.udp_limit())
+            size = respond(request, r, status, request.udp_limit());
+        sendto(_udp, _response.data(), size, 0, reinterpret_cast<sockaddr*>(&from), sizeof from);
+    }
 
+    void on_udp()
+    {
+        std::array<std::uint8_t, MAX_UDP_PAYLOAD_SIZE> buf;
+        for (;;)
+        {
+            sockaddr_in from{};
+            socklen_t len = sizeof from;
+            ssize_t const received = recvfrom(_udp, buf.data(), buf.size(), MSG_DONTWAIT,
+                                              reinterpret_cast<sockaddr*>(&from), &len);
+            if (received < 0)
+                return;
+            if (_packets.answer(buf.data(), received, false, _hit))
+            {
+                sendto(_udp, _hit.data(), _hit.size(), 0, reinterpret_cast<sockaddr*>(&from), sizeof from);
+                continue;
+            }
 
-        for (resource_record & rr: answers)
-            std::cout << "[[log ansr]] " << rr << "\n";
+            dns_request request;
+            error_type const parsed = parse_request(buf.data(), received, request);
+            if (parsed == error_type::plain)
+                continue;
+            if (std::size_t const size = refuse(request, parsed, request.udp_limit()); size > 0)
+            {
+                sendto(_udp, _response.data(), size, 0, reinterpret_cast<sockaddr*>(&from), sizeof from);
+                continue;
+            }
+            answer_udp(std::move(request), from);
+        }
+    }
 
-        for (resource_record & rr: authorities)
-            std::cout << "[[log auth]] " << rr << "\n";
+    auto answer_tcp(dns_request request, std::uint64_t id) -> detached
+    {
+        auto [r, status] = co_await resolve(request);
+        auto it = _connections.find(id);
+        if (it == _connections.end())
+            co_return; // gone meanwhile
+        it->second._answering--;
+        bool const paused = it->second._paused;
+        byte_span const packet{_response.data(), respond(request, r, status, MAX_TCP_MESSAGE_SIZE)};
+        _packets.store(request, packet);
+        send_tcp(id, packet);
+        if (not _connections.count(id))
+            co_return;
+        touch(id);
+        if (paused)
+            answer_queued(id); // below the cap again: take what waited
+    }
 
-        for (resource_record & rr: additional)
-            std::cout << "[[log addi]] " << rr << "\n";
+    void on_accept()
+    {
+        for (;;)
+        {
+            int const fd = accept4(_tcp, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            if (_connections.size() >= MAX_CONNECTIONS)
+            {
+                close(fd);
+                continue;
+            }
 
-        return std::make_tuple(std::move(answers), std::move(authorities), std::move(additional), error_type::noerror);
+            std::uint64_t const id = ++_last_connection;
+            _connections.emplace(id, connection{fd, {}, {}, 0, false, false, false, 0});
+            _resolver.get_engine().watch(fd, EPOLLIN | EPOLLRDHUP, [this, id] (std::uint32_t events) { on_tcp(id, events); });
+            touch(id);
+        }
     }
 
-    // This function will return -> std::set<ipv4>, error_type
-    auto recursive_resolve(std::string host,
-                           query_type query,
-                           std::set<ipv4> const & dns_servers = root_dns)
-        -> std::pair<std::set<ipv4>, error_type>
+    // restarts the idle timeout of connection 'id'; one still being
+    // answered gets another round
+    void touch(std::uint64_t id)
     {
-        if (host.back() != '.')
-            host += '.';
+        connection & c = _connections.at(id);
+        engine & e = _resolver.get_engine();
+        e.cancel(c._idle);
+        c._idle = e.schedule(engine_clock::now() + TCP_IDLE, [this, id] {
+            auto it = _connections.find(id);
+            if (it == _connections.end())
+                return;
+            if (it->second._answering == 0)
+                drop(id);
+            else
+                touch(id);
+        });
+    }
 
-        if (auto it = _dns_cache.find(host); it != _dns_cache.end())
-            return {it->second, error_type::noerror};
+    void drop(std::uint64_t id)
+    {
+        auto it = _connections.find(id);
+        if (it == _connections.end())
+            return;
+        engine & e = _resolver.get_engine();
+        e.cancel(it->second._idle);
+        e.unwatch(it->second._fd);
+        close(it->second._fd);
+        _connections.erase(it);
+    }
 
-        for (ipv4 dns_server : dns_servers)
+    void on_tcp(std::uint64_t id, std::uint32_t events)
+    {
+        auto it = _connections.find(id);
+        if (it == _connections.end())
+            return;
+        connection & c = it->second;
+        if (events & (EPOLLERR | EPOLLHUP))
+            return drop(id);
+
+        if (events & EPOLLIN)
         {
-            std::cout << "Query [" << host << "] @" << ip_to_string(dns_server) << "\n";
-            auto&& [ans, auth, addi, error] = resolve(host, query, dns_server);
-            if (is_fatal(error))
-                return {{}, error};
-            else if (error != error_type::noerror)
-                continue;
-
+            std::array<std::uint8_t, 4096> buf;
+            for (;;)
             {
-                bool is_final = false;
-                for (resource_record & rr : auth)
-                {
-                    if (rr._query_type == query_type::SOA)
-                    {
-                        std::cout << "[[auth]] " << rr << "\n";
-                        is_final = true;
-                    }
-                }
-                if (is_final)
-                    return {{}, error_type::noerror};
+                ssize_t const n = recv(c._fd, buf.data(), buf.size(), MSG_DONTWAIT);
+                if (n == 0)
+                    c._finished = true;
+                if (n <= 0)
+                    break;
+                c._in.insert(c._in.end(), buf.data(), buf.data() + n);
             }
+            touch(id);
+            answer_queued(id);
+        }
 
-            for (resource_record & rr: addi)
-                if (rr._query_type == query_type::A)
-                    _dns_cache[rr._name].insert(rr.rd_data_as_ip());
+        if (events & EPOLLOUT)
+            send_tcp(id, {});
+        if (auto at = _connections.find(id); at != _connections.end())
+            if (at->second._finished and at->second._answering == 0 and at->second._out.empty())
+                drop(id);
+    }
 
-            if (not ans.empty())
+    // starts on every whole query read from connection 'id', each behind its
+    // two byte length, until MAX_PIPELINED are being answered; the rest wait
+    // in '_in' with reading paused
+    void answer_queued(std::uint64_t id)
+    {
+        auto it = _connections.find(id);
+        if (it == _connections.end())
+            return;
+        connection & c = it->second;
+        while (c._in.size() >= 2 and c._answering < MAX_PIPELINED)
+        {
+            std::size_t const size = readnet<std::uint16_t>(c._in.data());
+            if (c._in.size() < 2 + size)
+                break;
+            if (_packets.answer(c._in.data() + 2, size, true, _hit))
             {
-                std::set<ipv4> rep;
-                for (resource_record & rr: ans)
-                {
-                    std::cout << "[[ansr]] " << rr << "\n";
-                    if (rr._query_type == query_type::A)
-                        rep.insert(rr.rd_data_as_ip());
-                }
-
-                auto&& [ans, auth, addi, error] = resolve(host, query_type::DNSKEY, dns_server);
-
-                return {rep, error_type::noerror};
+                c._in.erase(c._in.begin(), c._in.begin() + 2 + size);
+                send_tcp(id, {_hit.data(), _hit.size()});
+                if (not _connections.count(id))
+                    return;
+                continue;
             }
+            dns_request request;
+            error_type const parsed = parse_request(c._in.data() + 2, size, request);
+            c._in.erase(c._in.begin(), c._in.begin() + 2 + size);
+            if (parsed == error_type::plain)
+                return drop(id);
+            if (std::size_t const refused = refuse(request, parsed, MAX_TCP_MESSAGE_SIZE); refused > 0)
+                send_tcp(id, {_response.data(), refused});
             else
             {
-                for (resource_record & rr: auth)
-                {
-                    std::cout << "using dns: " << rr.rd_data_as_hostname() << " [";
-                    auto && [next_dns_server, derror] =
-                        recursive_resolve(rr.rd_data_as_hostname(), query_type::A);
-
-                    if (is_fatal(derror))
-                        return {{}, derror};
-
-                    for (ipv4 ip : next_dns_server)
-                        std::cout << " " << ip_to_string(ip);
-                    std::cout << " ]\n";
-
-                    auto && [ans, error] = recursive_resolve(host, query, next_dns_server);
-                    if (is_fatal(error))
-                        return {{}, error};
-                    else if (error == error_type::noerror)
-                        return {ans, error};
-                }
+                c._answering++;
+                answer_tcp(std::move(request), id);
             }
+            if (not _connections.count(id))
+                return;
         }
-        return {{}, error_type::plain};
+        interest(id);
+    }
+
+    // queues 'message' on connection 'id' and writes what the socket takes
+    void send_tcp(std::uint64_t id, byte_span message)
+    {
+        auto it = _connections.find(id);
+        if (it == _connections.end())
+            return;
+        connection & c = it->second;
+        if (not message.empty())
+        {
+            c._out.push_back(message.size() >> 8);
+            c._out.push_back(message.size() & 0xff);
+            c._out.insert(c._out.end(), message.begin(), message.end());
+        }
+
+        std::size_t written = 0;
+        while (written < c._out.size())
+        {
+            ssize_t const n = send(c._fd, c._out.data() + written, c._out.size() - written, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 and (errno == EAGAIN or errno == EWOULDBLOCK))
+                break;
+            if (n < 0)
+                return drop(id);
+            written += n;
+        }
+        c._out.erase(c._out.begin(), c._out.begin() + written);
+
+        interest(id);
+        if (c._finished and c._answering == 0 and c._out.empty())
+            drop(id);
+    }
+
+    // watches connection 'id' for what it can take now: reads unless paused,
+    // writes while its output is blocked
+    void interest(std::uint64_t id)
+    {
+        connection & c = _connections.at(id);
+        bool const paused = c._answering >= MAX_PIPELINED;
+        bool const blocked = not c._out.empty();
+        if (paused == c._paused and blocked == c._writing)
+            return;
+        c._paused = paused;
+        c._writing = blocked;
+        std::uint32_t const events = (paused ? 0u : std::uint32_t{EPOLLIN | EPOLLRDHUP}) | (blocked ? std::uint32_t{EPOLLOUT} : 0u);
+        _resolver.get_engine().watch(c._fd, events, [this, id] (std::uint32_t events) { on_tcp(id, events); });
+    }
+
+public:
+    // 'cache' is shared by every worker; 'log' gets the resolver's trace,
+    // nullptr keeps it quiet
+    dns_server(sockaddr_in const & address, rrset_cache & cache, engine_options transport,
+               std::vector<trust_anchor> const & anchors, work_pool * verifiers, std::ostream * log = nullptr):
+        _resolver{cache, {}, transport, log ? *log : _quiet},
+        _validator{_resolver, anchors, verifiers},
+        _udp{listen_socket(address, SOCK_DGRAM)},
+        _tcp{listen_socket(address, SOCK_STREAM)} {}
+
+    dns_server(dns_server const &) = delete;
+    dns_server& operator = (dns_server const &) = delete;
+
+    ~dns_server()
+    {
+        while (not _connections.empty())
+            drop(_connections.begin()->first);
+        if (_udp >= 0)
+            close(_udp);
+        if (_tcp >= 0)
+            close(_tcp);
+    }
+
+    bool ok() const { return _udp >= 0 and _tcp >= 0; }
+
+    // serves until the process ends
+    void run()
+    {
+        _resolver.prime_roots();
+        engine & e = _resolver.get_engine();
+        e.watch(_udp, EPOLLIN, [this] (std::uint32_t) { on_udp(); });
+        e.watch(_tcp, EPOLLIN, [this] (std::uint32_t) { on_accept(); });
+        e.run();
     }
 };
 
+// ./run --serve [--listen address:port] [--threads n] [--verbose]
+int serve(int argc, char *argv[], engine_options transport, std::vector<trust_anchor> const & anchors)
+{
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port   = htons(53);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned verify_threads = threads;
+    bool verbose = false;
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string const arg = argv[i];
+        if (arg == "--listen" and i + 1 < argc and parse_endpoint(argv[i + 1], address))
+            i++;
+        else if (arg == "--threads" and i + 1 < argc and std::atoi(argv[i + 1]) > 0)
+            threads = std::atoi(argv[++i]);
+        else if (arg == "--verify-threads" and i + 1 < argc and std::atoi(argv[i + 1]) >= 0)
+            verify_threads = std::atoi(argv[++i]);
+        else if (arg == "--verbose")
+            verbose = true;
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " --serve [--listen address:port] [--threads n] [--verify-threads n] [--verbose]\n";
+            return 1;
+        }
+    }
+
+    // every worker binds before any starts, so a bad address fails at once;
+    // DNSSEC signatures are checked on a pool the workers share, or by each
+    // worker itself with --verify-threads 0
+    rrset_cache cache{64 << 20};
+    std::unique_ptr<work_pool> verifiers;
+    if (verify_threads > 0)
+        verifiers = std::make_unique<work_pool>(verify_threads);
+    std::vector<std::unique_ptr<dns_server>> servers;
+    for (unsigned i = 0; i < threads; i++)
+    {
+        servers.push_back(std::make_unique<dns_server>(address, cache, transport, anchors, verifiers.get(),
+                                                          verbose ? &std::cout : nullptr));
+        if (not servers.back()->ok())
+            return 1;
+    }
+    std::cerr << "serving on " << inet_ntoa(address.sin_addr) << ":" << ntohs(address.sin_port)
+              << " with " << threads << " thread(s), " << verify_threads << " verifying\n";
+
+    std::vector<std::thread> workers;
+    for (auto & server : servers)
+        workers.emplace_back([&server] { server->run(); });
+    for (std::thread & t : workers)
+        t.join();
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    dns_resolver resolver;
-    auto && [_, err] = resolver.recursive_resolve(argv[1], query_type::A);
-    if (err != error_type::noerror)
-        std::cout << "Error occurred: dns error code: " << err << "\n";
+    // HAREDNS_IO=io_uring picks the io_uring backend
+    engine_options transport;
+    if (char const * io = std::getenv("HAREDNS_IO"); io != nullptr and std::string{io} == "io_uring")
+        transport._backend = io_backend::io_uring;
+
+    // HAREDNS_BATCH=<n> moves up to n datagrams per sendmmsg/recvmmsg
+    if (char const * batch = std::getenv("HAREDNS_BATCH"); batch != nullptr and std::atoi(batch) > 0)
+        transport._batch = std::atoi(batch);
+
+    // HAREDNS_TRUST_ANCHOR="<zone> <key tag> <algorithm> <digest type> <digest>"
+    // replaces the root KSKs
+    std::vector<trust_anchor> anchors = root_trust_anchors();
+    if (char const * ds = std::getenv("HAREDNS_TRUST_ANCHOR"); ds != nullptr)
+    {
+        auto anchor = parse_trust_anchor(ds);
+        if (not anchor)
+        {
+            std::cerr << "bad HAREDNS_TRUST_ANCHOR: " << ds << "\n";
+            return 1;
+        }
+        anchors = {*anchor};
+    }
+
+    if (argc > 1 and std::string{argv[1]} == "--serve")
+        return serve(argc, argv, transport, anchors);
+
+    rrset_cache cache{16 << 20};
+    dns_resolver resolver{cache, {}, transport};
+    dns_validator validator{resolver, anchors};
+    resolver.prime_roots();
+    for (int i = 1; i < argc; i++)
+    {
+        std::string const host = argv[i];
+        spawn(validator.resolve(host, query_type::A), [host] (std::pair<dns_resolver::result, security> r) {
+            if (r.first.second != error_type::noerror)
+                std::cout << "Error occurred: " << host << ": dns error code: " << r.first.second << "\n";
+            std::cout << "[[dsec]] " << host << "\t" << r.second << "\n";
+        });
+    }
+    resolver.get_engine().run();
 }
@@ -0,0 +1,504 @@
+// Micro benchmarks. ./bench <name> [args]
+// udp [datagrams]:  loopback packets per second, one datagram per syscall
+//                   against sendmmsg/recvmmsg batches
+// backend [queries]: engine queries per second and per CPU second over
+//                   loopback, epoll against io_uring
+// cache [lookups] [threads]: rrset cache hits per second from 1 up to
+//                   'threads' threads, lock free against one global mutex
+// encode [queries]: ns per query packet, dns::set_query against
+//                   query_encoder
+// verify [count]:   DNSSEC signature verifications per second for each
+//                   algorithm, setting the key up every time against a
+//                   prepared_key
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+// posix headers
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <time.h>
+
+// project headers
+#include "haredns_def.hpp"
+#include "haredns_net.hpp"
+#include "haredns_wire.hpp"
+#include "haredns_cache.hpp"
+#include "haredns_engine.hpp"
+#include "haredns_sec.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+// a UDP socket on 127.0.0.1, on a port the kernel picks
+auto loopback_socket(sockaddr_in & addr) -> int
+{
+    int const fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int const size = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof addr;
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), len) < 0 or
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+    {
+        perror("bind failed: ");
+        std::exit(1);
+    }
+    return fd;
+}
+
+// Client and server on loopback: the client sends 'batch' queries, the
+// server reads and echoes them, the client reads the echoes. Returns
+// datagrams moved per second, counting both directions. A 'batch' of 1 is
+// sendto/recvfrom, one datagram per syscall, as the engine does by default.
+auto udp_round_trips(std::size_t datagrams, std::size_t batch) -> double
+{
+    sockaddr_in client_addr, server_addr;
+    int const client = loopback_socket(client_addr);
+    int const server = loopback_socket(server_addr);
+
+    dns d;
+    d.set_query("www.example.com", query_type::A);
+    std::vector<std::uint8_t> const packet {d.create_packet()};
+
+    std::size_t const burst = std::max<std::size_t>(batch, 32);
+    std::vector<outgoing> queries(burst, outgoing{packet, server_addr});
+    std::vector<outgoing> echoes(burst, outgoing{packet, client_addr});
+
+    buffer_pool pool;
+    std::vector<buffer_pool::buffer> buffers;
+    std::vector<sockaddr_in> from;
+
+    // reads 'count' datagrams from 'fd'
+    auto drain = [&] (int fd, std::size_t count) {
+        while (count > 0)
+            count -= receive_batch(fd, pool, std::min(batch, count), buffers, from);
+    };
+
+    // writes 'count' datagrams of 'out' to 'fd'
+    auto send = [&] (int fd, std::vector<outgoing> const & out, std::size_t count) {
+        send_batch(fd, out.data(), count, batch);
+    };
+
+    auto const start = bench_clock::now();
+    for (std::size_t done = 0; done < datagrams; done += burst)
+    {
+        send(client, queries, burst);
+        drain(server, burst);
+        send(server, echoes, burst);
+        drain(client, burst);
+    }
+    std::chrono::duration<double> const took = bench_clock::now() - start;
+
+    close(client);
+    close(server);
+    std::size_t const rounds = (datagrams + burst - 1) / burst;
+    return 2 * rounds * burst / took.count();
+}
+
+void bench_udp(std::size_t datagrams)
+{
+    double const single = udp_round_trips(datagrams, 1);
+    std::cout << std::left << std::setw(10) << "batch" << std::setw(14) << "pps" << "speedup\n"
+              << std::setw(10) << "1/syscall" << std::setw(14) << std::fixed << std::setprecision(0) << single
+              << "1.00\n";
+    for (std::size_t batch : {8, 32, 64})
+    {
+        double const pps = udp_round_trips(datagrams, batch);
+        std::cout << std::setw(10) << batch << std::setw(14) << std::setprecision(0) << pps
+                  << std::setprecision(2) << pps / single << "\n";
+    }
+}
+
+// answers every query sent to it with the query itself, QR set, until
+// 'stop'; on its own thread
+void echo_server(int fd, std::atomic<bool> const & stop)
+{
+    timeval tv{0, 50000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    constexpr std::size_t BATCH = 64;
+    std::vector<std::array<std::uint8_t, 512>> bufs(BATCH);
+    std::vector<sockaddr_in> from(BATCH);
+    std::vector<iovec> iovs(BATCH);
+    std::vector<mmsghdr> msgs(BATCH);
+    while (not stop)
+    {
+        for (std::size_t i = 0; i < BATCH; i++)
+        {
+            iovs[i] = { bufs[i].data(), bufs[i].size() };
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_name    = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof from[i];
+            msgs[i].msg_hdr.msg_iov     = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen  = 1;
+        }
+        int const n = recvmmsg(fd, msgs.data(), BATCH, MSG_WAITFORONE, nullptr);
+        if (n <= 0)
+            continue;
+        for (int i = 0; i < n; i++)
+        {
+            bufs[i][2] |= 0x80; // QR
+            iovs[i].iov_len = msgs[i].msg_len;
+        }
+        sendmmsg(fd, msgs.data(), n, 0);
+    }
+}
+
+// CPU time of the calling thread
+auto thread_cpu() -> double
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct backend_result
+{
+    double _qps;
+    double _per_cpu; // queries per CPU second of the engine's thread
+};
+
+// 'queries' through an engine on 'backend', 'window' in flight at a time,
+// against an echo server on loopback
+auto engine_queries(io_backend backend, std::size_t queries, std::size_t window) -> backend_result
+{
+    sockaddr_in server_addr;
+    int const server = loopback_socket(server_addr);
+    std::atomic<bool> stop{false};
+    std::thread responder{echo_server, server, std::cref(stop)};
+
+    engine_options options;
+    options._backend = backend;
+    options._server_port = ntohs(server_addr.sin_port);
+    engine e{options};
+
+    std::size_t sent = 0, answered = 0;
+    std::function<void()> next = [&] {
+        if (sent++ < queries)
+            e.query(INADDR_LOOPBACK, "www.example.com", query_type::A, [&] (dns_message_view &&, error_type error) {
+                if (error == error_type::noerror)
+                    answered++;
+                next();
+            });
+    };
+
+    auto const start = bench_clock::now();
+    double const cpu = thread_cpu();
+    for (std::size_t i = 0; i < window; i++)
+        next();
+    e.run_until([&] { return sent >= queries + window and e.inflight() == 0; });
+    std::chrono::duration<double> const took = bench_clock::now() - start;
+    double const used = thread_cpu() - cpu;
+
+    stop = true;
+    responder.join();
+    close(server);
+    if (answered < queries)
+        std::cerr << "  " << queries - answered << " queries unanswered\n";
+    return {answered / took.count(), answered / used};
+}
+
+void bench_backend(std::size_t queries)
+{
+    std::cout << std::left << std::setw(10) << "backend" << std::setw(14) << "qps" << "q/cpu-s\n";
+    for (io_backend backend : {io_backend::epoll, io_backend::io_uring})
+    {
+        backend_result const r = engine_queries(backend, queries, 256);
+        std::cout << std::setw(10) << (backend == io_backend::epoll ? "epoll" : "io_uring")
+                  << std::setw(14) << std::fixed << std::setprecision(0) << r._qps << r._per_cpu << "\n";
+    }
+}
+
+// 'threads' threads each looking up 'lookups' names, all cached, at once.
+// With 'serialized' every lookup takes one mutex, as a shared cache behind
+// a single lock would. Returns hits per second.
+auto cache_hits(rrset_cache const & cache, std::vector<wire_name> const & names,
+                std::size_t lookups, unsigned threads, bool serialized) -> double
+{
+    std::mutex global;
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> go{false};
+    std::atomic<std::size_t> hits{0};
+
+    auto worker = [&] (unsigned id) {
+        ready++;
+        while (not go)
+            std::this_thread::yield();
+
+        std::size_t found = 0;
+        for (std::size_t i = 0; i < lookups; i++)
+        {
+            wire_name const & name = names[(i * 7919 + id * 104729) % names.size()];
+            if (serialized)
+            {
+                std::lock_guard lock{global};
+                found += cache.lookup(name, query_type::A).has_value();
+            }
+            else
+                found += cache.lookup(name, query_type::A).has_value();
+        }
+        hits += found;
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < threads; i++)
+        pool.emplace_back(worker, i);
+    while (ready < threads)
+        std::this_thread::yield();
+
+    auto const start = bench_clock::now();
+    go = true;
+    for (std::thread & t : pool)
+        t.join();
+    std::chrono::duration<double> const took = bench_clock::now() - start;
+
+    if (hits != lookups * threads)
+        std::cerr << "  " << lookups * threads - hits << " lookups missed\n";
+    return hits / took.count();
+}
+
+void bench_cache(std::size_t lookups, unsigned max_threads)
+{
+    rrset_cache cache{64 << 20};
+    std::vector<wire_name> names;
+    for (int i = 0; i < 50000; i++)
+    {
+        wire_name name;
+        parse_name("host" + std::to_string(i) + ".example.com.", name);
+        std::vector<std::uint8_t> rdata { 0, 4, 192, 0, 2, static_cast<std::uint8_t>(i) };
+        cache.insert(name, query_type::A, 1, 3600, 1, std::move(rdata), trust::answer);
+        names.push_back(std::move(name));
+    }
+
+    std::cout << std::left << std::setw(10) << "threads" << std::setw(14) << "sharded" << std::setw(10) << "scaling"
+              << std::setw(14) << "mutex" << "scaling\n";
+    double sharded_one = 0, mutex_one = 0;
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+    {
+        double const sharded = cache_hits(cache, names, lookups, threads, false);
+        double const mutex   = cache_hits(cache, names, lookups, threads, true);
+        if (threads == 1)
+        {
+            sharded_one = sharded;
+            mutex_one   = mutex;
+        }
+        std::cout << std::setw(10) << threads << std::fixed
+                  << std::setw(14) << std::setprecision(0) << sharded
+                  << std::setw(10) << std::setprecision(2) << sharded / sharded_one
+                  << std::setw(14) << std::setprecision(0) << mutex
+                  << std::setprecision(2) << mutex / mutex_one << "\n";
+    }
+}
+
+void bench_encode(std::size_t queries)
+{
+    std::vector<std::string> hosts;
+    std::vector<wire_name> names;
+    for (int i = 0; i < 1024; i++)
+    {
+        hosts.push_back("host" + std::to_string(i) + ".example.com.");
+        names.emplace_back();
+        parse_name(hosts.back(), names.back());
+    }
+
+    // what the engine sent before, and what it sends now
+    std::size_t bytes = 0;
+    auto const start = bench_clock::now();
+    for (std::size_t i = 0; i < queries; i++)
+    {
+        dns d;
+        d.set_query(hosts[i % hosts.size()], query_type::A);
+        d.set(1, dns::control_code::AD, dns::control_code::CD, dns::control_code::RD);
+        bytes += d.create_packet().size();
+    }
+    auto const middle = bench_clock::now();
+
+    using encoder = query_encoder<flag_bit(dns::control_code::RD) | flag_bit(dns::control_code::AD) |
+                                  flag_bit(dns::control_code::CD)>;
+    for (std::size_t i = 0; i < queries; i++)
+    {
+        std::vector<std::uint8_t> packet(encoder::MAX_SIZE);
+        packet.resize(encoder::write(packet.data(), random_query_id(), names[i % names.size()], query_type::A));
+        bytes += packet.size();
+    }
+    auto const end = bench_clock::now();
+
+    std::chrono::duration<double, std::nano> const before = middle - start, after = end - middle;
+    std::cout << std::left << std::setw(14) << "encoder" << "ns/query\n" << std::fixed << std::setprecision(1)
+              << std::setw(14) << "set_query" << before.count() / queries << "\n"
+              << std::setw(14) << "query_encoder" << after.count() / queries << "\n";
+    if (bytes == 0)
+        std::cerr << "nothing encoded\n";
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+// a fresh key pair of 'algorithm', and the public key as a DNSKEY carries it
+auto dnssec_key(dnssec_algorithm algorithm, std::vector<std::uint8_t> & public_key) -> evp_key
+{
+    EVP_PKEY * pk = nullptr;
+    switch (algorithm)
+    {
+    case dnssec_algorithm::ECDSAP256SHA256: pk = EVP_PKEY_Q_keygen(nullptr, nullptr, "EC", "P-256"); break;
+    case dnssec_algorithm::ECDSAP384SHA384: pk = EVP_PKEY_Q_keygen(nullptr, nullptr, "EC", "P-384"); break;
+    case dnssec_algorithm::ED25519:         pk = EVP_PKEY_Q_keygen(nullptr, nullptr, "ED25519"); break;
+    case dnssec_algorithm::ED448:           pk = EVP_PKEY_Q_keygen(nullptr, nullptr, "ED448"); break;
+    default:                                pk = EVP_PKEY_Q_keygen(nullptr, nullptr, "RSA", std::size_t{2048}); break;
+    }
+    evp_key key{pk, EVP_PKEY_free};
+    public_key.clear();
+    if (not key)
+        return key;
+
+    std::size_t size = 0;
+    switch (algorithm)
+    {
+    case dnssec_algorithm::ECDSAP256SHA256:
+    case dnssec_algorithm::ECDSAP384SHA384:
+        public_key.resize(1 + 2 * 48);
+        EVP_PKEY_get_octet_string_param(pk, OSSL_PKEY_PARAM_PUB_KEY, public_key.data(), public_key.size(), &size);
+        public_key.resize(size);
+        public_key.erase(public_key.begin()); // the uncompressed point marker
+        break;
+    case dnssec_algorithm::ED25519:
+    case dnssec_algorithm::ED448:
+        public_key.resize(57);
+        size = public_key.size();
+        EVP_PKEY_get_raw_public_key(pk, public_key.data(), &size);
+        public_key.resize(size);
+        break;
+    default:
+    {
+        BIGNUM * e = nullptr;
+        BIGNUM * n = nullptr;
+        EVP_PKEY_get_bn_param(pk, OSSL_PKEY_PARAM_RSA_E, &e);
+        EVP_PKEY_get_bn_param(pk, OSSL_PKEY_PARAM_RSA_N, &n);
+        public_key.resize(1 + BN_num_bytes(e) + BN_num_bytes(n));
+        public_key[0] = BN_num_bytes(e);
+        BN_bn2bin(e, public_key.data() + 1);
+        BN_bn2bin(n, public_key.data() + 1 + BN_num_bytes(e));
+        BN_free(e);
+        BN_free(n);
+        break;
+    }
+    }
+    return key;
+}
+
+// 'data' signed with 'key', as an RRSIG carries the signature
+auto dnssec_sign(dnssec_algorithm algorithm, EVP_PKEY * key, std::vector<std::uint8_t> const & data) -> std::vector<std::uint8_t>
+{
+    EVP_MD_CTX * ctx = EVP_MD_CTX_new();
+    defer _free_ctx = [ctx] { EVP_MD_CTX_free(ctx); };
+    std::size_t size = 0;
+    if (EVP_DigestSignInit(ctx, nullptr, signature_digest(+algorithm), nullptr, key) != 1 or
+        EVP_DigestSign(ctx, nullptr, &size, data.data(), data.size()) != 1)
+        return {};
+    std::vector<std::uint8_t> signature(size);
+    if (EVP_DigestSign(ctx, signature.data(), &size, data.data(), data.size()) != 1)
+        return {};
+    signature.resize(size);
+    if (algorithm != dnssec_algorithm::ECDSAP256SHA256 and algorithm != dnssec_algorithm::ECDSAP384SHA384)
+        return signature;
+
+    // DER to r then s
+    std::size_t const half = (algorithm == dnssec_algorithm::ECDSAP256SHA256) ? 32 : 48;
+    std::uint8_t const * in = signature.data();
+    ECDSA_SIG * sig = d2i_ECDSA_SIG(nullptr, &in, signature.size());
+    defer _free_sig = [sig] { ECDSA_SIG_free(sig); };
+    std::vector<std::uint8_t> raw(2 * half);
+    if (sig == nullptr or BN_bn2binpad(ECDSA_SIG_get0_r(sig), raw.data(), half) < 0 or
+        BN_bn2binpad(ECDSA_SIG_get0_s(sig), raw.data() + half, half) < 0)
+        return {};
+    return raw;
+}
+
+void bench_verify(std::size_t count)
+{
+    // about what an RRSIG signs over a small rrset
+    std::vector<std::uint8_t> data(256);
+    for (std::size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<std::uint8_t>(i * 7);
+
+    std::pair<dnssec_algorithm, char const *> const algorithms[] = {
+        {dnssec_algorithm::RSASHA256,       "RSASHA256"},
+        {dnssec_algorithm::RSASHA512,       "RSASHA512"},
+        {dnssec_algorithm::ECDSAP256SHA256, "ECDSAP256"},
+        {dnssec_algorithm::ECDSAP384SHA384, "ECDSAP384"},
+        {dnssec_algorithm::ED25519,         "ED25519"},
+        {dnssec_algorithm::ED448,           "ED448"}};
+
+    std::cout << std::left << std::setw(12) << "algorithm" << std::setw(14) << "setup/verify"
+              << std::setw(14) << "prepared" << "speedup\n";
+    for (auto const & [algorithm, name] : algorithms)
+    {
+        std::vector<std::uint8_t> public_key;
+        evp_key const key = dnssec_key(algorithm, public_key);
+        std::vector<std::uint8_t> const signature = key ? dnssec_sign(algorithm, key.get(), data) : std::vector<std::uint8_t>{};
+        auto const prepared = prepare_key(+algorithm, {public_key.data(), public_key.size()});
+        if (signature.empty() or not prepared)
+        {
+            std::cout << std::setw(12) << name << "not supported\n";
+            continue;
+        }
+        byte_span const key_span{public_key.data(), public_key.size()}, sig_span{signature.data(), signature.size()};
+
+        std::size_t held = 0;
+        auto const start = bench_clock::now();
+        for (std::size_t i = 0; i < count; i++)
+            held += verify_signature(+algorithm, key_span, data, sig_span);
+        auto const middle = bench_clock::now();
+        for (std::size_t i = 0; i < count; i++)
+            held += verify_signature(*prepared, data, sig_span);
+        auto const end = bench_clock::now();
+
+        std::chrono::duration<double> const setup = middle - start, ready = end - middle;
+        std::cout << std::setw(12) << name << std::fixed << std::setprecision(0)
+                  << std::setw(14) << count / setup.count() << std::setw(14) << count / ready.count()
+                  << std::setprecision(2) << setup.count() / ready.count() << "\n";
+        if (held != 2 * count)
+            std::cerr << "  " << 2 * count - held << " verifications failed\n";
+    }
+}
+#else
+void bench_verify(std::size_t)
+{
+    std::cerr << "verify needs OpenSSL 3\n";
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    std::string const name = (argc > 1) ? argv[1] : "udp";
+    if (name == "udp")
+        bench_udp((argc > 2) ? std::stoul(argv[2]) : 200000);
+    else if (name == "backend")
+        bench_backend((argc > 2) ? std::stoul(argv[2]) : 100000);
+    else if (name == "cache")
+        bench_cache((argc > 2) ? std::stoul(argv[2]) : 200000,
+                    (argc > 3) ? std::stoul(argv[3]) : std::max(1u, std::thread::hardware_concurrency()));
+    else if (name == "encode")
+        bench_encode((argc > 2) ? std::stoul(argv[2]) : 2000000);
+    else if (name == "verify")
+        bench_verify((argc > 2) ? std::stoul(argv[2]) : 2000);
+    else
+    {
+        std::cerr << "usage: " << argv[0] << " udp|backend|cache|encode|verify [count] [threads]\n";
+        return 1;
+    }
+}
@@ -0,0 +1,722 @@
+#ifndef HAREDNS_CACHE_HPP_
+#define HAREDNS_CACHE_HPP_
+
+// TTL:          https://tools.ietf.org/html/rfc2181#section-8
+// Data ranking: https://tools.ietf.org/html/rfc2181#section-5.4.1
+// Negative:     https://tools.ietf.org/html/rfc2308
+// Glue:         https://tools.ietf.org/html/rfc1034#section-4.2.1
+// DNSSEC:       https://tools.ietf.org/html/rfc4035#section-4.5
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+#include "haredns_def.hpp"
+#include "haredns_wire.hpp"
+#include "haredns_epoch.hpp"
+
+using cache_clock = std::chrono::steady_clock;
+
+// How much an rrset can be believed, lowest first. A cached rrset is only
+// replaced by data of the same or higher trust until it expires.
+enum class trust : std::uint8_t
+{
+    glue      = 0, // additional section of a referral
+    authority = 1, // authority section (NS of a delegation)
+    answer    = 2, // answer section
+};
+
+// What validation made of a cached rrset. Data fetched for a query with CD
+// set, or not checked yet, is unchecked; bogus data is not kept. Unchecked
+// data never replaces checked data that has not expired.
+enum class validation : std::uint8_t
+{
+    unchecked = 0,
+    insecure  = 1, // provably unsigned
+    secure    = 2, // its signatures and the chain above them hold
+};
+
+// NXDOMAIN is cached per name, under a type no record can have
+constexpr query_type NXDOMAIN_TYPE = static_cast<query_type>(0);
+
+// The NSEC and NSEC3 records that came with an answer expanded from a
+// wildcard, under another (65535 is reserved), kept apart by the type of
+// the answer like RRSIGs
+constexpr query_type WILDCARD_PROOF_TYPE = static_cast<query_type>(65535);
+
+// (lowercased wire name, type, class) packed into one string. RRSIGs are
+// kept apart by the type they cover, as if it were part of their type, so
+// the signatures of one owner's rrsets never replace each other
+auto make_rrset_key(wire_name name, query_type type, std::uint16_t class_type,
+                    query_type covered = NXDOMAIN_TYPE) -> std::string
+{
+    name.to_lower();
+    std::string key(reinterpret_cast<char const *>(name.data()), name.size());
+    std::uint16_t const t = +type;
+    key.push_back(static_cast<char>(t >> 8));
+    key.push_back(static_cast<char>(t & 0xff));
+    key.push_back(static_cast<char>(class_type >> 8));
+    key.push_back(static_cast<char>(class_type & 0xff));
+    if (type == query_type::RRSIG or type == WILDCARD_PROOF_TYPE)
+    {
+        std::uint16_t const c = +covered;
+        key.push_back(static_cast<char>(c >> 8));
+        key.push_back(static_cast<char>(c & 0xff));
+    }
+    return key;
+}
+
+// A cache hit: every RDATA of the rrset (uncompressed, each prefixed by its
+// 16 bit length) and the TTL left on it. The RDATA is shared with the cache
+// entry and never changed, so a hit copies no records and outlives the entry.
+//
+// A negative hit (NXDOMAIN or NODATA) has no records; _rdata then holds the
+// owner name and the RDATA of the SOA that proved it, in that order, then
+// the NSEC, NSEC3 and RRSIG records that came with it (the DNSSEC proof),
+// each as its owner name, its type and its RDATA.
+struct rrset
+{
+    std::uint32_t _TTL = 0;
+    std::uint16_t _count = 0;
+    std::shared_ptr<std::vector<std::uint8_t> const> _rdata;
+    error_type _rcode = error_type::noerror;
+    validation _validation = validation::unchecked; // as of the lookup
+
+    bool negative() const { return _count == 0; }
+
+    template<typename Callable>
+    void for_each(Callable && fn) const
+    {
+        if (not _rdata)
+            return;
+        for (auto it = _rdata->begin(); it != _rdata->end();)
+        {
+            std::uint16_t size = readnet<std::uint16_t>(it);
+            fn(byte_span{std::addressof(*it), size});
+            std::advance(it, size);
+        }
+    }
+};
+
+// RRset cache bounded by an approximate memory budget, shared by every
+// worker thread. Entries carry an absolute expiry computed from the record
+// TTLs, are served with the TTL decremented by the time spent in the cache,
+// and are evicted by CLOCK (second chance) once the budget is exceeded.
+//
+// Names hash to one of a power of two shards, each with its own lock, hash
+// table and share of the budget. Lookups take no lock: entries are never
+// changed once published but for their validation state, an atomic that
+// only rises; a replaced or evicted one is unlinked under the shard lock
+// and freed only when no reader can still hold it (epoch_domain). The
+// bucket arrays are sized from the budget and never rehashed.
+class rrset_cache
+{
+    struct entry
+    {
+        std::atomic<entry *> _next{nullptr};
+        std::size_t _hash = 0;
+        std::string _key;
+        std::shared_ptr<std::vector<std::uint8_t> const> _rdata;
+        std::uint16_t _count = 0;
+        error_type _rcode = error_type::noerror;
+        cache_clock::time_point _expires;
+        trust _trust = trust::glue;
+        std::atomic<validation> _validation{validation::unchecked}; // only ever raised
+        std::atomic<bool> _referenced{false};
+        std::size_t _slot = 0; // in shard::_entries, writers only
+
+        auto cost() const -> std::size_t { return sizeof(entry) + _key.capacity() + _rdata->capacity() + 48 /* control block, bucket, slot */; }
+    };
+
+    struct alignas(64) shard
+    {
+        mutable std::mutex _lock;
+        std::vector<std::atomic<entry *>> _buckets;
+        std::vector<entry *> _entries; // the CLOCK ring
+        std::vector<std::pair<entry *, std::uint64_t>> _retired; // with their epoch tags
+        std::size_t _hand  = 0;
+        std::size_t _bytes = 0;
+    };
+
+    static constexpr std::size_t RECLAIM_BATCH = 64;
+
+    std::unique_ptr<shard[]> _shards;
+    std::size_t _shard_count;
+    std::size_t _shard_capacity;
+    std::uint32_t _max_ttl;
+
+    auto shard_of(std::size_t hash) const -> shard & { return _shards[(hash >> 48) & (_shard_count - 1)]; }
+    static auto bucket_of(shard & s, std::size_t hash) -> std::atomic<entry *> & { return s._buckets[hash & (s._buckets.size() - 1)]; }
+
+    // under the shard lock
+    static auto find(shard & s, std::size_t hash, std::string const & key) -> entry *
+    {
+        for (entry * e = bucket_of(s, hash).load(std::memory_order_relaxed); e; e = e->_next.load(std::memory_order_relaxed))
+            if (e->_hash == hash and e->_key == key)
+                return e;
+        return nullptr;
+    }
+
+    // under the shard lock: unlinks 'e' and hands it to the reclaimer
+    void erase(shard & s, entry * e)
+    {
+        std::atomic<entry *> * link = &bucket_of(s, e->_hash);
+        while (link->load(std::memory_order_relaxed) != e)
+            link = &link->load(std::memory_order_relaxed)->_next;
+        link->store(e->_next.load(std::memory_order_relaxed), std::memory_order_release);
+
+        s._entries[e->_slot] = s._entries.back();
+        s._entries[e->_slot]->_slot = e->_slot;
+        s._entries.pop_back();
+        s._bytes -= e->cost();
+
+        s._retired.emplace_back(e, epochs().retire());
+        if (s._retired.size() >= RECLAIM_BATCH)
+            reclaim(s);
+    }
+
+    // under the shard lock: frees what no reader can see any more
+    static void reclaim(shard & s)
+    {
+        std::uint64_t const oldest = epochs().oldest();
+        auto const kept = std::remove_if(s._retired.begin(), s._retired.end(), [oldest] (auto const & r) {
+            if (r.second >= oldest)
+                return false;
+            delete r.first;
+            return true;
+        });
+        s._retired.erase(kept, s._retired.end());
+    }
+
+    // CLOCK: sweep the hand, giving referenced entries a second chance and
+    // evicting expired or unreferenced ones until under budget
+    void evict(shard & s, cache_clock::time_point now)
+    {
+        for (std::size_t scanned = 0; s._bytes > _shard_capacity and not s._entries.empty() and scanned < 2 * s._entries.size(); scanned++)
+        {
+            s._hand = (s._hand + 1) % s._entries.size();
+            entry * e = s._entries[s._hand];
+            if (e->_referenced.load(std::memory_order_relaxed) and e->_expires > now)
+                e->_referenced.store(false, std::memory_order_relaxed);
+            else
+                erase(s, e);
+        }
+    }
+
+public:
+    explicit rrset_cache(std::size_t capacity = 16 << 20, std::uint32_t max_ttl = 7 * 86400, std::size_t shards = 64):
+        _shard_count{std::bit_ceil(std::max<std::size_t>(shards, 1))},
+        _shard_capacity{capacity / _shard_count},
+        _max_ttl{max_ttl}
+    {
+        _shards = std::make_unique<shard[]>(_shard_count);
+        std::size_t const buckets = std::bit_ceil(std::max<std::size_t>(_shard_capacity / 128, 16));
+        for (std::size_t i = 0; i < _shard_count; i++)
+            _shards[i]._buckets = std::vector<std::atomic<entry *>>(buckets);
+    }
+
+    // no reader may be left
+    ~rrset_cache()
+    {
+        for (std::size_t i = 0; i < _shard_count; i++)
+        {
+            for (entry * e : _shards[i]._entries)
+                delete e;
+            for (auto & r : _shards[i]._retired)
+                delete r.first;
+        }
+    }
+
+    rrset_cache(rrset_cache const &) = delete;
+    rrset_cache& operator = (rrset_cache const &) = delete;
+
+    auto size() const -> std::size_t
+    {
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < _shard_count; i++)
+        {
+            std::lock_guard lock{_shards[i]._lock};
+            total += _shards[i]._entries.size();
+        }
+        return total;
+    }
+
+    auto bytes() const -> std::size_t
+    {
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < _shard_count; i++)
+        {
+            std::lock_guard lock{_shards[i]._lock};
+            total += _shards[i]._bytes;
+        }
+        return total;
+    }
+
+    // Takes no lock. An expired entry is a miss; it stays until evicted or
+    // replaced. So is one trusted less than 'minimum': glue only serves to
+    // reach nameservers, never as an answer.
+    auto lookup(wire_name const & name, query_type type, trust minimum = trust::authority, std::uint16_t class_type = 1,
+                cache_clock::time_point now = cache_clock::now()) const -> std::optional<rrset>
+    {
+        return lookup(make_rrset_key(name, type, class_type), now, minimum);
+    }
+
+    auto lookup_nxdomain(wire_name const & name, std::uint16_t class_type = 1,
+                         cache_clock::time_point now = cache_clock::now()) const -> std::optional<rrset>
+    {
+        return lookup(name, NXDOMAIN_TYPE, trust::authority, class_type, now);
+    }
+
+    // the RRSIGs of the 'covered' rrset of 'name'
+    auto lookup_signatures(wire_name const & name, query_type covered, std::uint16_t class_type = 1,
+                           cache_clock::time_point now = cache_clock::now()) const -> std::optional<rrset>
+    {
+        return lookup(make_rrset_key(name, query_type::RRSIG, class_type, covered), now, trust::authority);
+    }
+
+    // what insert_wildcard_proof kept for the 'type' answer at 'name'
+    auto lookup_wildcard_proof(wire_name const & name, query_type type, std::uint16_t class_type = 1,
+                               cache_clock::time_point now = cache_clock::now()) const -> std::optional<rrset>
+    {
+        return lookup(make_rrset_key(name, WILDCARD_PROOF_TYPE, class_type, type), now, trust::authority);
+    }
+
+    auto lookup(std::string const & key, cache_clock::time_point now, trust minimum) const -> std::optional<rrset>
+    {
+        std::size_t const hash = std::hash<std::string>{}(key);
+        shard & s = shard_of(hash);
+
+        epoch_domain::guard reading{epochs()};
+        for (entry * e = bucket_of(s, hash).load(std::memory_order_acquire); e; e = e->_next.load(std::memory_order_acquire))
+        {
+            if (e->_hash != hash or e->_key != key)
+                continue;
+            if (e->_expires <= now or e->_trust < minimum)
+                return std::nullopt;
+
+            // written once per sweep, so hits stay read only
+            if (not e->_referenced.load(std::memory_order_relaxed))
+                e->_referenced.store(true, std::memory_order_relaxed);
+            auto left = std::chrono::duration_cast<std::chrono::seconds>(e->_expires - now).count();
+            return rrset{static_cast<std::uint32_t>(left), e->_count, e->_rdata, e->_rcode,
+                         e->_validation.load(std::memory_order_acquire)};
+        }
+        return std::nullopt;
+    }
+
+    // Records what validation made of 'seen', what a lookup of 'key'
+    // returned, if the cache still holds that very rrset; false if not.
+    // Bogus data (nullopt) is dropped, for the next query to fetch again.
+    bool validated(std::string const & key, rrset const & seen, std::optional<validation> v)
+    {
+        std::size_t const hash = std::hash<std::string>{}(key);
+        shard & s = shard_of(hash);
+        std::lock_guard lock{s._lock};
+        entry * const e = find(s, hash, key);
+        if (e == nullptr or e->_rdata != seen._rdata)
+            return false;
+        if (not v)
+            erase(s, e);
+        else if (*v > e->_validation.load(std::memory_order_relaxed))
+            e->_validation.store(*v, std::memory_order_release);
+        return true;
+    }
+
+    // 'rdata' holds 'count' RDATAs, each prefixed by its 16 bit length.
+    // count == 0 stores a negative entry, see rrset
+    void insert(wire_name const & name, query_type type, std::uint16_t class_type,
+                std::uint32_t TTL, std::uint16_t count, std::vector<std::uint8_t> rdata, trust t,
+                cache_clock::time_point now = cache_clock::now(),
+                error_type rcode = error_type::noerror)
+    {
+        insert(make_rrset_key(name, type, class_type), TTL, count, std::move(rdata), t, now, rcode);
+    }
+
+    void insert(std::string key, std::uint32_t TTL, std::uint16_t count, std::vector<std::uint8_t> rdata, trust t,
+                cache_clock::time_point now, error_type rcode)
+    {
+        if (TTL > INT32_MAX) // RFC 2181: treat as zero
+            TTL = 0;
+        TTL = std::min(TTL, _max_ttl);
+        if (TTL == 0 or (count == 0 and rdata.empty()))
+            return;
+
+        auto e = std::make_unique<entry>();
+        e->_key     = std::move(key);
+        e->_hash    = std::hash<std::string>{}(e->_key);
+        e->_rdata   = std::make_shared<std::vector<std::uint8_t> const>(std::move(rdata));
+        e->_count   = count;
+        e->_rcode   = rcode;
+        e->_expires = now + std::chrono::seconds(TTL);
+        e->_trust   = t;
+
+        shard & s = shard_of(e->_hash);
+        std::lock_guard lock{s._lock};
+        entry * const old = find(s, e->_hash, e->_key);
+        if (old and old->_expires > now and
+            (old->_trust > t or old->_validation.load(std::memory_order_relaxed) != validation::unchecked))
+            return;
+
+        // the new entry goes in front of the old one before that is
+        // unlinked, so a reader always finds one of them
+        std::atomic<entry *> & head = bucket_of(s, e->_hash);
+        e->_next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        e->_slot = s._entries.size();
+        s._bytes += e->cost();
+        s._entries.push_back(e.get());
+        head.store(e.release(), std::memory_order_release);
+        if (old)
+            erase(s, old);
+        evict(s, now);
+    }
+
+    // Remembers that 'name' does not exist (type == NXDOMAIN_TYPE) or has no
+    // 'type' records (NODATA), proven by the SOA in 'authorities', the
+    // authority section, along with the NSEC, NSEC3 and RRSIG records there.
+    // All from a server authoritative for 'bailiwick': the SOA must be of a
+    // zone in it above 'name', records outside of it are left out.
+    // RFC 2308 section 5: the lifetime is the smaller of the SOA TTL and MINIMUM.
+    void insert_negative(wire_name const & name, query_type type, dns_message_view::records const & authorities,
+                         wire_name const & bailiwick, cache_clock::time_point now = cache_clock::now())
+    {
+        std::vector<std::uint8_t> rdata;
+        std::uint32_t TTL = 0;
+        std::uint16_t class_type = 1;
+        for (resource_record soa : authorities)
+        {
+            byte_span const rd = soa.rd_data();
+            wire_name owner;
+            if (soa.type() != query_type::SOA or rd.size() < 22 or not soa.name(owner) or
+                not is_subdomain(owner, bailiwick) or not is_subdomain(name, owner))
+                continue;
+
+            std::uint32_t const minimum = readnet<std::uint32_t>(rd.end() - sizeof(std::uint32_t));
+            append(rdata, [&] { rdata.insert(rdata.end(), owner.data(), owner.data() + owner.size()); return true; });
+            if (not append(rdata, [&] { return soa.rd_data_uncompressed(rdata); }))
+            {
+                rdata.clear();
+                continue;
+            }
+            TTL = std::min(soa.TTL(), minimum);
+            class_type = soa.class_type();
+            break;
+        }
+        if (rdata.empty())
+            return;
+
+        append_proof(rdata, authorities, bailiwick);
+        insert(name, type, class_type, TTL, 0, std::move(rdata),
+               trust::authority, now, type == NXDOMAIN_TYPE ? error_type::nxdomain : error_type::noerror);
+    }
+
+    // Keeps the NSEC, NSEC3 and RRSIG records in 'authorities' that came with
+    // the 'type' answer at 'name', expanded from a wildcard, from a server
+    // authoritative for 'bailiwick': the proof that no closer name exists
+    // (RFC 4035 section 5.3.4). Laid out as the parts of a negative rrset
+    // after its SOA, as many as _count says; it lives as long as the
+    // shortest TTL among them.
+    void insert_wildcard_proof(wire_name const & name, query_type type, dns_message_view::records const & authorities,
+                               wire_name const & bailiwick, cache_clock::time_point now = cache_clock::now())
+    {
+        std::vector<std::uint8_t> rdata;
+        std::uint16_t const count = append_proof(rdata, authorities, bailiwick);
+        std::uint32_t TTL = UINT32_MAX;
+        for (resource_record rr : authorities)
+            if (query_type const t = rr.type(); t == query_type::NSEC or t == query_type::NSEC3 or t == query_type::RRSIG)
+                TTL = std::min(TTL, rr.TTL());
+        if (count > 0)
+            insert(make_rrset_key(name, WILDCARD_PROOF_TYPE, 1, type), TTL, count, std::move(rdata),
+                   trust::authority, now, error_type::noerror);
+    }
+
+    // A denial made up here rather than received: 'parts' are laid out as
+    // a negative rrset keeps them, the SOA owner and RDATA first.
+    void insert_negative(wire_name const & name, query_type type, std::uint32_t TTL, std::vector<byte_span> const & parts,
+                         cache_clock::time_point now = cache_clock::now())
+    {
+        std::vector<std::uint8_t> rdata;
+        for (byte_span part : parts)
+        {
+            std::uint16_t const size = htons(static_cast<std::uint16_t>(part.size()));
+            rdata.insert(rdata.end(), reinterpret_cast<std::uint8_t const *>(&size),
+                         reinterpret_cast<std::uint8_t const *>(&size) + sizeof size);
+            rdata.insert(rdata.end(), part.begin(), part.end());
+        }
+        insert(name, type, 1, TTL, 0, std::move(rdata),
+               trust::authority, now, type == NXDOMAIN_TYPE ? error_type::nxdomain : error_type::noerror);
+    }
+
+    // caches every rrset found in 'records' from a server authoritative for
+    // 'bailiwick'; what lies outside of it is not the server's to say and is
+    // left out. The rrset TTL is the smallest TTL among its records; RRSIGs
+    // make one rrset per type they cover
+    void insert(dns_message_view::records const & records, trust t, wire_name const & bailiwick,
+                cache_clock::time_point now = cache_clock::now())
+    {
+        std::vector<bool> done(records.size());
+        for (std::size_t i = 0; i < records.size(); i++)
+        {
+            resource_record const head = records[i];
+            query_type const type = head.type();
+            wire_name name;
+            if (done[i] or type == query_type::OPT or not head.name(name) or not is_subdomain(name, bailiwick))
+                continue;
+
+            query_type const covered = covered_type(head);
+            std::uint32_t TTL = head.TTL();
+            std::uint16_t count = 0;
+            std::vector<std::uint8_t> rdata;
+            for (std::size_t j = i; j < records.size(); j++)
+            {
+                resource_record const rr = records[j];
+                wire_name owner;
+                if (done[j] or rr.type() != type or rr.class_type() != head.class_type() or not rr.name(owner) or
+                    owner != name or covered_type(rr) != covered)
+                    continue;
+
+                done[j] = true;
+                std::size_t const at = rdata.size();
+                rdata.resize(at + sizeof(std::uint16_t));
+                if (not rr.rd_data_uncompressed(rdata))
+                {
+                    rdata.resize(at); // malformed, left out
+                    continue;
+                }
+                std::uint16_t const size = htons(static_cast<std::uint16_t>(rdata.size() - at - sizeof(std::uint16_t)));
+                std::memcpy(rdata.data() + at, &size, sizeof size);
+                TTL = std::min(TTL, rr.TTL());
+                count++;
+            }
+            if (count == 0)
+                continue;
+            insert(make_rrset_key(name, type, head.class_type(), covered), TTL, count, std::move(rdata), t, now,
+                   error_type::noerror);
+        }
+    }
+
+    // the type an RRSIG covers, NXDOMAIN_TYPE for other records
+    static auto covered_type(resource_record const & rr) -> query_type
+    {
+        if (rr.type() != query_type::RRSIG or rr.rd_size() < sizeof(query_type))
+            return NXDOMAIN_TYPE;
+        return readnet<query_type>(rr.rd_data().begin());
+    }
+
+private:
+    // 'write' appends one part to 'rdata', behind its 16 bit length; one
+    // that fails leaves nothing behind
+    template<typename Callable>
+    static bool append(std::vector<std::uint8_t> & rdata, Callable && write)
+    {
+        std::size_t const at = rdata.size();
+        rdata.resize(at + sizeof(std::uint16_t));
+        if (not write())
+        {
+            rdata.resize(at);
+            return false;
+        }
+        std::uint16_t const size = htons(static_cast<std::uint16_t>(rdata.size() - at - sizeof(std::uint16_t)));
+        std::memcpy(rdata.data() + at, &size, sizeof size);
+        return true;
+    }
+
+    // appends the NSEC, NSEC3 and RRSIG records of 'authorities' inside
+    // 'bailiwick' to 'rdata', each as its owner, its type and its RDATA;
+    // returns how many
+    static auto append_proof(std::vector<std::uint8_t> & rdata, dns_message_view::records const & authorities,
+                             wire_name const & bailiwick) -> std::uint16_t
+    {
+        std::uint16_t count = 0;
+        for (resource_record rr : authorities)
+        {
+            query_type const t = rr.type();
+            if (t != query_type::NSEC and t != query_type::NSEC3 and t != query_type::RRSIG)
+                continue;
+            count += append(rdata, [&] {
+                wire_name owner;
+                if (not rr.name(owner) or not is_subdomain(owner, bailiwick))
+                    return false;
+                rdata.insert(rdata.end(), owner.data(), owner.data() + owner.size());
+                std::uint16_t const type = htons(+t);
+                rdata.insert(rdata.end(), reinterpret_cast<std::uint8_t const *>(&type),
+                             reinterpret_cast<std::uint8_t const *>(&type) + sizeof type);
+                return rr.rd_data_uncompressed(rdata);
+            });
+        }
+        return count;
+    }
+};
+
+// A zone cut: the NS set of a zone and what is known of each server's
+// addresses, each with its own expiry.
+struct delegation
+{
+    struct nameserver
+    {
+        wire_name _name;
+        std::vector<ipv4> _addresses;
+        cache_clock::time_point _expires; // of _addresses
+    };
+
+    wire_name _zone;
+    std::vector<nameserver> _servers;
+    cache_clock::time_point _expires; // of the NS set
+
+    auto addresses(cache_clock::time_point now = cache_clock::now()) const -> std::set<ipv4>
+    {
+        std::set<ipv4> result;
+        for (nameserver const & ns : _servers)
+            if (ns._expires > now)
+                result.insert(ns._addresses.begin(), ns._addresses.end());
+        return result;
+    }
+};
+
+// Zone cuts learnt from referrals, so a query can start at the deepest known
+// ancestor of its name instead of at the root. Bounded by a zone count;
+// expired cuts are dropped first when it is reached. Not thread safe.
+class delegation_cache
+{
+    std::unordered_map<std::string, delegation> _zones;
+    std::size_t _max_zones;
+    std::uint32_t _max_ttl;
+
+    static auto key(wire_name name) -> std::string
+    {
+        name.to_lower();
+        return {reinterpret_cast<char const *>(name.data()), name.size()};
+    }
+
+    auto expiry(std::uint32_t TTL, cache_clock::time_point now) const -> cache_clock::time_point
+    {
+        return now + std::chrono::seconds(TTL > INT32_MAX ? 0 : std::min(TTL, _max_ttl));
+    }
+
+    void make_room(cache_clock::time_point now)
+    {
+        if (_zones.size() < _max_zones)
+            return;
+        for (auto it = _zones.begin(); it != _zones.end();)
+            it = (it->second._expires <= now) ? _zones.erase(it) : std::next(it);
+        if (_zones.size() >= _max_zones)
+            _zones.erase(_zones.begin());
+    }
+
+public:
+    explicit delegation_cache(std::size_t max_zones = 1 << 16, std::uint32_t max_ttl = 2 * 86400):
+        _max_zones{max_zones}, _max_ttl{max_ttl} {}
+
+    auto size() const -> std::size_t { return _zones.size(); }
+
+    // Records the cut described by the NS records of a referral from a server
+    // authoritative for 'bailiwick', with the glue for those NS names. The
+    // new zone must lie strictly below 'bailiwick' and glue outside of it is
+    // ignored. Returns the zone, or nullopt if the referral is not usable.
+    auto insert(dns_message_view const & referral, wire_name const & bailiwick,
+                cache_clock::time_point now = cache_clock::now()) -> std::optional<wire_name>
+    {
+        delegation cut;
+        std::uint32_t TTL = UINT32_MAX;
+        bool found = false;
+        for (resource_record rr : referral.authorities())
+        {
+            if (rr.type() != query_type::NS)
+                continue;
+
+            wire_name owner;
+            if (not rr.name(owner))
+                continue;
+            if (not found)
+            {
+                if (owner == bailiwick or not is_subdomain(owner, bailiwick))
+                    return std::nullopt;
+                cut._zone = owner;
+                found = true;
+            }
+            else if (owner != cut._zone)
+                continue;
+
+            delegation::nameserver ns;
+            if (rr.rd_name(0, ns._name) == 0)
+                continue;
+            cut._servers.push_back(std::move(ns));
+            TTL = std::min(TTL, rr.TTL());
+        }
+        if (not found)
+            return std::nullopt;
+
+        cut._expires = expiry(TTL, now);
+        for (resource_record rr : referral.additionals())
+        {
+            wire_name name;
+            ipv4 ip;
+            if (not rr.rd_data_as_ip(ip) or not rr.name(name) or not is_subdomain(name, bailiwick))
+                continue;
+            for (delegation::nameserver & ns : cut._servers)
+                if (ns._name == name)
+                {
+                    ns._addresses.push_back(ip);
+                    ns._expires = std::min(cut._expires, expiry(rr.TTL(), now));
+                }
+        }
+
+        make_room(now);
+        wire_name zone = cut._zone;
+        _zones[key(zone)] = std::move(cut);
+        return zone;
+    }
+
+    // fills in the addresses of a nameserver of 'zone' that came without glue
+    void insert_addresses(wire_name const & zone, wire_name const & ns_name, std::set<ipv4> const & addresses,
+                          std::uint32_t TTL, cache_clock::time_point now = cache_clock::now())
+    {
+        auto it = _zones.find(key(zone));
+        if (it == _zones.end())
+            return;
+
+        for (delegation::nameserver & ns : it->second._servers)
+            if (ns._name == ns_name)
+            {
+                ns._addresses.assign(addresses.begin(), addresses.end());
+                ns._expires = std::min(it->second._expires, expiry(TTL, now));
+            }
+    }
+
+    auto get(wire_name const & zone) const -> delegation const *
+    {
+        auto it = _zones.find(key(zone));
+        return it == _zones.end() ? nullptr : &it->second;
+    }
+
+    // the deepest unexpired cut above or at 'name' that has at least one
+    // nameserver address
+    auto closest(wire_name name, cache_clock::time_point now = cache_clock::now()) const -> delegation const *
+    {
+        for (;;)
+        {
+            if (auto it = _zones.find(key(name)); it != _zones.end())
+            {
+                delegation const & cut = it->second;
+                if (cut._expires > now)
+                    for (delegation::nameserver const & ns : cut._servers)
+                        if (ns._expires > now and not ns._addresses.empty())
+                            return &cut;
+            }
+            if (name.is_root())
+                return nullptr;
+            name.to_parent();
+        }
+    }
+};
+
+#endif // HAREDNS_CACHE_HPP_
@@ -8,6 +8,7 @@
 #include <set>
 #include <cstdint>
 #include <cstring>
+#include <functional>
 
 // posix headers
 #include <sys/socket.h>
@@ -30,6 +31,7 @@ enum class query_type : std::uint16_t
     AAAA  = 28,
     SRV   = 33,
     NAPTR = 35,
+    DNAME = 39,
     OPT   = 41,
     DS    = 43,
     RRSIG = 46,
@@ -82,6 +84,12 @@ enum class dnssec_algorithm : std::uint8_t
     RSASHA1    = 5, // https://tools.ietf.org/html/rfc3110 [MANDATORY]
     RSASHA1_NSEC3_SHA1 = 7, // https://www.iana.org/assignments/dns-sec-alg-numbers/dns-sec-alg-numbers.xml
     RSASHA256  = 8,         // https://tools.ietf.org/html/rfc5702
+    RSASHA512  = 10,        // https://tools.ietf.org/html/rfc5702
+    ECC_GOST   = 12,        // https://tools.ietf.org/html/rfc5933
+    ECDSAP256SHA256 = 13,   // https://tools.ietf.org/html/rfc6605
+    ECDSAP384SHA384 = 14,   // https://tools.ietf.org/html/rfc6605
+    ED25519    = 15,        // https://tools.ietf.org/html/rfc8080
+    ED448      = 16,        // https://tools.ietf.org/html/rfc8080
     Indirect   = 252,
     PRIVATEDNS = 253,
     PRIVATEOID = 254,
@@ -197,6 +205,6 @@ struct defer
     ~defer() { std::invoke(_callable); }
 };
 
-constexpr bool is_big_endian() { return htonl(47) == 47; }
+constexpr bool is_big_endian() { return __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__; }
 
 #endif // HAREDNS_DEF_HPP_
@@ -0,0 +1,790 @@
+#ifndef HAREDNS_ENGINE_HPP_
+#define HAREDNS_ENGINE_HPP_
+
+// epoll:         https://man7.org/linux/man-pages/man7/epoll.7.html
+// Spoofing:      https://tools.ietf.org/html/rfc5452#section-9
+// Batched I/O:  https://man7.org/linux/man-pages/man2/sendmmsg.2.html
+// io_uring:     https://man7.org/linux/man-pages/man7/io_uring.7.html
+// eventfd:      https://man7.org/linux/man-pages/man2/eventfd.2.html
+// Timing wheels: http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// posix headers
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "haredns_def.hpp"
+#include "haredns_net.hpp"
+#include "haredns_wire.hpp"
+#include "haredns_infra.hpp"
+#include "haredns_task.hpp"
+#include "haredns_uring.hpp"
+#include "haredns_pool.hpp"
+
+using engine_clock = infra_clock;
+
+// Hashed timing wheel with millisecond ticks. A timer further out than one
+// revolution waits in its slot until its tick comes round; cancelling only
+// forgets the callback and the slot entry is dropped when reached.
+class timer_wheel
+{
+public:
+    using timer_id = std::uint64_t;
+    static constexpr std::size_t SLOTS = 4096;
+
+private:
+    struct entry
+    {
+        std::uint64_t _tick;
+        timer_id _id;
+    };
+
+    engine_clock::time_point _start;
+    std::uint64_t _current = 0; // every tick up to this one has fired
+    timer_id _last_id = 0;
+    std::array<std::vector<entry>, SLOTS> _slots;
+    std::map<std::uint64_t, std::size_t> _revolutions; // entries per revolution, cancelled ones included
+    std::unordered_map<timer_id, std::function<void()>> _callbacks;
+
+    auto ticks(engine_clock::time_point t) const -> std::uint64_t
+    {
+        if (t <= _start)
+            return 0;
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t - _start).count();
+    }
+
+    void fire(std::uint64_t tick, std::uint64_t upto)
+    {
+        std::vector<entry> & slot = _slots[tick % SLOTS];
+        std::vector<entry> due;
+        for (auto it = slot.begin(); it != slot.end();)
+        {
+            if (it->_tick <= upto)
+            {
+                if (auto rev = _revolutions.find(it->_tick / SLOTS); --rev->second == 0)
+                    _revolutions.erase(rev);
+                due.push_back(*it);
+                it = slot.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        for (entry const & e : due)
+        {
+            auto it = _callbacks.find(e._id);
+            if (it == _callbacks.end())
+                continue; // cancelled
+            std::function<void()> fn = std::move(it->second);
+            _callbacks.erase(it);
+            fn();
+        }
+    }
+
+public:
+    explicit timer_wheel(engine_clock::time_point start = engine_clock::now()): _start{start} {}
+
+    auto schedule(engine_clock::time_point when, std::function<void()> fn) -> timer_id
+    {
+        std::uint64_t const tick = std::max(ticks(when), _current + 1);
+        timer_id const id = ++_last_id;
+        _slots[tick % SLOTS].push_back({tick, id});
+        _revolutions[tick / SLOTS]++;
+        _callbacks.emplace(id, std::move(fn));
+        return id;
+    }
+
+    void cancel(timer_id id) { _callbacks.erase(id); }
+    bool empty() const { return _callbacks.empty(); }
+
+    // when the next live timer is due, looking at most one revolution ahead;
+    // nothing is scanned before the earliest revolution holding a timer
+    auto next_due() const -> std::optional<engine_clock::time_point>
+    {
+        if (empty() or _revolutions.empty())
+            return std::nullopt;
+
+        std::uint64_t const first = std::max(_current + 1, _revolutions.begin()->first * SLOTS);
+        if (first > _current + SLOTS)
+            return _start + std::chrono::milliseconds(first);
+
+        for (std::uint64_t tick = first; tick <= _current + SLOTS; tick++)
+            for (entry const & e : _slots[tick % SLOTS])
+                if (e._tick == tick and _callbacks.count(e._id))
+                    return _start + std::chrono::milliseconds(tick);
+        return _start + std::chrono::milliseconds(_current + SLOTS);
+    }
+
+    // runs every timer due by 'now'; callbacks may schedule new timers
+    void advance(engine_clock::time_point now)
+    {
+        std::uint64_t const target = ticks(now);
+        if (target <= _current)
+            return;
+
+        // past a whole revolution every slot is visited once
+        std::uint64_t tick = (target - _current > SLOTS) ? target - SLOTS : _current;
+        while (tick < target)
+        {
+            _current = ++tick;
+            fire(tick, target);
+        }
+    }
+};
+
+// The response to one query from one server, or why there is none:
+// error_type::timeout when the server stayed silent, error_type::plain when
+// the query could not be sent. The RCODE is left to the handler.
+using reply_handler = std::function<void(dns_message_view &&, error_type)>;
+
+// Called with the epoll events of an fd given to engine::watch().
+using fd_handler = std::function<void(std::uint32_t events)>;
+
+// What services the engine's sockets: epoll with sendto/recvfrom, or
+// sendmmsg/recvmmsg when batching, or io_uring with multishot receives and
+// sends batched per enter. io_uring needs Linux 6.0 and is left out of
+// builds with HAREDNS_NO_URING; without it the engine falls back to epoll.
+enum class io_backend { epoll, io_uring };
+
+// How the engine talks to the network. With the default '_batch' of 1 each
+// datagram goes through its own sendto/recvfrom; a larger '_batch' moves that
+// many per sendmmsg/recvmmsg call. Batching is opt-in: on loopback it
+// measured from 0.85x to 1.04x of the single-datagram path. Queries wait at
+// most '_flush_interval' for others to share their sendmmsg; 0 sends them
+// before the loop next blocks.
+struct engine_options
+{
+    std::size_t _sockets   = 16; // source ports at a time
+    std::size_t _port_uses = 64; // queries before a socket moves to a new port
+    std::size_t _batch     = 1;
+    microseconds _flush_interval{0};
+    io_backend _backend = io_backend::epoll;
+    std::uint16_t _server_port = 53; // where servers are asked
+};
+
+// (socket, ID, server, question) packed into one string
+auto make_transaction_key(std::uint16_t socket, std::uint16_t id, ipv4 server, wire_name name, query_type type)
+    -> std::string
+{
+    name.to_lower();
+    std::string key;
+    key.reserve(sizeof socket + sizeof id + sizeof server + name.size() + sizeof(std::uint16_t));
+    key.append(reinterpret_cast<char const *>(&socket), sizeof socket);
+    key.append(reinterpret_cast<char const *>(&id), sizeof id);
+    key.append(reinterpret_cast<char const *>(&server), sizeof server);
+    key.append(reinterpret_cast<char const *>(name.data()), name.size());
+    std::uint16_t const t = +type;
+    key.append(reinterpret_cast<char const *>(&t), sizeof t);
+    return key;
+}
+
+// Non-blocking query engine. Queries carry random IDs and go out from a
+// pool of non-blocking UDP sockets on random ports, all watched by epoll
+// or serviced by io_uring (see io_backend).
+// Every query in flight is a transaction keyed by (socket, ID, server,
+// question), and its timeout, the server's RTO from the infra table, sits on
+// a timer wheel. A response is delivered only to the transaction it
+// matches; anything else is dropped after reading just its header and
+// question. Queries are queued per socket and flushed in batches, and
+// responses are drained in batches into pooled buffers. Handlers run on the
+// thread calling run(). Not thread safe.
+class engine
+{
+    // queued datagrams of one socket, and the transactions they belong to
+    struct outbox
+    {
+        std::vector<outgoing> _datagrams;
+        std::vector<std::string> _keys;
+    };
+
+    struct transaction
+    {
+        std::size_t _socket;
+        ipv4 _server;
+        engine_clock::time_point _sent;
+        timer_wheel::timer_id _timer;
+        reply_handler _handler; // empty once abandoned
+        bool _hedge;
+    };
+
+    // recursion desired, DNSSEC data asked for (DO) but left to us to check (CD)
+    using query_packet = query_encoder<flag_bit(dns::control_code::RD) | flag_bit(dns::control_code::AD) |
+                                       flag_bit(dns::control_code::CD)>;
+
+    static constexpr int MAX_EVENTS = 64;
+    static constexpr std::uint64_t WATCHED = 1ull << 63; // epoll data of a watch()ed fd, not a pool socket
+
+    engine_options _options;
+    int _epoll_fd;
+    std::unique_ptr<uring> _ring; // nullptr: epoll
+    std::vector<std::uint32_t> _generations; // per socket, bumped when reopened
+    socket_pool _sockets;
+    std::vector<outbox> _outboxes;
+    std::size_t _queued = 0;
+    engine_clock::time_point _queued_since{}; // oldest queued datagram
+    buffer_pool _buffers;
+    timer_wheel _timers;
+    infra_table _infra;
+    std::unordered_map<std::string, transaction> _inflight;
+    std::unordered_map<int, fd_handler> _watched;
+    bool _polling_watched = false; // io_uring polls the epoll fd for them
+    std::vector<std::function<void()>> _posted;
+    std::size_t _hedges = 0;
+
+    // Coroutines other threads are done with, to resume on this loop, and
+    // the eventfd that wakes it for them. Shared with what those threads
+    // run, which may outlive the engine.
+    struct inbox
+    {
+        std::mutex _lock;
+        std::vector<std::coroutine_handle<>> _ready;
+        int _fd = -1;
+        bool _closed = false;
+
+        void deliver(std::coroutine_handle<> h)
+        {
+            std::lock_guard<std::mutex> lock{_lock};
+            if (_closed)
+                return;
+            _ready.push_back(h);
+            std::uint64_t const one = 1;
+            [[maybe_unused]] ssize_t const n = ::write(_fd, &one, sizeof one);
+        }
+    };
+    std::shared_ptr<inbox> _inbox; // made on the first offload()
+    std::size_t _offloaded = 0;    // waiting on other threads; the eventfd is watched while any is
+
+    // an offload() is about to start: the inbox it reports back to
+    auto expect_remote() -> std::shared_ptr<inbox>
+    {
+        if (not _inbox)
+        {
+            _inbox = std::make_shared<inbox>();
+            _inbox->_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+        if (_offloaded++ == 0)
+            watch(_inbox->_fd, EPOLLIN, [this] (std::uint32_t) { resume_remote(); });
+        return _inbox;
+    }
+
+    void resume_remote()
+    {
+        std::uint64_t count;
+        [[maybe_unused]] ssize_t const n = ::read(_inbox->_fd, &count, sizeof count);
+        std::vector<std::coroutine_handle<>> ready;
+        {
+            std::lock_guard<std::mutex> lock{_inbox->_lock};
+            ready.swap(_inbox->_ready);
+        }
+        for (std::coroutine_handle<> h : ready)
+        {
+            _offloaded--;
+            h.resume();
+        }
+        if (_offloaded == 0)
+            unwatch(_inbox->_fd);
+    }
+
+    // what the multishot recvmsg on socket 'index' is armed under, so a
+    // late completion from a socket since replaced is told apart
+    auto recv_tag(std::size_t index) const -> std::uint64_t
+    {
+        return (std::uint64_t{_generations[index]} << 32) | index;
+    }
+
+    void opened(std::size_t index, int fd)
+    {
+        _generations[index]++;
+        if (_ring)
+            _ring->recv(fd, recv_tag(index));
+        else
+            watch_socket(index, fd);
+    }
+
+    void closing(std::size_t index, int)
+    {
+        if (_ring)
+            _ring->cancel(recv_tag(index));
+    }
+
+    void watch_socket(std::size_t index, int fd)
+    {
+        epoll_event ev{};
+        ev.events   = EPOLLIN;
+        ev.data.u64 = index;
+        if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            perror("epoll_ctl failed: ");
+    }
+
+    void complete(std::unordered_map<std::string, transaction>::iterator it, dns_message_view && message, error_type error)
+    {
+        transaction t = std::move(it->second);
+        _inflight.erase(it);
+        _sockets.release(t._socket);
+        if (t._hedge)
+            _hedges--;
+        if (t._handler)
+            t._handler(std::move(message), error);
+    }
+
+    void expire(std::string const & key)
+    {
+        auto it = _inflight.find(key);
+        if (it == _inflight.end())
+            return;
+        _infra.timeout(it->second._server);
+        complete(it, dns_message_view{}, error_type::timeout);
+    }
+
+    void fail(std::string const & key)
+    {
+        auto it = _inflight.find(key);
+        if (it == _inflight.end())
+            return;
+        _timers.cancel(it->second._timer);
+        complete(it, dns_message_view{}, error_type::plain);
+    }
+
+    // Sends what is queued on 'socket'. The clock of each transaction starts
+    // here, not when it was queued; ones that could not be sent fail on the
+    // next turn.
+    void flush(std::size_t socket)
+    {
+        outbox & box = _outboxes[socket];
+        if (box._datagrams.empty())
+            return;
+
+        std::size_t sent = box._datagrams.size();
+        if (not _ring)
+        {
+            sent = send_batch(_sockets.fd(socket), box._datagrams.data(), box._datagrams.size(), _options._batch);
+            if (sent < box._datagrams.size())
+                perror("send failed: ");
+        }
+
+        auto const now = engine_clock::now();
+        for (std::size_t i = 0; i < box._keys.size(); i++)
+        {
+            if (i >= sent)
+                post([this, key = std::move(box._keys[i])] { fail(key); });
+            else if (auto it = _inflight.find(box._keys[i]); it != _inflight.end())
+                it->second._sent = now;
+
+            if (_ring and i < sent)
+                _ring->send(_sockets.fd(socket), std::move(box._datagrams[i]), std::move(box._keys[i]));
+        }
+
+        _queued -= box._datagrams.size();
+        box._datagrams.clear();
+        box._keys.clear();
+    }
+
+    void flush()
+    {
+        for (std::size_t socket = 0; socket < _outboxes.size() and _queued > 0; socket++)
+            flush(socket);
+    }
+
+    // the transaction a datagram from 'from' on 'socket' answers, if any
+    auto match(std::size_t socket, sockaddr_in const & from, std::uint8_t const * data, std::size_t size)
+        -> std::unordered_map<std::string, transaction>::iterator
+    {
+        if (from.sin_port != htons(_options._server_port))
+            return _inflight.end();
+
+        std::uint16_t id;
+        wire_name name;
+        query_type type;
+        if (not peek_question(data, size, id, name, type))
+            return _inflight.end();
+
+        // end(): late, spoofed or not ours
+        return _inflight.find(make_transaction_key(socket, id, ntohl(from.sin_addr.s_addr), name, type));
+    }
+
+    void deliver(std::unordered_map<std::string, transaction>::iterator it, buffer_pool::buffer && buf)
+    {
+        _timers.cancel(it->second._timer);
+        _infra.update(it->second._server,
+                      std::chrono::duration_cast<microseconds>(engine_clock::now() - it->second._sent));
+        complete(it, dns_message_view{std::move(buf)}, error_type::noerror);
+    }
+
+    void receive(std::size_t socket, buffer_pool::buffer && buf, sockaddr_in const & from)
+    {
+        auto it = match(socket, from, buf.data(), buf.size());
+        if (it != _inflight.end())
+            deliver(it, std::move(buf));
+    }
+
+    // a datagram io_uring put in one of its own buffers: only a match is
+    // copied out
+    void received(std::uint64_t tag, sockaddr_in const & from, std::uint8_t const * data, std::size_t size)
+    {
+        std::size_t const socket = tag & 0xffffffff;
+        if (tag != recv_tag(socket))
+            return; // the socket has been replaced
+
+        auto it = match(socket, from, data, size);
+        if (it == _inflight.end())
+            return;
+
+        buffer_pool::buffer buf = _buffers.acquire();
+        std::memcpy(buf.data(), data, size);
+        buf.resize(size);
+        deliver(it, std::move(buf));
+    }
+
+    // hands every event on 'events' to its socket or watch()ed fd
+    void dispatch(epoll_event const * events, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            std::uint64_t const data = events[i].data.u64;
+            if (not (data & WATCHED))
+            {
+                receive(data);
+                continue;
+            }
+            auto it = _watched.find(static_cast<int>(data & ~WATCHED));
+            if (it == _watched.end())
+                continue; // unwatched by an earlier handler
+            fd_handler handler = it->second; // may unwatch itself
+            handler(events[i].events);
+        }
+    }
+
+    // waits up to 'timeout_ms' on the ring and handles what completed
+    void reap(int timeout_ms)
+    {
+        _ring->wait(timeout_ms);
+        _ring->reap(
+            [this] (std::uint64_t tag, sockaddr_in const & from, std::uint8_t const * data, std::size_t size) {
+                received(tag, from, data, size);
+            },
+            [this] (std::uint64_t tag, int) {
+                // out of provided buffers, or cancelled: rearm if still current
+                std::size_t const socket = tag & 0xffffffff;
+                if (tag == recv_tag(socket))
+                    _ring->recv(_sockets.fd(socket), tag);
+            },
+            [this] (std::string const & key, int error) {
+                std::fprintf(stderr, "sendmsg failed: %s\n", std::strerror(-error));
+                fail(key);
+            },
+            [this] (std::uint64_t, bool armed) {
+                std::array<epoll_event, MAX_EVENTS> events;
+                dispatch(events.data(), epoll_wait(_epoll_fd, events.data(), events.size(), 0));
+                if (not armed)
+                    _ring->poll(_epoll_fd, 0);
+            });
+    }
+
+    // drains 'socket' a batch at a time
+    void receive(std::size_t socket)
+    {
+        int const fd = _sockets.fd(socket);
+        std::vector<buffer_pool::buffer> buffers;
+        std::vector<sockaddr_in> from;
+        for (;;)
+        {
+            std::size_t const n = receive_batch(fd, _buffers, _options._batch, buffers, from);
+            for (std::size_t i = 0; i < n; i++)
+                receive(socket, std::move(buffers[i]), from[i]);
+            if (n < _options._batch)
+                return;
+        }
+    }
+
+public:
+    explicit engine(engine_options options = {}):
+        _options{options},
+        _epoll_fd{epoll_create1(EPOLL_CLOEXEC)},
+        _ring{options._backend == io_backend::io_uring ? uring::open() : nullptr},
+        _generations(std::max<std::size_t>(options._sockets, 1)),
+        _sockets{options._sockets, options._port_uses,
+                 [this] (std::size_t index, int fd) { opened(index, fd); },
+                 [this] (std::size_t index, int fd) { closing(index, fd); }},
+        _outboxes(_sockets.size())
+    {
+        _options._batch = std::max<std::size_t>(_options._batch, 1);
+        if (options._backend == io_backend::io_uring and not _ring)
+        {
+            std::fputs("io_uring unavailable, using epoll\n", stderr);
+            _options._backend = io_backend::epoll;
+        }
+    }
+
+    engine(engine const &) = delete;
+    engine& operator = (engine const &) = delete;
+
+    ~engine()
+    {
+        if (_inbox)
+        {
+            std::lock_guard<std::mutex> lock{_inbox->_lock};
+            _inbox->_closed = true;
+            close(_inbox->_fd);
+        }
+        close(_epoll_fd);
+    }
+
+    auto infra() -> infra_table & { return _infra; }
+    auto inflight() const -> std::size_t { return _inflight.size(); }
+    auto hedges()   const -> std::size_t { return _hedges; }
+    auto options()  const -> engine_options const & { return _options; }
+
+    // Sends 'host' 'type' to 'server' and calls 'handler' with the outcome,
+    // never from inside this call. 'hedge' counts the query in hedges().
+    // Returns the transaction key, to abandon() it with.
+    auto query(ipv4 server, std::string const & host, query_type type, reply_handler handler, bool hedge = false)
+        -> std::string
+    {
+        wire_name qname;
+        if (not parse_name(host, qname))
+        {
+            post([handler = std::move(handler)] { handler(dns_message_view{}, error_type::formerr); });
+            return {};
+        }
+
+        std::size_t const socket = _sockets.acquire();
+        std::uint16_t id;
+        std::string key;
+        do
+        {
+            id  = random_query_id();
+            key = make_transaction_key(socket, id, server, qname, type);
+        } while (_inflight.count(key));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(_options._server_port);
+        addr.sin_addr.s_addr = htonl(server);
+
+        auto const now = engine_clock::now();
+        timer_wheel::timer_id const timer =
+            _timers.schedule(now + _options._flush_interval + _infra.rto(server), [this, key] { expire(key); });
+        _inflight.emplace(key, transaction{socket, server, now, timer, std::move(handler), hedge});
+        if (hedge)
+            _hedges++;
+
+        outbox & box = _outboxes[socket];
+        std::vector<std::uint8_t> packet(query_packet::MAX_SIZE);
+        packet.resize(query_packet::write(packet.data(), id, qname, type));
+        box._datagrams.push_back(outgoing{std::move(packet), addr});
+        box._keys.push_back(key);
+        if (_queued++ == 0)
+            _queued_since = now;
+        if (box._datagrams.size() >= _options._batch)
+            flush(socket);
+        return key;
+    }
+
+    // The handler of 'key' will not be called. The query stays in flight
+    // until answered or timed out, so a late answer still counts as an RTT
+    // sample and silence still counts as a timeout.
+    void abandon(std::string const & key)
+    {
+        if (auto it = _inflight.find(key); it != _inflight.end())
+            it->second._handler = nullptr;
+    }
+
+    // query() for coroutines: co_await yields the response and the outcome
+    // as a std::pair<dns_message_view, error_type>
+    auto async_query(ipv4 server, std::string host, query_type type, bool hedge = false)
+    {
+        struct awaiter
+        {
+            engine & _engine;
+            ipv4 _server;
+            std::string _host;
+            query_type _type;
+            bool _hedge;
+            dns_message_view _message;
+            error_type _error = error_type::plain;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> waiting)
+            {
+                _engine.query(_server, _host, _type, [this, waiting] (dns_message_view && message, error_type error) {
+                    _message = std::move(message);
+                    _error   = error;
+                    waiting.resume();
+                }, _hedge);
+            }
+            auto await_resume() -> std::pair<dns_message_view, error_type> { return {std::move(_message), _error}; }
+        };
+        return awaiter{*this, server, std::move(host), type, hedge, {}};
+    }
+
+    // co_await sleep_until(when) resumes from the loop at 'when'
+    auto sleep_until(engine_clock::time_point when)
+    {
+        struct awaiter
+        {
+            engine & _engine;
+            engine_clock::time_point _when;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> waiting)
+            {
+                _engine.schedule(_when, [waiting] { waiting.resume(); });
+            }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{*this, when};
+    }
+
+    // co_await offload(pool, jobs) runs 'jobs' on 'pool' and resumes on this
+    // loop once every one of them has returned; what they wrote is then
+    // visible here
+    auto offload(work_pool & pool, std::vector<work_pool::job> jobs)
+    {
+        struct awaiter
+        {
+            engine & _engine;
+            work_pool & _pool;
+            std::vector<work_pool::job> _jobs;
+
+            bool await_ready() const noexcept { return _jobs.empty(); }
+            void await_suspend(std::coroutine_handle<> waiting)
+            {
+                auto left = std::make_shared<std::atomic<std::size_t>>(_jobs.size());
+                std::shared_ptr<inbox> box = _engine.expect_remote();
+                for (work_pool::job & j : _jobs)
+                    j = [j = std::move(j), left, box, waiting] {
+                        j();
+                        if (left->fetch_sub(1, std::memory_order_acq_rel) == 1)
+                            box->deliver(waiting);
+                    };
+                _pool.submit(std::move(_jobs));
+            }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{*this, pool, std::move(jobs)};
+    }
+
+    auto schedule(engine_clock::time_point when, std::function<void()> fn) -> timer_wheel::timer_id
+    {
+        return _timers.schedule(when, std::move(fn));
+    }
+
+    void cancel(timer_wheel::timer_id id) { _timers.cancel(id); }
+
+    // Calls 'handler' from the loop whenever 'fd' has any of the epoll
+    // 'events'. Watching an fd again changes its events and handler.
+    void watch(int fd, std::uint32_t events, fd_handler handler)
+    {
+        epoll_event ev{};
+        ev.events   = events;
+        ev.data.u64 = WATCHED | static_cast<std::uint32_t>(fd);
+        bool const known = _watched.count(fd) != 0;
+        if (epoll_ctl(_epoll_fd, known ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            perror("epoll_ctl failed: ");
+            return;
+        }
+        _watched[fd] = std::move(handler);
+
+        if (_ring and not _polling_watched)
+        {
+            _ring->poll(_epoll_fd, 0);
+            _polling_watched = true;
+        }
+    }
+
+    // stops watching 'fd'; call before closing it
+    void unwatch(int fd)
+    {
+        if (_watched.erase(fd))
+            epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    // runs 'fn' on the next turn of the loop
+    void post(std::function<void()> fn) { _posted.push_back(std::move(fn)); }
+
+    // One turn: runs what was posted, sends the queued queries once they
+    // have waited long enough, waits for responses, watched fds, the next
+    // timer or the next flush, and dispatches them. Returns false if there
+    // was nothing to wait for.
+    bool run_once()
+    {
+        while (not _posted.empty())
+        {
+            std::vector<std::function<void()>> posted;
+            posted.swap(_posted);
+            for (auto & fn : posted)
+                fn();
+        }
+
+        if (_queued > 0 and engine_clock::now() >= _queued_since + _options._flush_interval)
+            flush();
+
+        // watched fds are waited on for as long as it takes
+        std::optional<engine_clock::time_point> due = _timers.next_due();
+        if (not due and _watched.empty())
+            return false;
+        if (_queued > 0)
+            due = std::min(due.value_or(engine_clock::time_point::max()), _queued_since + _options._flush_interval);
+        if (not _posted.empty())
+            due = engine_clock::now(); // a failed send to report
+
+        int timeout_ms = -1;
+        if (due)
+            timeout_ms = std::max<int>(0, std::chrono::ceil<std::chrono::milliseconds>(*due - engine_clock::now()).count());
+        if (_ring)
+            reap(timeout_ms);
+        else
+        {
+            std::array<epoll_event, MAX_EVENTS> events;
+            dispatch(events.data(), epoll_wait(_epoll_fd, events.data(), events.size(), timeout_ms));
+        }
+
+        _timers.advance(engine_clock::now());
+        return true;
+    }
+
+    // runs 't' on this loop until it finishes, or the loop runs out of work
+    // before it does
+    template<typename T>
+    auto run(task<T> t) -> std::optional<T>
+    {
+        std::optional<T> result;
+        spawn(std::move(t), [&result] (T value) { result.emplace(std::move(value)); });
+        run_until([&result] { return result.has_value(); });
+        return result;
+    }
+
+    // turns the loop until 'done' or out of work
+    template<typename Predicate>
+    void run_until(Predicate && done)
+    {
+        while (not done() and (run_once() or not _posted.empty()))
+            ;
+    }
+
+    void run() { run_until([] { return false; }); }
+};
+
+#endif // HAREDNS_ENGINE_HPP_
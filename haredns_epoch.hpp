@@ -0,0 +1,128 @@
+#ifndef HAREDNS_EPOCH_HPP_
+#define HAREDNS_EPOCH_HPP_
+
+// Epoch based reclamation: https://www.cl.cam.ac.uk/techreports/UCAM-CL-TR-579.pdf
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Tells writers when memory unlinked from a shared structure can be freed,
+// without readers taking any lock. A reader holds a guard while it follows
+// pointers; it announces the epoch it entered in a slot of its own. A writer
+// tags what it unlinks with retire() and may free it once oldest() has
+// moved past that tag: every reader that could still see it has left.
+class epoch_domain
+{
+public:
+    static constexpr std::size_t MAX_THREADS = 256;
+
+private:
+    struct alignas(64) slot
+    {
+        std::atomic<std::uint64_t> _epoch{0}; // 0: not reading
+        std::atomic<bool> _taken{false};
+    };
+
+    // a thread's slot, claimed on its first guard and given back when it exits
+    struct owner
+    {
+        epoch_domain & _domain;
+        slot * _slot = nullptr;
+        int _depth = 0;
+
+        explicit owner(epoch_domain & domain): _domain{domain}
+        {
+            for (slot & s : _domain._slots)
+                if (not s._taken.exchange(true, std::memory_order_acquire))
+                {
+                    _slot = &s;
+                    break;
+                }
+        }
+
+        ~owner()
+        {
+            if (_slot)
+                _slot->_taken.store(false, std::memory_order_release);
+        }
+    };
+
+    alignas(64) std::atomic<std::uint64_t> _epoch{1};
+    alignas(64) std::atomic<std::size_t> _overflow{0}; // readers beyond MAX_THREADS
+    std::array<slot, MAX_THREADS> _slots;
+
+    auto self() -> owner &
+    {
+        thread_local owner o{*this};
+        return o;
+    }
+
+public:
+    epoch_domain() = default;
+    epoch_domain(epoch_domain const &) = delete;
+    epoch_domain& operator = (epoch_domain const &) = delete;
+
+    // A read side critical section; nests.
+    class guard
+    {
+        owner & _owner;
+
+    public:
+        explicit guard(epoch_domain & domain): _owner{domain.self()}
+        {
+            if (_owner._depth++ > 0)
+                return;
+            if (_owner._slot)
+                _owner._slot->_epoch.store(domain._epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            else
+                domain._overflow.fetch_add(1, std::memory_order_relaxed);
+            // pairs with the fence in oldest(): either the writer sees this
+            // reader, or this reader sees what the writer unlinked
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        ~guard()
+        {
+            if (--_owner._depth > 0)
+                return;
+            if (_owner._slot)
+                _owner._slot->_epoch.store(0, std::memory_order_release);
+            else
+                _owner._domain._overflow.fetch_sub(1, std::memory_order_release);
+        }
+
+        guard(guard const &) = delete;
+        guard& operator = (guard const &) = delete;
+    };
+
+    // The tag of something just unlinked, which no new reader can reach.
+    auto retire() -> std::uint64_t
+    {
+        return _epoch.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    // What was retired with a tag below this is no longer seen by anyone.
+    auto oldest() const -> std::uint64_t
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_overflow.load(std::memory_order_acquire) != 0)
+            return 0;
+
+        std::uint64_t oldest = _epoch.load(std::memory_order_acquire);
+        for (slot const & s : _slots)
+            if (std::uint64_t const e = s._epoch.load(std::memory_order_acquire); e != 0 and e < oldest)
+                oldest = e;
+        return oldest;
+    }
+};
+
+// the domain shared by every structure in the process
+auto epochs() -> epoch_domain &
+{
+    static epoch_domain domain;
+    return domain;
+}
+
+#endif // HAREDNS_EPOCH_HPP_
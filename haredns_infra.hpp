@@ -0,0 +1,167 @@
+#ifndef HAREDNS_INFRA_HPP_
+#define HAREDNS_INFRA_HPP_
+
+// RTT estimation: https://tools.ietf.org/html/rfc6298#section-2
+// Backoff:        https://tools.ietf.org/html/rfc6298#section-5
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+#include "haredns_def.hpp"
+
+using infra_clock = std::chrono::steady_clock;
+using std::chrono::microseconds;
+
+// How far to hedge: a query that has not been answered within about the
+// server's p90 RTT is sent again to the next server in line, up to '_fan_out'
+// servers at once. '_max_outstanding' caps the hedges a resolver has in
+// flight in total, including those that lost a race and are still owed an
+// answer. '_fan_out' of 1 turns hedging off.
+struct hedge_policy
+{
+    std::size_t _fan_out = 2;
+    std::size_t _max_outstanding = 4;
+};
+
+// What we know about one nameserver address.
+struct server_stats
+{
+    microseconds _srtt{0};
+    microseconds _rttvar{0};
+    std::uint32_t _samples  = 0;
+    std::uint32_t _timeouts = 0; // in a row
+    infra_clock::time_point _held_until{}; // skipped until then
+};
+
+// Per-server infrastructure table: smoothed RTT and RTT variance, updated
+// from every exchange, the retransmission timeout to wait for each server,
+// and the order to try the servers of a zone in. Servers that keep timing
+// out are held down and skipped for a while. Not thread safe.
+class infra_table
+{
+    std::unordered_map<ipv4, server_stats> _servers;
+    std::mt19937 _random{std::random_device{}()};
+    double _explore;
+    infra_clock::duration _hold_down;
+
+    bool held_down(ipv4 server, infra_clock::time_point now) const
+    {
+        server_stats const * s = get(server);
+        return s != nullptr and s->_held_until > now;
+    }
+
+    // what trying 'server' is expected to cost: its SRTT, or its whole
+    // backed off timeout once it has started losing queries
+    auto rank(ipv4 server) const -> microseconds
+    {
+        server_stats const * s = get(server);
+        return (s != nullptr and s->_timeouts > 0) ? rto(server) : srtt(server);
+    }
+
+public:
+    // servers never heard from rank as if they answered this fast, so they
+    // are tried before known slow ones but after known fast ones
+    static constexpr microseconds UNKNOWN_RTT{std::chrono::milliseconds{300}};
+    static constexpr microseconds UNKNOWN_RTO{std::chrono::milliseconds{400}};
+    static constexpr microseconds MIN_RTO{std::chrono::milliseconds{50}};
+    static constexpr microseconds MAX_RTO{std::chrono::milliseconds{3000}};
+    static constexpr std::uint32_t HOLD_DOWN_AFTER = 3; // timeouts in a row
+
+    // 'explore' is the chance to put a random server first, so estimates of
+    // the others get refreshed now and then
+    explicit infra_table(double explore = 0.05,
+                         infra_clock::duration hold_down = std::chrono::seconds{60}):
+        _explore{explore}, _hold_down{hold_down} {}
+
+    auto get(ipv4 server) const -> server_stats const *
+    {
+        auto it = _servers.find(server);
+        return it == _servers.end() ? nullptr : &it->second;
+    }
+
+    auto srtt(ipv4 server) const -> microseconds
+    {
+        server_stats const * s = get(server);
+        return (s == nullptr or s->_samples == 0) ? UNKNOWN_RTT : s->_srtt;
+    }
+
+    // RFC 6298: rto = srtt + 4 rttvar, clamped, doubled for every timeout in
+    // a row (Karn: timeouts back off but never feed the estimator)
+    auto rto(ipv4 server) const -> microseconds
+    {
+        server_stats const * s = get(server);
+        if (s == nullptr)
+            return UNKNOWN_RTO;
+
+        microseconds base = (s->_samples == 0) ? UNKNOWN_RTO : s->_srtt + 4 * s->_rttvar;
+        base = std::clamp(base, MIN_RTO, MAX_RTO);
+        return std::min(base * (1 << std::min<std::uint32_t>(s->_timeouts, 6)), MAX_RTO);
+    }
+
+    // roughly the 90th percentile of the server's RTT, never later than its
+    // RTO: by then the query is given up on anyway
+    auto hedge_after(ipv4 server) const -> microseconds
+    {
+        server_stats const * s = get(server);
+        microseconds const p90 = (s == nullptr or s->_samples == 0) ? UNKNOWN_RTT : s->_srtt + 2 * s->_rttvar;
+        return std::clamp(p90, MIN_RTO, rto(server));
+    }
+
+    // RFC 6298: rttvar = 3/4 rttvar + 1/4 |srtt - r|, srtt = 7/8 srtt + 1/8 r
+    void update(ipv4 server, microseconds rtt)
+    {
+        server_stats & s = _servers[server];
+        if (s._samples == 0)
+        {
+            s._srtt   = rtt;
+            s._rttvar = rtt / 2;
+        }
+        else
+        {
+            microseconds const delta = (s._srtt > rtt) ? s._srtt - rtt : rtt - s._srtt;
+            s._rttvar = (3 * s._rttvar + delta) / 4;
+            s._srtt   = (7 * s._srtt + rtt) / 8;
+        }
+        s._samples++;
+        s._timeouts = 0;
+    }
+
+    // backs the server off, and holds it down after too many timeouts in a row
+    void timeout(ipv4 server, infra_clock::time_point now = infra_clock::now())
+    {
+        server_stats & s = _servers[server];
+        if (++s._timeouts >= HOLD_DOWN_AFTER)
+            s._held_until = now + _hold_down;
+    }
+
+    // 'servers' sorted by expected cost, cheapest first, leaving out the ones
+    // held down unless nothing else is left. Now and then a random one goes
+    // first
+    auto order(std::set<ipv4> const & servers, infra_clock::time_point now = infra_clock::now()) -> std::vector<ipv4>
+    {
+        std::vector<ipv4> ordered;
+        ordered.reserve(servers.size());
+        for (ipv4 server : servers)
+            if (not held_down(server, now))
+                ordered.push_back(server);
+        if (ordered.empty())
+            ordered.assign(servers.begin(), servers.end());
+
+        std::stable_sort(ordered.begin(), ordered.end(),
+                         [this](ipv4 a, ipv4 b) { return rank(a) < rank(b); });
+
+        if (ordered.size() > 1 and std::bernoulli_distribution{_explore}(_random))
+        {
+            std::size_t const k = std::uniform_int_distribution<std::size_t>{1, ordered.size() - 1}(_random);
+            std::rotate(ordered.begin(), ordered.begin() + k, ordered.begin() + k + 1);
+        }
+        return ordered;
+    }
+};
+
+#endif // HAREDNS_INFRA_HPP_
@@ -0,0 +1,394 @@
+#ifndef HAREDNS_NET_HPP_
+#define HAREDNS_NET_HPP_
+
+// Spoofing resilience: https://tools.ietf.org/html/rfc5452
+// Batched I/O:         https://man7.org/linux/man-pages/man2/recvmmsg.2.html
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+// posix headers
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "haredns_def.hpp"
+
+struct record_offsets
+{
+    std::uint16_t _offset;    // owner name
+    std::uint16_t _rd_offset; // RDATA, or QTYPE for questions
+};
+
+// One received datagram plus room for the record offsets a parser indexes
+// into it (see dns_message_view). A record takes at least 5 bytes on the
+// wire, which bounds how many offsets a full slab can need.
+struct receive_slab
+{
+    static constexpr std::size_t max_records = MAX_UDP_PAYLOAD_SIZE / 5;
+
+    std::array<std::uint8_t,   MAX_UDP_PAYLOAD_SIZE> _data;
+    std::array<record_offsets, max_records>          _index;
+};
+
+// Receive slabs recycled across queries. Slabs are allocated a chunk at a
+// time when the pool runs dry and live as long as the pool, so a warm pool
+// serves every recvfrom without touching the heap. Not thread safe; each
+// resolver owns its own.
+class buffer_pool
+{
+public:
+    class buffer
+    {
+        buffer_pool  * _pool = nullptr; // nullptr -> standalone, owns _slab
+        receive_slab * _slab = nullptr;
+        std::size_t    _size = 0;
+
+        friend class buffer_pool;
+        buffer(buffer_pool * pool, receive_slab * slab): _pool{pool}, _slab{slab} {}
+
+    public:
+        buffer() = default;
+        buffer(buffer const &) = delete;
+        buffer& operator = (buffer const &) = delete;
+
+        buffer(buffer && other) noexcept:
+            _pool{std::exchange(other._pool, nullptr)},
+            _slab{std::exchange(other._slab, nullptr)},
+            _size{std::exchange(other._size, 0)} {}
+
+        buffer& operator = (buffer && other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                _pool = std::exchange(other._pool, nullptr);
+                _slab = std::exchange(other._slab, nullptr);
+                _size = std::exchange(other._size, 0);
+            }
+            return *this;
+        }
+
+        ~buffer() { reset(); }
+
+        // a slab that does not come from any pool, for messages that do not
+        // arrive through a resolver socket
+        static auto standalone() -> buffer { return {nullptr, new receive_slab}; }
+
+        void reset()
+        {
+            if (_slab == nullptr)
+                return;
+            if (_pool)
+                _pool->release(_slab);
+            else
+                delete _slab;
+            _slab = nullptr;
+            _size = 0;
+        }
+
+        auto data()     const -> std::uint8_t * { return _slab->_data.data(); }
+        auto size()     const -> std::size_t { return _size; }
+        auto capacity() const -> std::size_t { return _slab->_data.size(); }
+        auto slab()     const -> receive_slab * { return _slab; }
+        void resize(std::size_t size) { _size = std::min(size, capacity()); }
+        explicit operator bool () const { return _slab != nullptr; }
+    };
+
+    explicit buffer_pool(std::size_t chunk_size = 8): _chunk_size{chunk_size} {}
+    buffer_pool(buffer_pool const &) = delete;
+    buffer_pool& operator = (buffer_pool const &) = delete;
+
+    auto acquire() -> buffer
+    {
+        if (_free.empty())
+            grow();
+
+        receive_slab * slab = _free.back();
+        _free.pop_back();
+        return {this, slab};
+    }
+
+    auto allocated() const -> std::size_t { return _chunks.size() * _chunk_size; }
+
+private:
+    void grow()
+    {
+        _chunks.push_back(std::make_unique<receive_slab[]>(_chunk_size));
+        _free.reserve(allocated());
+        for (std::size_t i = 0; i < _chunk_size; i++)
+            _free.push_back(&_chunks.back()[i]);
+    }
+
+    void release(receive_slab * slab) { _free.push_back(slab); }
+
+    std::size_t _chunk_size;
+    std::vector<std::unique_ptr<receive_slab[]>> _chunks;
+    std::vector<receive_slab *> _free;
+};
+
+// A datagram waiting to be sent.
+struct outgoing
+{
+    std::vector<std::uint8_t> _packet;
+    sockaddr_in _to;
+};
+
+// Sends 'count' datagrams from 'queue' on 'fd', 'batch' per sendmmsg call;
+// a 'batch' of 1 sends each with sendto. Returns how many went out; on a
+// short count errno tells why the next one did not.
+auto send_batch(int fd, outgoing const * queue, std::size_t count, std::size_t batch) -> std::size_t
+{
+    if (batch <= 1)
+    {
+        std::size_t sent = 0;
+        while (sent < count)
+        {
+            outgoing const & out = queue[sent];
+            ssize_t const n = sendto(fd, out._packet.data(), out._packet.size(), 0,
+                                     reinterpret_cast<sockaddr const *>(&out._to), sizeof out._to);
+            if (n < 0 and errno == EINTR)
+                continue;
+            if (n < 0)
+                break;
+            sent++;
+        }
+        return sent;
+    }
+
+    std::vector<mmsghdr> msgs(std::min(count, batch));
+    std::vector<iovec>   iovs(msgs.size());
+
+    std::size_t sent = 0;
+    while (sent < count)
+    {
+        std::size_t const n = std::min(count - sent, batch);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            outgoing const & out = queue[sent + i];
+            iovs[i] = { const_cast<std::uint8_t *>(out._packet.data()), out._packet.size() };
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_name    = const_cast<sockaddr_in *>(&out._to);
+            msgs[i].msg_hdr.msg_namelen = sizeof out._to;
+            msgs[i].msg_hdr.msg_iov     = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen  = 1;
+        }
+
+        int const done = sendmmsg(fd, msgs.data(), n, 0);
+        if (done < 0 and errno == EINTR)
+            continue;
+        if (done <= 0)
+            break;
+        sent += done;
+    }
+    return sent;
+}
+
+// Reads up to 'batch' waiting datagrams from 'fd' with one recvmmsg, or one
+// with recvfrom when 'batch' is 1, each into a buffer from 'pool' sized to
+// it, with its source in 'from'. Returns how many were read; 0 when nothing
+// is waiting.
+auto receive_batch(int fd, buffer_pool & pool, std::size_t batch,
+                   std::vector<buffer_pool::buffer> & buffers, std::vector<sockaddr_in> & from) -> std::size_t
+{
+    batch = std::max<std::size_t>(batch, 1);
+    buffers.resize(batch);
+    from.resize(batch);
+    if (batch == 1)
+    {
+        if (not buffers[0])
+            buffers[0] = pool.acquire();
+        socklen_t length = sizeof from[0];
+        ssize_t received;
+        do
+            received = recvfrom(fd, buffers[0].data(), buffers[0].capacity(), MSG_DONTWAIT,
+                                reinterpret_cast<sockaddr *>(&from[0]), &length);
+        while (received < 0 and errno == EINTR);
+        if (received < 0)
+            return 0;
+        buffers[0].resize(received);
+        return 1;
+    }
+
+    std::vector<mmsghdr> msgs(batch);
+    std::vector<iovec>   iovs(batch);
+    for (std::size_t i = 0; i < batch; i++)
+    {
+        if (not buffers[i])
+            buffers[i] = pool.acquire();
+        iovs[i] = { buffers[i].data(), buffers[i].capacity() };
+        msgs[i] = {};
+        msgs[i].msg_hdr.msg_name    = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof from[i];
+        msgs[i].msg_hdr.msg_iov     = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    int received;
+    do
+        received = recvmmsg(fd, msgs.data(), batch, MSG_DONTWAIT, nullptr);
+    while (received < 0 and errno == EINTR);
+    if (received <= 0)
+        return 0;
+
+    for (int i = 0; i < received; i++)
+        buffers[i].resize(msgs[i].msg_len);
+    return received;
+}
+
+// Unpredictable numbers for query IDs and source ports, drawn from the
+// kernel a block at a time. One per thread.
+class random_source
+{
+    std::array<std::uint8_t, 512> _block;
+    std::size_t _used = _block.size();
+
+    void refill()
+    {
+        std::size_t got = 0;
+        while (got < _block.size())
+        {
+            ssize_t n = getrandom(_block.data() + got, _block.size() - got, 0);
+            if (n < 0 and errno == EINTR)
+                continue;
+            if (n < 0)
+                break;
+            got += n;
+        }
+        if (got < _block.size()) // no getrandom: fall back to the library
+            for (std::random_device device; got < _block.size(); got++)
+                _block[got] = static_cast<std::uint8_t>(device());
+        _used = 0;
+    }
+
+public:
+    auto next16() -> std::uint16_t
+    {
+        if (_used + sizeof(std::uint16_t) > _block.size())
+            refill();
+        std::uint16_t value;
+        std::memcpy(&value, _block.data() + _used, sizeof value);
+        _used += sizeof value;
+        return value;
+    }
+
+    static auto local() -> random_source &
+    {
+        thread_local random_source source;
+        return source;
+    }
+};
+
+auto random_query_id() -> std::uint16_t { return random_source::local().next16(); }
+
+// Non-blocking UDP sockets bound to random source ports, for queries to be
+// spread over. A socket that has carried enough queries is moved to a fresh
+// random port once nothing is in flight on it. 'on_open' is told of every
+// socket opened, to watch it, and 'on_close' of every socket about to be
+// replaced. Not thread safe.
+class socket_pool
+{
+public:
+    static constexpr std::uint16_t MIN_PORT = 1024;
+    using open_handler = std::function<void(std::size_t index, int fd)>;
+    using close_handler = open_handler;
+
+private:
+    struct udp_socket
+    {
+        int _fd = -1;
+        std::uint16_t _port = 0;
+        std::size_t _uses = 0;
+        std::size_t _inflight = 0;
+    };
+
+    std::vector<udp_socket> _sockets;
+    std::size_t _max_uses;
+    open_handler _on_open;
+    close_handler _on_close;
+
+    void open(std::size_t i)
+    {
+        udp_socket & s = _sockets[i];
+        if (s._fd >= 0)
+        {
+            if (_on_close)
+                _on_close(i, s._fd);
+            close(s._fd);
+        }
+        s = udp_socket{};
+        s._fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+        if (s._fd < 0)
+        {
+            perror("socket failed: ");
+            return;
+        }
+
+        for (int attempt = 0; attempt < 32; attempt++)
+        {
+            std::uint16_t const port = MIN_PORT + random_source::local().next16() % (65536 - MIN_PORT);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port   = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            if (bind(s._fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0)
+            {
+                s._port = port;
+                break;
+            }
+        }
+        // port still 0: left to the kernel's own (randomized) ephemeral choice
+        if (_on_open)
+            _on_open(i, s._fd);
+    }
+
+public:
+    explicit socket_pool(std::size_t size = 16, std::size_t max_uses = 64,
+                         open_handler on_open = {}, close_handler on_close = {}):
+        _sockets(std::max<std::size_t>(size, 1)), _max_uses{max_uses},
+        _on_open{std::move(on_open)}, _on_close{std::move(on_close)}
+    {
+        for (std::size_t i = 0; i < _sockets.size(); i++)
+            open(i);
+    }
+
+    socket_pool(socket_pool const &) = delete;
+    socket_pool& operator = (socket_pool const &) = delete;
+
+    ~socket_pool()
+    {
+        for (udp_socket const & s : _sockets)
+            if (s._fd >= 0)
+                close(s._fd);
+    }
+
+    auto size() const -> std::size_t { return _sockets.size(); }
+    auto fd(std::size_t i) const -> int { return _sockets[i]._fd; }
+    auto port(std::size_t i) const -> std::uint16_t { return _sockets[i]._port; }
+
+    // a random socket for the next query
+    auto acquire() -> std::size_t
+    {
+        std::size_t const i = random_source::local().next16() % _sockets.size();
+        if (_sockets[i]._uses >= _max_uses and _sockets[i]._inflight == 0)
+            open(i);
+        _sockets[i]._uses++;
+        _sockets[i]._inflight++;
+        return i;
+    }
+
+    void release(std::size_t i) { _sockets[i]._inflight--; }
+};
+
+#endif // HAREDNS_NET_HPP_
@@ -0,0 +1,140 @@
+#ifndef HAREDNS_POOL_HPP_
+#define HAREDNS_POOL_HPP_
+
+// Work stealing: http://supertech.csail.mit.edu/papers/steal.pdf
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+// A fixed set of threads running jobs for whoever submits them, off the
+// threads that submit. Every thread has a queue of its own, which
+// submissions are dealt to round robin; it takes from the front of its own
+// and, when that runs dry, steals from the back of the others', so a long
+// job does not hold up the ones queued behind it while others idle.
+// Pending jobs are run before the pool is destroyed.
+class work_pool
+{
+public:
+    using job = std::function<void()>;
+
+private:
+    struct alignas(64) queue
+    {
+        std::mutex _lock;
+        std::deque<job> _jobs;
+    };
+
+    std::unique_ptr<queue[]> _queues;
+    std::size_t _size;
+    std::vector<std::thread> _threads;
+    std::atomic<std::size_t> _next{0};    // the queue the next submission goes to
+    std::atomic<std::size_t> _pending{0}; // queued, not taken yet
+    std::mutex _idle_lock;
+    std::condition_variable _idle;
+    bool _stopping = false;
+
+    auto take(std::size_t self) -> std::optional<job>
+    {
+        for (std::size_t i = 0; i < _size; i++)
+        {
+            queue & q = _queues[(self + i) % _size];
+            std::lock_guard<std::mutex> lock{q._lock};
+            if (q._jobs.empty())
+                continue;
+            job j;
+            if (i == 0)
+            {
+                j = std::move(q._jobs.front());
+                q._jobs.pop_front();
+            }
+            else
+            {
+                j = std::move(q._jobs.back());
+                q._jobs.pop_back();
+            }
+            _pending.fetch_sub(1, std::memory_order_relaxed);
+            return j;
+        }
+        return std::nullopt;
+    }
+
+    void work(std::size_t self)
+    {
+        for (;;)
+        {
+            if (auto j = take(self); j)
+            {
+                (*j)();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock{_idle_lock};
+            _idle.wait(lock, [this] { return _stopping or _pending.load(std::memory_order_relaxed) > 0; });
+            if (_stopping and _pending.load(std::memory_order_relaxed) == 0)
+                return;
+        }
+    }
+
+    void wake(std::size_t count)
+    {
+        {
+            // taken so a thread between its check and its wait does not miss it
+            std::lock_guard<std::mutex> lock{_idle_lock};
+        }
+        if (count == 1)
+            _idle.notify_one();
+        else
+            _idle.notify_all();
+    }
+
+public:
+    explicit work_pool(std::size_t threads):
+        _queues{std::make_unique<queue[]>(std::max<std::size_t>(threads, 1))}, _size{std::max<std::size_t>(threads, 1)}
+    {
+        for (std::size_t i = 0; i < _size; i++)
+            _threads.emplace_back([this, i] { work(i); });
+    }
+
+    work_pool(work_pool const &) = delete;
+    work_pool& operator = (work_pool const &) = delete;
+
+    ~work_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{_idle_lock};
+            _stopping = true;
+        }
+        _idle.notify_all();
+        for (std::thread & t : _threads)
+            t.join();
+    }
+
+    auto size() const -> std::size_t { return _size; }
+
+    // runs every job of 'batch' on some thread of the pool; may be called
+    // from any thread
+    void submit(std::vector<job> batch)
+    {
+        if (batch.empty())
+            return;
+        std::size_t const first = _next.fetch_add(batch.size(), std::memory_order_relaxed);
+        for (std::size_t i = 0; i < batch.size(); i++)
+        {
+            queue & q = _queues[(first + i) % _size];
+            std::lock_guard<std::mutex> lock{q._lock};
+            q._jobs.push_back(std::move(batch[i]));
+            _pending.fetch_add(1, std::memory_order_relaxed);
+        }
+        wake(batch.size());
+    }
+};
+
+#endif // HAREDNS_POOL_HPP_
@@ -1,39 +1,1273 @@
 #ifndef HAREDNS_SEC_HPP_
 #define HAREDNS_SEC_HPP_
 
-// OpenSSL/1.1.1c@conan/stable
+// DNSSEC:       https://tools.ietf.org/html/rfc4033
+// Records:      https://tools.ietf.org/html/rfc4034
+// Validation:   https://tools.ietf.org/html/rfc4035#section-5
+// NSEC3:        https://tools.ietf.org/html/rfc5155
+// Aggressive NSEC: https://tools.ietf.org/html/rfc8198
+// RSA/SHA-2:    https://tools.ietf.org/html/rfc5702
+// ECDSA:        https://tools.ietf.org/html/rfc6605
+// EdDSA:        https://tools.ietf.org/html/rfc8080
+// Trust anchor: https://data.iana.org/root-anchors/root-anchors.xml
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+// OpenSSL/1.1.1c@conan/stable, or 3.x
+#include <openssl/opensslv.h>
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #include <openssl/bn.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
+#endif
 
 #include "haredns_def.hpp"
+#include "haredns_wire.hpp"
+#include "haredns_cache.hpp"
+
+// What validating an answer found (RFC 4035 section 4.3), best first, so
+// the worst of several is the largest.
+enum class security : std::uint8_t
+{
+    secure        = 0, // a chain of signatures from a trust anchor holds
+    insecure      = 1, // provably below an unsigned delegation
+    indeterminate = 2, // the chain could not be fetched
+    bogus         = 3, // signed, but a signature or a proof does not hold
+};
+
+auto weakest(security a, security b) -> security { return std::max(a, b); }
+
+auto operator << (std::ostream& os, security s) -> std::ostream&
+{
+    switch (s)
+    {
+    case security::secure:        return os << "secure";
+    case security::insecure:      return os << "insecure";
+    case security::indeterminate: return os << "indeterminate";
+    case security::bogus:         return os << "bogus";
+    }
+    return os;
+}
+
+// A DS record the chain of trust starts from.
+struct trust_anchor
+{
+    wire_name _zone;
+    std::vector<std::uint8_t> _ds; // DS RDATA
+};
+
+// "<zone> <key tag> <algorithm> <digest type> <digest in hex>", the DS
+// presentation format without TTL, class and type
+auto parse_trust_anchor(std::string const & text) -> std::optional<trust_anchor>
+{
+    std::istringstream in{text};
+    std::string zone, digest;
+    unsigned tag = 0, algorithm = 0, digest_type = 0;
+    if (not (in >> zone >> tag >> algorithm >> digest_type >> digest) or
+        tag > 0xffff or algorithm > 0xff or digest_type > 0xff or digest.size() % 2 != 0)
+        return std::nullopt;
+
+    trust_anchor anchor;
+    if (zone.empty() or zone.back() != '.')
+        zone += '.';
+    if (not parse_name(zone, anchor._zone))
+        return std::nullopt;
+
+    anchor._ds = {static_cast<std::uint8_t>(tag >> 8), static_cast<std::uint8_t>(tag & 0xff),
+                  static_cast<std::uint8_t>(algorithm), static_cast<std::uint8_t>(digest_type)};
+    for (std::size_t i = 0; i < digest.size(); i += 2)
+    {
+        char * end = nullptr;
+        std::string const byte = digest.substr(i, 2);
+        unsigned long const value = std::strtoul(byte.c_str(), &end, 16);
+        if (end != byte.c_str() + 2)
+            return std::nullopt;
+        anchor._ds.push_back(static_cast<std::uint8_t>(value));
+    }
+    return anchor;
+}
+
+// the root zone KSKs: KSK-2017 and KSK-2024
+auto root_trust_anchors() -> std::vector<trust_anchor>
+{
+    std::vector<trust_anchor> anchors;
+    for (char const * ds : {". 20326 8 2 E06D44B80B8F1D39A95C0B0D7C65D08458E880409BBC683457104237C7F8EC8D",
+                            ". 38696 8 2 683D2D0ACB8C9B712A1948B27F741219298D0A450D612C483AF444A4C0FB2B16"})
+        anchors.push_back(*parse_trust_anchor(ds));
+    return anchors;
+}
+
+// RFC 4034 appendix B
+auto key_tag(byte_span dnskey) -> std::uint16_t
+{
+    std::uint32_t ac = 0;
+    for (std::size_t i = 0; i < dnskey.size(); i++)
+        ac += (i & 1) ? dnskey.data()[i] : dnskey.data()[i] << 8;
+    ac += (ac >> 16) & 0xffff;
+    return ac & 0xffff;
+}
+
+// https://tools.ietf.org/html/rfc4034#section-2.1
+struct dnskey
+{
+    static constexpr std::uint16_t ZONE_KEY = 1 << 8;
+    static constexpr std::uint16_t REVOKED  = 1 << 7; // RFC 5011
+
+    std::uint16_t _flags = 0;
+    std::uint8_t _protocol = 0;
+    std::uint8_t _algorithm = 0;
+    std::uint16_t _tag = 0;
+    byte_span _public_key;
 
-bool verify(std::vector<std::uint8_t> &n, std::vector<std::uint8_t> &e,
-            std::vector<std::uint8_t> &msg, std::vector<std::uint8_t> &hash)
+    // may sign the zone's rrsets
+    bool usable() const { return (_flags & ZONE_KEY) and not (_flags & REVOKED) and _protocol == 3; }
+};
+
+bool parse_dnskey(byte_span rd, dnskey & key)
+{
+    if (rd.size() < 4)
+        return false;
+    key._flags      = readnet<std::uint16_t>(rd.begin());
+    key._protocol   = rd.data()[2];
+    key._algorithm  = rd.data()[3];
+    key._tag        = key_tag(rd);
+    key._public_key = {rd.data() + 4, rd.size() - 4};
+    return true;
+}
+
+// https://tools.ietf.org/html/rfc4034#section-3.1
+struct rrsig
+{
+    query_type _covered = NXDOMAIN_TYPE;
+    std::uint8_t _algorithm = 0;
+    std::uint8_t _labels = 0;
+    std::uint32_t _original_ttl = 0;
+    std::uint32_t _expiration = 0;
+    std::uint32_t _inception = 0;
+    std::uint16_t _key_tag = 0;
+    wire_name _signer;
+    byte_span _signature;
+};
+
+bool parse_rrsig(byte_span rd, rrsig & sig)
+{
+    if (rd.size() < 19)
+        return false;
+    auto it = rd.begin();
+    sig._covered      = readnet<query_type>(it);
+    sig._algorithm    = readnet<std::uint8_t>(it);
+    sig._labels       = readnet<std::uint8_t>(it);
+    sig._original_ttl = readnet<std::uint32_t>(it);
+    sig._expiration   = readnet<std::uint32_t>(it);
+    sig._inception    = readnet<std::uint32_t>(it);
+    sig._key_tag      = readnet<std::uint16_t>(it);
+
+    std::size_t const end = read_name(rd.data(), rd.size(), 18, sig._signer);
+    if (end == 0 or end >= rd.size())
+        return false;
+    sig._signature = {rd.data() + end, rd.size() - end};
+    return true;
+}
+
+// RFC 4034 section 6.2: the RDATA of 'type' with the names in it lowercased,
+// for the types that have them and whose RDATA the cache keeps uncompressed
+auto canonical_rdata(query_type type, byte_span rd) -> std::vector<std::uint8_t>
+{
+    std::vector<std::uint8_t> out(rd.begin(), rd.end());
+    auto lower = [&out] (std::size_t at) {
+        while (at < out.size() and out[at] != 0)
+        {
+            for (std::size_t i = at + 1; i <= at + out[at] and i < out.size(); i++)
+                out[i] = std::tolower(out[i]);
+            at += out[at] + 1;
+        }
+        return at + 1;
+    };
+
+    switch (type)
+    {
+    case query_type::NS:
+    case query_type::CNAME:
+    case query_type::PTR:
+    case query_type::DNAME:
+        lower(0);
+        break;
+    case query_type::MX:
+        lower(2);
+        break;
+    case query_type::SRV:
+        lower(6);
+        break;
+    case query_type::SOA:
+        lower(lower(0));
+        break;
+    default:
+        break;
+    }
+    return out;
+}
+
+// "*." in front of 'name'
+auto wildcard_of(wire_name const & name) -> wire_name
+{
+    wire_name w;
+    if (name.size() + 2 > MAX_NAME_SIZE)
+        return w;
+    w._data[0] = 1;
+    w._data[1] = '*';
+    std::memcpy(w._data.data() + 2, name.data(), name.size());
+    w._size   = name.size() + 2;
+    w._labels = name._labels + 1;
+    return w;
+}
+
+// RFC 4034 section 3.1.8.1: what 'sig' signs over the rrset of 'owner' made
+// of 'rdatas'. The owner of a record expanded from a wildcard is signed as
+// the wildcard, which 'sig' tells by its label count.
+auto signed_data(rrsig const & sig, byte_span sig_rdata, wire_name owner, query_type type,
+                 std::uint16_t class_type, std::vector<byte_span> const & rdatas) -> std::vector<std::uint8_t>
 {
-    RSA *rsa = RSA_new();
-    defer _run_1 = [rsa] { RSA_free(rsa); };
-    RSA_set0_key(rsa,
-                 BN_bin2bn(n.data(), n.size(), nullptr),
-                 BN_bin2bn(e.data(), e.size(), nullptr),
-                 nullptr);
+    std::vector<std::uint8_t> out(sig_rdata.begin(), sig_rdata.begin() + 18);
+    wire_name signer = sig._signer;
+    signer.to_lower();
+    out.insert(out.end(), signer.data(), signer.data() + signer.size());
+
+    owner.to_lower();
+    if (sig._labels < owner._labels)
+    {
+        while (owner._labels > sig._labels)
+            owner.to_parent();
+        owner = wildcard_of(owner);
+    }
 
-    EVP_PKEY *pk = EVP_PKEY_new();
-    defer _run_2 = [pk] { EVP_PKEY_free(pk); };
+    std::vector<std::vector<std::uint8_t>> records;
+    for (byte_span rd : rdatas)
+        records.push_back(canonical_rdata(type, rd));
+    // RFC 4034 section 6.3: as left-justified unsigned octet sequences
+    std::sort(records.begin(), records.end(), [] (auto const & a, auto const & b) {
+        std::size_t const common = std::min(a.size(), b.size());
+        int const c = common ? std::memcmp(a.data(), b.data(), common) : 0;
+        return c < 0 or (c == 0 and a.size() < b.size());
+    });
+    records.erase(std::unique(records.begin(), records.end()), records.end());
 
+    for (auto const & rd : records)
+    {
+        out.insert(out.end(), owner.data(), owner.data() + owner.size());
+        std::uint8_t const fields[] = {
+            static_cast<std::uint8_t>(+type >> 8), static_cast<std::uint8_t>(+type & 0xff),
+            static_cast<std::uint8_t>(class_type >> 8), static_cast<std::uint8_t>(class_type & 0xff),
+            static_cast<std::uint8_t>(sig._original_ttl >> 24), static_cast<std::uint8_t>(sig._original_ttl >> 16),
+            static_cast<std::uint8_t>(sig._original_ttl >> 8), static_cast<std::uint8_t>(sig._original_ttl),
+            static_cast<std::uint8_t>(rd.size() >> 8), static_cast<std::uint8_t>(rd.size() & 0xff)};
+        out.insert(out.end(), std::begin(fields), std::end(fields));
+        out.insert(out.end(), rd.begin(), rd.end());
+    }
+    return out;
+}
+
+// the digest an algorithm signs with; nullptr for EdDSA, which hashes
+// itself, and for what is not supported
+auto signature_digest(std::uint8_t algorithm) -> EVP_MD const *
+{
+    switch (static_cast<dnssec_algorithm>(algorithm))
+    {
+    case dnssec_algorithm::RSASHA1:
+    case dnssec_algorithm::RSASHA1_NSEC3_SHA1:
+        return EVP_sha1();
+    case dnssec_algorithm::RSASHA256:
+    case dnssec_algorithm::ECDSAP256SHA256:
+        return EVP_sha256();
+    case dnssec_algorithm::ECDSAP384SHA384:
+        return EVP_sha384();
+    case dnssec_algorithm::RSASHA512:
+        return EVP_sha512();
+    default:
+        return nullptr;
+    }
+}
+
+bool supported_algorithm(std::uint8_t algorithm)
+{
+    switch (static_cast<dnssec_algorithm>(algorithm))
+    {
+    case dnssec_algorithm::ED25519:
+    case dnssec_algorithm::ED448:
+        return true;
+    default:
+        return signature_digest(algorithm) != nullptr;
+    }
+}
+
+// RFC 3110 section 2: the exponent length (one byte, or zero and two more),
+// the exponent, the modulus
+auto make_rsa_key(byte_span key) -> EVP_PKEY *
+{
+    if (key.size() < 3)
+        return nullptr;
+    std::size_t at = 1;
+    std::size_t exponent_size = key.data()[0];
+    if (exponent_size == 0)
+    {
+        exponent_size = readnet<std::uint16_t>(key.data() + 1);
+        at = 3;
+    }
+    if (exponent_size == 0 or at + exponent_size >= key.size())
+        return nullptr;
+
+    BIGNUM * e = BN_bin2bn(key.data() + at, exponent_size, nullptr);
+    BIGNUM * n = BN_bin2bn(key.data() + at + exponent_size, key.size() - at - exponent_size, nullptr);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    defer _free_bn = [e, n] { BN_free(e); BN_free(n); };
+    OSSL_PARAM_BLD * build = OSSL_PARAM_BLD_new();
+    defer _free_build = [build] { OSSL_PARAM_BLD_free(build); };
+    if (not OSSL_PARAM_BLD_push_BN(build, OSSL_PKEY_PARAM_RSA_N, n) or
+        not OSSL_PARAM_BLD_push_BN(build, OSSL_PKEY_PARAM_RSA_E, e))
+        return nullptr;
+    OSSL_PARAM * params = OSSL_PARAM_BLD_to_param(build);
+    defer _free_params = [params] { OSSL_PARAM_free(params); };
+    EVP_PKEY_CTX * ctx = EVP_PKEY_CTX_new_from_name(nullptr, "RSA", nullptr);
+    defer _free_ctx = [ctx] { EVP_PKEY_CTX_free(ctx); };
+
+    EVP_PKEY * pk = nullptr;
+    if (params == nullptr or ctx == nullptr or EVP_PKEY_fromdata_init(ctx) <= 0 or
+        EVP_PKEY_fromdata(ctx, &pk, EVP_PKEY_PUBLIC_KEY, params) <= 0)
+        return nullptr;
+    return pk;
+#else
+    RSA * rsa = RSA_new();
+    RSA_set0_key(rsa, n, e, nullptr);
+    EVP_PKEY * pk = EVP_PKEY_new();
     EVP_PKEY_assign_RSA(pk, rsa);
+    return pk;
+#endif
+}
+
+// RFC 6605 section 4: the point, X then Y, of 'size' bytes each
+auto make_ec_key(char const * curve, std::size_t size, byte_span key) -> EVP_PKEY *
+{
+    if (key.size() != 2 * size)
+        return nullptr;
+    std::vector<std::uint8_t> point{POINT_CONVERSION_UNCOMPRESSED};
+    point.insert(point.end(), key.begin(), key.end());
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM const params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_PKEY_PARAM_GROUP_NAME, const_cast<char *>(curve), 0),
+        OSSL_PARAM_construct_octet_string(OSSL_PKEY_PARAM_PUB_KEY, point.data(), point.size()),
+        OSSL_PARAM_construct_end()};
+    EVP_PKEY_CTX * ctx = EVP_PKEY_CTX_new_from_name(nullptr, "EC", nullptr);
+    defer _free_ctx = [ctx] { EVP_PKEY_CTX_free(ctx); };
+
+    EVP_PKEY * pk = nullptr;
+    if (ctx == nullptr or EVP_PKEY_fromdata_init(ctx) <= 0 or
+        EVP_PKEY_fromdata(ctx, &pk, EVP_PKEY_PUBLIC_KEY, const_cast<OSSL_PARAM *>(params)) <= 0)
+        return nullptr;
+    return pk;
+#else
+    EC_KEY * ec = EC_KEY_new_by_curve_name(OBJ_sn2nid(curve));
+    std::uint8_t const * in = point.data();
+    if (ec == nullptr or o2i_ECPublicKey(&ec, &in, point.size()) == nullptr)
+    {
+        EC_KEY_free(ec);
+        return nullptr;
+    }
+    EVP_PKEY * pk = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(pk, ec);
+    return pk;
+#endif
+}
+
+// a public key ready for OpenSSL, freed with its last user
+using evp_key = std::shared_ptr<EVP_PKEY>;
+
+// the 'public_key' of a DNSKEY of 'algorithm' for OpenSSL, nullptr if it is
+// not supported or malformed
+auto make_key(std::uint8_t algorithm, byte_span public_key) -> evp_key
+{
+    EVP_PKEY * pk = nullptr;
+    switch (static_cast<dnssec_algorithm>(algorithm))
+    {
+    case dnssec_algorithm::RSASHA1:
+    case dnssec_algorithm::RSASHA1_NSEC3_SHA1:
+    case dnssec_algorithm::RSASHA256:
+    case dnssec_algorithm::RSASHA512:
+        pk = make_rsa_key(public_key);
+        break;
+    case dnssec_algorithm::ECDSAP256SHA256:
+        pk = make_ec_key("P-256", 32, public_key);
+        break;
+    case dnssec_algorithm::ECDSAP384SHA384:
+        pk = make_ec_key("P-384", 48, public_key);
+        break;
+    case dnssec_algorithm::ED25519:
+        pk = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, nullptr, public_key.data(), public_key.size());
+        break;
+    case dnssec_algorithm::ED448:
+        pk = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED448, nullptr, public_key.data(), public_key.size());
+        break;
+    default:
+        break;
+    }
+    if (pk == nullptr)
+        return nullptr;
+    return evp_key{pk, EVP_PKEY_free};
+}
+
+// A DNSKEY made ready to verify with: its key for OpenSSL and, for RSA, a
+// context initialized for that key once. RSA verifications start from a
+// copy of the context, which skips the costly key setup; for ECDSA and
+// EdDSA the copy costs as much as a fresh init, so they init from the key.
+// Either way nothing is written to it, so any thread may verify with one.
+struct prepared_key
+{
+    std::uint8_t _algorithm = 0;
+    evp_key _key;
+    std::shared_ptr<EVP_MD_CTX> _ready;
+};
+
+bool rsa_algorithm(std::uint8_t algorithm)
+{
+    return algorithm == +dnssec_algorithm::RSASHA1 or algorithm == +dnssec_algorithm::RSASHA1_NSEC3_SHA1 or
+           algorithm == +dnssec_algorithm::RSASHA256 or algorithm == +dnssec_algorithm::RSASHA512;
+}
 
-    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(pk, nullptr);
-    defer _run_3 = [ctx]{ EVP_PKEY_CTX_free(ctx); };
+auto prepare_key(std::uint8_t algorithm, byte_span public_key) -> std::shared_ptr<prepared_key const>
+{
+    evp_key key = make_key(algorithm, public_key);
+    if (not key)
+        return nullptr;
+    std::shared_ptr<EVP_MD_CTX> ready;
+    if (rsa_algorithm(algorithm))
+    {
+        ready.reset(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        if (not ready or EVP_DigestVerifyInit(ready.get(), nullptr, signature_digest(algorithm), nullptr, key.get()) != 1)
+            return nullptr;
+    }
+    return std::make_shared<prepared_key const>(prepared_key{algorithm, std::move(key), std::move(ready)});
+}
 
-    EVP_MD_CTX* verify = EVP_MD_CTX_new();
-    defer _run_4 = [ctx]{ EVP_MD_CTX_free(verify); };
-    EVP_MD_CTX_init(verify);
+// RFC 6605 section 4: DNSSEC carries an ECDSA signature as r then s, of
+// half its size each, OpenSSL takes their DER encoding
+auto ecdsa_der(byte_span signature) -> std::vector<std::uint8_t>
+{
+    if (signature.size() == 0 or signature.size() % 2 != 0)
+        return {};
+    std::size_t const half = signature.size() / 2;
+    ECDSA_SIG * sig = ECDSA_SIG_new();
+    defer _free_sig = [sig] { ECDSA_SIG_free(sig); };
+    BIGNUM * r = BN_bin2bn(signature.data(), half, nullptr);
+    BIGNUM * s = BN_bin2bn(signature.data() + half, half, nullptr);
+    if (sig == nullptr or ECDSA_SIG_set0(sig, r, s) != 1)
+    {
+        BN_free(r);
+        BN_free(s);
+        return {};
+    }
 
-    EVP_DigestVerifyInit(verify, nullptr, EVP_sha256(), nullptr, pk);
-    EVP_DigestVerifyUpdate(verify, msg.data(), msg.size());
-    return EVP_DigestVerifyFinal(verify, hash.data(), hash.size());
+    int const size = i2d_ECDSA_SIG(sig, nullptr);
+    if (size <= 0)
+        return {};
+    std::vector<std::uint8_t> der(size);
+    std::uint8_t * out = der.data();
+    i2d_ECDSA_SIG(sig, &out);
+    return der;
 }
 
+// whether 'signature' over 'data' was made with 'key'
+bool verify_signature(prepared_key const & key, std::vector<std::uint8_t> const & data, byte_span signature)
+{
+    std::vector<std::uint8_t> der;
+    if (key._algorithm == +dnssec_algorithm::ECDSAP256SHA256 or key._algorithm == +dnssec_algorithm::ECDSAP384SHA384)
+    {
+        der = ecdsa_der(signature);
+        signature = {der.data(), der.size()};
+    }
+
+    EVP_MD_CTX * verify = EVP_MD_CTX_new();
+    defer _free_ctx = [verify] { EVP_MD_CTX_free(verify); };
+    bool const ready = key._ready ? EVP_MD_CTX_copy_ex(verify, key._ready.get()) == 1 :
+                       EVP_DigestVerifyInit(verify, nullptr, signature_digest(key._algorithm), nullptr, key._key.get()) == 1;
+    return ready and EVP_DigestVerify(verify, signature.data(), signature.size(), data.data(), data.size()) == 1;
+}
+
+bool verify_signature(std::uint8_t algorithm, byte_span public_key,
+                      std::vector<std::uint8_t> const & data, byte_span signature)
+{
+    prepared_key key{algorithm, make_key(algorithm, public_key), nullptr};
+    return key._key and verify_signature(key, data, signature);
+}
+
+// RFC 4035 section 5.3.1: whether 'sig' over the 'type' rrset of 'owner' is
+// valid at 'now' and can have been made by 'key'; what is left is the
+// cryptography
+bool rrsig_applies(wire_name const & owner, query_type type, rrsig const & sig,
+                   dnskey const & key, std::uint32_t now)
+{
+    // validity period in serial number arithmetic (RFC 1982)
+    if (static_cast<std::int32_t>(now - sig._inception) < 0 or static_cast<std::int32_t>(sig._expiration - now) < 0)
+        return false;
+    return sig._covered == type and sig._algorithm == key._algorithm and sig._key_tag == key._tag and key.usable() and
+           sig._labels <= owner._labels and is_subdomain(owner, sig._signer);
+}
+
+// RFC 4035 section 5.3: whether 'sig' (with RDATA 'sig_rdata') over the
+// 'type' rrset of 'owner' made of 'rdatas' is valid at 'now' and was made
+// by 'key'
+bool verify_rrset(wire_name const & owner, query_type type, std::vector<byte_span> const & rdatas,
+                  rrsig const & sig, byte_span sig_rdata, dnskey const & key, std::uint32_t now)
+{
+    return rrsig_applies(owner, type, sig, key, now) and
+           verify_signature(key._algorithm, key._public_key,
+                            signed_data(sig, sig_rdata, owner, type, 1, rdatas), sig._signature);
+}
+
+// Keys prepared for verifying (prepare_key), by (zone, key tag,
+// algorithm), kept until the TTL of the DNSKEY rrset they came from runs
+// out, so a key is decoded once and not for every signature. Times are in
+// seconds of the clock signatures are checked against. Not thread safe:
+// one per worker.
+class key_cache
+{
+    struct entry
+    {
+        std::vector<std::uint8_t> _public_key; // tags collide; the key must match too
+        std::shared_ptr<prepared_key const> _key;
+        std::uint32_t _expires = 0;
+    };
+
+    std::unordered_map<std::string, entry> _entries;
+    std::size_t _capacity;
+
+    static bool expired(std::uint32_t expires, std::uint32_t now) { return static_cast<std::int32_t>(expires - now) <= 0; }
+
+public:
+    explicit key_cache(std::size_t capacity = 1024): _capacity{capacity} {}
+
+    // 'key' of 'zone', whose DNSKEY rrset has 'ttl' left, nullptr if it
+    // cannot be used
+    auto get(wire_name zone, dnskey const & key, std::uint32_t ttl, std::uint32_t now) -> std::shared_ptr<prepared_key const>
+    {
+        zone.to_lower();
+        std::string id(reinterpret_cast<char const *>(zone.data()), zone.size());
+        id.push_back(static_cast<char>(key._tag >> 8));
+        id.push_back(static_cast<char>(key._tag & 0xff));
+        id.push_back(static_cast<char>(key._algorithm));
+
+        if (auto it = _entries.find(id); it != _entries.end() and not expired(it->second._expires, now) and
+            std::equal(key._public_key.begin(), key._public_key.end(), it->second._public_key.begin(), it->second._public_key.end()))
+            return it->second._key;
+
+        auto made = prepare_key(key._algorithm, key._public_key);
+        if (not made)
+            return nullptr;
+        if (_entries.size() >= _capacity and not _entries.contains(id))
+        {
+            std::erase_if(_entries, [now] (auto const & e) { return expired(e.second._expires, now); });
+            if (_entries.size() >= _capacity)
+                _entries.erase(_entries.begin());
+        }
+        _entries[id] = entry{{key._public_key.begin(), key._public_key.end()}, made, now + ttl};
+        return made;
+    }
+
+    auto size() const -> std::size_t { return _entries.size(); }
+};
+
+// Signatures checked, whether they held, by a SHA-256 digest of the key, the
+// signature and the canonical data it signs (the RRSIG fields and the
+// rrset), until the signature expires: an rrset met again is not verified
+// again. Not thread safe: one per worker.
+class verified_cache
+{
+    struct entry
+    {
+        std::uint32_t _expiration; // of the RRSIG
+        bool _holds;
+    };
+
+    std::unordered_map<std::string, entry> _entries;
+    std::size_t _capacity;
+
+public:
+    using digest = std::string;
+
+    explicit verified_cache(std::size_t capacity = 16384): _capacity{capacity} {}
+
+    static auto make_digest(dnskey const & key, std::vector<std::uint8_t> const & data, byte_span signature) -> digest
+    {
+        std::array<std::uint8_t, EVP_MAX_MD_SIZE> out;
+        unsigned int size = 0;
+        EVP_MD_CTX * ctx = EVP_MD_CTX_new();
+        defer _free_ctx = [ctx] { EVP_MD_CTX_free(ctx); };
+        if (EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) != 1 or
+            EVP_DigestUpdate(ctx, &key._algorithm, 1) != 1 or
+            EVP_DigestUpdate(ctx, key._public_key.data(), key._public_key.size()) != 1 or
+            EVP_DigestUpdate(ctx, signature.data(), signature.size()) != 1 or
+            EVP_DigestUpdate(ctx, data.data(), data.size()) != 1 or
+            EVP_DigestFinal_ex(ctx, out.data(), &size) != 1)
+            return {};
+        return digest(reinterpret_cast<char const *>(out.data()), size);
+    }
+
+    // whether what 'd' digests held when checked, if it was and its
+    // signature is still valid at 'now'
+    auto find(digest const & d, std::uint32_t now) const -> std::optional<bool>
+    {
+        if (auto it = _entries.find(d); it != _entries.end() and static_cast<std::int32_t>(it->second._expiration - now) >= 0)
+            return it->second._holds;
+        return std::nullopt;
+    }
+
+    void insert(digest d, bool holds, std::uint32_t expiration, std::uint32_t now)
+    {
+        if (d.empty())
+            return;
+        if (_entries.size() >= _capacity)
+        {
+            std::erase_if(_entries, [now] (auto const & e) { return static_cast<std::int32_t>(e.second._expiration - now) < 0; });
+            if (_entries.size() >= _capacity)
+                _entries.erase(_entries.begin());
+        }
+        _entries[std::move(d)] = entry{expiration, holds};
+    }
+
+    auto size() const -> std::size_t { return _entries.size(); }
+};
+
+// RFC 4034 section 5.1.4: whether 'ds' is the digest of 'key' (an RDATA) of 'owner'
+bool ds_matches(wire_name owner, byte_span key, byte_span ds)
+{
+    if (ds.size() < 5 or readnet<std::uint16_t>(ds.begin()) != key_tag(key) or key.size() < 4 or ds.data()[2] != key.data()[3])
+        return false;
+
+    EVP_MD const * md = nullptr;
+    switch (ds.data()[3])
+    {
+    case 1: md = EVP_sha1();   break;
+    case 2: md = EVP_sha256(); break;
+    case 4: md = EVP_sha384(); break;
+    default: return false;
+    }
+
+    owner.to_lower();
+    std::array<std::uint8_t, EVP_MAX_MD_SIZE> digest;
+    unsigned int size = 0;
+    EVP_MD_CTX * ctx = EVP_MD_CTX_new();
+    defer _free_ctx = [ctx] { EVP_MD_CTX_free(ctx); };
+    if (EVP_DigestInit_ex(ctx, md, nullptr) != 1 or
+        EVP_DigestUpdate(ctx, owner.data(), owner.size()) != 1 or
+        EVP_DigestUpdate(ctx, key.data(), key.size()) != 1 or
+        EVP_DigestFinal_ex(ctx, digest.data(), &size) != 1)
+        return false;
+    return size == ds.size() - 4 and std::memcmp(digest.data(), ds.data() + 4, size) == 0;
+}
+
+// a DS this validator can check: a supported algorithm and digest type
+bool usable_ds(byte_span ds)
+{
+    return ds.size() > 4 and supported_algorithm(ds.data()[2]) and
+           (ds.data()[3] == 1 or ds.data()[3] == 2 or ds.data()[3] == 4);
+}
+
+// RFC 4034 section 6.1: compares label by label from the root, each label
+// case-insensitively as unsigned bytes, a missing label first
+auto canonical_compare(wire_name const & a, wire_name const & b) -> int
+{
+    auto labels = [] (wire_name const & n) {
+        std::vector<std::uint8_t> at;
+        for (std::size_t i = 0; n._data[i] != 0; i += n._data[i] + 1)
+            at.push_back(static_cast<std::uint8_t>(i));
+        return at;
+    };
+    std::vector<std::uint8_t> const la = labels(a), lb = labels(b);
+    for (std::size_t i = 1; i <= std::min(la.size(), lb.size()); i++)
+    {
+        std::uint8_t const * x = a.data() + la[la.size() - i];
+        std::uint8_t const * y = b.data() + lb[lb.size() - i];
+        for (std::size_t j = 1; j <= std::min(x[0], y[0]); j++)
+            if (int const d = std::tolower(x[j]) - std::tolower(y[j]); d != 0)
+                return d;
+        if (x[0] != y[0])
+            return x[0] - y[0];
+    }
+    return static_cast<int>(la.size()) - static_cast<int>(lb.size());
+}
+
+// RFC 4034 section 4.1.2: whether the type bit maps list 'type'
+bool bitmap_has(byte_span bitmaps, query_type type)
+{
+    std::uint8_t const window = +type >> 8;
+    std::uint8_t const bit    = +type & 0xff;
+    for (std::size_t pos = 0; pos + 2 <= bitmaps.size();)
+    {
+        std::uint8_t const w   = bitmaps.data()[pos];
+        std::uint8_t const len = bitmaps.data()[pos + 1];
+        pos += 2;
+        if (len == 0 or len > 32 or pos + len > bitmaps.size())
+            return false;
+        if (w == window)
+            return bit / 8 < len and (bitmaps.data()[pos + bit / 8] & (0x80 >> (bit % 8)));
+        pos += len;
+    }
+    return false;
+}
+
+// https://tools.ietf.org/html/rfc4034#section-4.1
+struct nsec
+{
+    wire_name _next;
+    byte_span _bitmaps;
+};
+
+bool parse_nsec(byte_span rd, nsec & n)
+{
+    std::size_t const end = read_name(rd.data(), rd.size(), 0, n._next);
+    if (end == 0)
+        return false;
+    n._bitmaps = {rd.data() + end, rd.size() - end};
+    return true;
+}
+
+// https://tools.ietf.org/html/rfc5155#section-3.1
+struct nsec3
+{
+    static constexpr std::uint8_t OPT_OUT = 1;
+
+    std::uint8_t _algorithm = 0;
+    std::uint8_t _flags = 0;
+    std::uint16_t _iterations = 0;
+    byte_span _salt;
+    byte_span _next; // hashed owner name, raw
+    byte_span _bitmaps;
+};
+
+bool parse_nsec3(byte_span rd, nsec3 & n)
+{
+    if (rd.size() < 5)
+        return false;
+    n._algorithm  = rd.data()[0];
+    n._flags      = rd.data()[1];
+    n._iterations = readnet<std::uint16_t>(rd.data() + 2);
+    std::size_t pos = 4;
+    std::size_t const salt = rd.data()[pos++];
+    if (pos + salt + 1 > rd.size())
+        return false;
+    n._salt = {rd.data() + pos, salt};
+    pos += salt;
+    std::size_t const hash = rd.data()[pos++];
+    if (hash == 0 or pos + hash > rd.size())
+        return false;
+    n._next = {rd.data() + pos, hash};
+    pos += hash;
+    n._bitmaps = {rd.data() + pos, rd.size() - pos};
+    return true;
+}
+
+using nsec3_digest = std::array<std::uint8_t, 20>; // SHA-1, the only hash defined
+
+// RFC 5155 section 5: IH(salt, x, 0) = H(x || salt),
+// IH(salt, x, k) = H(IH(salt, x, k - 1) || salt), over the lowercased name
+auto nsec3_hash(wire_name name, byte_span salt, std::uint16_t iterations) -> nsec3_digest
+{
+    name.to_lower();
+    nsec3_digest digest{};
+    std::vector<std::uint8_t> input(name.data(), name.data() + name.size());
+    for (std::uint32_t k = 0; k <= iterations; k++)
+    {
+        input.insert(input.end(), salt.begin(), salt.end());
+        EVP_Digest(input.data(), input.size(), digest.data(), nullptr, EVP_sha1(), nullptr);
+        input.assign(digest.begin(), digest.end());
+    }
+    return digest;
+}
+
+// the hash an NSEC3 owner name starts with: its first label in base32hex
+// (RFC 4648 section 7), false if it is not one
+bool nsec3_owner_hash(wire_name const & owner, nsec3_digest & digest)
+{
+    std::size_t const len = owner._data[0];
+    if (len != 32) // 20 bytes
+        return false;
+    std::uint64_t bits = 0;
+    std::size_t count = 0, out = 0;
+    for (std::size_t i = 1; i <= len; i++)
+    {
+        int const c = std::tolower(owner._data[i]);
+        int value;
+        if (c >= '0' and c <= '9')
+            value = c - '0';
+        else if (c >= 'a' and c <= 'v')
+            value = c - 'a' + 10;
+        else
+            return false;
+        bits = (bits << 5) | value;
+        count += 5;
+        if (count >= 8)
+        {
+            count -= 8;
+            digest[out++] = static_cast<std::uint8_t>(bits >> count);
+        }
+    }
+    return out == digest.size();
+}
+
+// Iterations above this make a proof cost more than it is worth: RFC 9276
+// section 3.2 lets a validator treat it as insecure, so such records are not
+// hashed and their answers are served without AD.
+constexpr std::uint16_t MAX_NSEC3_ITERATIONS = 150;
+
+// What an NSEC or NSEC3 record of a denial proof can say about a name.
+// Only records whose signatures were checked belong in one.
+struct denial_record
+{
+    wire_name _owner;
+    query_type _type = NXDOMAIN_TYPE;
+    byte_span _rdata;
+};
+
+// a record a negative rrset_cache entry keeps after its SOA: owner, type, RDATA
+bool parse_negative_part(byte_span part, denial_record & r)
+{
+    std::size_t const end = read_name(part.data(), part.size(), 0, r._owner);
+    if (end == 0 or end + sizeof(query_type) > part.size())
+        return false;
+    r._type  = readnet<query_type>(part.data() + end);
+    r._rdata = {part.data() + end + sizeof(query_type), part.size() - end - sizeof(query_type)};
+    return true;
+}
+
+// What a denial proof shows about a name and type
+enum class denial : std::uint8_t
+{
+    unproven,      // nothing, or not enough
+    nodata,        // the name exists without the type
+    nxdomain,      // the name does not exist
+    opt_out,       // inside an opt-out NSEC3 span: may be an unsigned delegation
+    too_costly,    // only NSEC3 with more than MAX_NSEC3_ITERATIONS: insecure
+};
+
+// NSEC: https://tools.ietf.org/html/rfc4035#section-5.4
+// whether an NSEC from 'owner' to 'next' leaves 'name' out, the last one
+// of a zone wrapping around to its apex
+bool nsec_covers(wire_name const & owner, wire_name const & next, wire_name const & name)
+{
+    if (canonical_compare(owner, name) >= 0)
+        return false;
+    return canonical_compare(name, next) < 0 or canonical_compare(next, owner) <= 0;
+}
+
+// whether the NSEC3 span from 'owner' to 'next' leaves 'hash' out
+bool nsec3_covers(nsec3_digest const & owner, byte_span next, nsec3_digest const & hash)
+{
+    if (next.size() != hash.size())
+        return false;
+    auto less = [] (std::uint8_t const * a, std::uint8_t const * b) { return std::memcmp(a, b, 20) < 0; };
+    if (less(owner.data(), next.data()))
+        return less(owner.data(), hash.data()) and less(hash.data(), next.data());
+    return less(owner.data(), hash.data()) or less(hash.data(), next.data()); // the last span
+}
+
+// An NSEC or NSEC3 at a delegation (NS without SOA) or a DNAME comes from
+// above what lies below it, and says nothing about that (RFC 6840 section 4.1)
+bool denial_from_above(byte_span bitmaps)
+{
+    return (bitmap_has(bitmaps, query_type::NS) and not bitmap_has(bitmaps, query_type::SOA)) or
+           bitmap_has(bitmaps, query_type::DNAME);
+}
+
+// the deepest ancestor of 'name' that the NSEC from 'owner' to 'next' shows to exist
+auto nsec_encloser(wire_name const & owner, wire_name const & next, wire_name const & name) -> wire_name
+{
+    wire_name encloser;
+    for (wire_name const & side : {owner, next})
+    {
+        wire_name common = name;
+        while (not is_subdomain(side, common))
+            common.to_parent();
+        if (common._labels > encloser._labels)
+            encloser = common;
+    }
+    return encloser;
+}
+
+// What the NSEC and NSEC3 records of 'proof', all from 'zone', prove about
+// 'type' at 'name' (NXDOMAIN_TYPE: about the name itself). A DS denial also
+// tells whether 'name' is a delegation: 'cut' is set when the bit maps show
+// NS without SOA.
+auto prove_denial(wire_name const & zone, wire_name const & name, query_type type,
+                  std::vector<denial_record> const & proof, bool * cut = nullptr) -> denial
+{
+    if (cut)
+        *cut = false;
+
+    // at the name itself a record from above speaks only for the DS there:
+    // what else the name holds is below the cut, or beside the DNAME
+    auto absent = [&] (byte_span bitmaps) {
+        if (type == NXDOMAIN_TYPE or bitmap_has(bitmaps, type) or bitmap_has(bitmaps, query_type::CNAME))
+            return false;
+        if (type != query_type::DS and denial_from_above(bitmaps))
+            return false;
+        if (cut)
+            *cut = bitmap_has(bitmaps, query_type::NS) and not bitmap_has(bitmaps, query_type::SOA);
+        return true;
+    };
+
+    // NSEC: a record at the name without the type, or records around the
+    // name and around the wildcard that could have made it
+    wire_name encloser; // the deepest ancestor shown to exist
+    bool covered = false;
+    for (denial_record const & r : proof)
+    {
+        nsec n;
+        if (r._type != query_type::NSEC or not parse_nsec(r._rdata, n))
+            continue;
+        if (r._owner == name)
+            return absent(n._bitmaps) ? denial::nodata : denial::unproven;
+        if (not nsec_covers(r._owner, n._next, name) or (is_subdomain(name, r._owner) and denial_from_above(n._bitmaps)))
+            continue;
+        if (is_subdomain(n._next, name))
+            return type == NXDOMAIN_TYPE ? denial::unproven : denial::nodata; // an empty non-terminal
+        covered = true;
+        if (wire_name const common = nsec_encloser(r._owner, n._next, name); common._labels > encloser._labels)
+            encloser = common;
+    }
+    if (covered)
+    {
+        wire_name const star = wildcard_of(encloser);
+        for (denial_record const & r : proof)
+            if (nsec n; r._type == query_type::NSEC and parse_nsec(r._rdata, n) and nsec_covers(r._owner, n._next, star))
+                return denial::nxdomain;
+        return denial::unproven;
+    }
+
+    // NSEC3: a record matching the name's hash, or the closest encloser
+    // proof (RFC 5155 section 8.4): an ancestor that matches, the name one
+    // label below it covered, and the wildcard at it covered
+    struct hashed
+    {
+        nsec3 _record;
+        nsec3_digest _owner;
+    };
+    std::vector<hashed> records;
+    bool costly = false;
+    for (denial_record const & r : proof)
+    {
+        hashed h;
+        wire_name parent = r._owner;
+        parent.to_parent();
+        if (r._type != query_type::NSEC3 or parent != zone or not parse_nsec3(r._rdata, h._record) or
+            h._record._algorithm != 1 or not nsec3_owner_hash(r._owner, h._owner))
+            continue;
+        if (h._record._iterations > MAX_NSEC3_ITERATIONS)
+            costly = true;
+        else
+            records.push_back(h);
+    }
+    if (records.empty())
+        return costly ? denial::too_costly : denial::unproven;
+
+    nsec3 const & params = records.front()._record;
+    auto hash = [&params] (wire_name const & n) { return nsec3_hash(n, params._salt, params._iterations); };
+    auto matching = [&records] (nsec3_digest const & h) -> nsec3 const * {
+        for (hashed const & r : records)
+            if (r._owner == h)
+                return &r._record;
+        return nullptr;
+    };
+    auto covering = [&records] (nsec3_digest const & h) -> nsec3 const * {
+        for (hashed const & r : records)
+            if (nsec3_covers(r._owner, r._record._next, h))
+                return &r._record;
+        return nullptr;
+    };
+
+    if (nsec3 const * match = matching(hash(name)))
+        return absent(match->_bitmaps) ? denial::nodata : denial::unproven;
+
+    wire_name next_closer = name;
+    wire_name closest = name;
+    closest.to_parent();
+    nsec3 const * matched = nullptr;
+    while (is_subdomain(closest, zone) and (matched = matching(hash(closest))) == nullptr)
+    {
+        if (closest == zone)
+            return denial::unproven;
+        next_closer = closest;
+        closest.to_parent();
+    }
+    if (matched == nullptr or denial_from_above(matched->_bitmaps))
+        return denial::unproven;
+
+    nsec3 const * span = covering(hash(next_closer));
+    if (span == nullptr)
+        return denial::unproven;
+    if (span->_flags & nsec3::OPT_OUT)
+        return denial::opt_out;
+    return covering(hash(wildcard_of(closest))) ? denial::nxdomain : denial::unproven;
+}
+
+// Wildcards: https://tools.ietf.org/html/rfc4035#section-5.3.4
+//            https://tools.ietf.org/html/rfc5155#section-8.8
+// What the NSEC and NSEC3 records of 'proof', all from 'zone', show about
+// the names between 'name' and the wildcard an RRSIG of 'labels' labels
+// was made at: nxdomain when none of them exists, so the answer at 'name'
+// rightly came from the wildcard. For NSEC the one around the name must
+// reach back to the wildcard's parent, for NSEC3 the next closer name must
+// be covered.
+auto prove_no_closer(wire_name const & zone, wire_name const & name, std::uint8_t labels,
+                     std::vector<denial_record> const & proof) -> denial
+{
+    wire_name next_closer = name;
+    while (next_closer._labels > labels + 1)
+        next_closer.to_parent();
+
+    bool costly = false;
+    for (denial_record const & r : proof)
+    {
+        if (nsec n; r._type == query_type::NSEC and parse_nsec(r._rdata, n))
+        {
+            if (nsec_covers(r._owner, n._next, name) and nsec_encloser(r._owner, n._next, name)._labels == labels and
+                not (is_subdomain(name, r._owner) and denial_from_above(n._bitmaps)))
+                return denial::nxdomain;
+            continue;
+        }
+
+        nsec3 n3;
+        nsec3_digest owner;
+        wire_name parent = r._owner;
+        parent.to_parent();
+        if (r._type != query_type::NSEC3 or parent != zone or not parse_nsec3(r._rdata, n3) or
+            n3._algorithm != 1 or not nsec3_owner_hash(r._owner, owner))
+            continue;
+        if (n3._iterations > MAX_NSEC3_ITERATIONS)
+            costly = true;
+        else if (nsec3_covers(owner, n3._next, nsec3_hash(next_closer, n3._salt, n3._iterations)))
+            return denial::nxdomain;
+    }
+    return costly ? denial::too_costly : denial::unproven;
+}
+
+// RFC 8198: the NSEC and NSEC3 records of denials that were proven, kept
+// by zone in the order of their owners (canonical order for NSEC, hash
+// order for NSEC3), each with its RRSIGs and the SOA it came with, until
+// the TTL of that denial runs out. The records around a name asked for
+// later may prove it absent without asking the zone: prove() gathers them
+// and lets prove_denial decide. Not thread safe: one per worker.
+class denial_cache
+{
+    struct span
+    {
+        std::vector<std::uint8_t> _record; // owner, type, RDATA, as a negative rrset keeps it
+        std::vector<std::vector<std::uint8_t>> _signatures; // its RRSIGs, alike
+        std::vector<std::uint8_t> _soa_owner;
+        std::vector<std::uint8_t> _soa;
+        std::vector<std::vector<std::uint8_t>> _soa_signatures;
+        std::uint32_t _expires = 0;
+    };
+
+    struct canonical_order
+    {
+        bool operator () (wire_name const & a, wire_name const & b) const { return canonical_compare(a, b) < 0; }
+    };
+
+    struct zone_spans
+    {
+        std::map<wire_name, span, canonical_order> _nsec;
+        std::map<nsec3_digest, span> _nsec3;
+    };
+
+    std::unordered_map<std::string, zone_spans> _zones; // by lowercased wire name
+    std::size_t _size = 0;
+    std::size_t _capacity;
+
+    static auto zone_key(wire_name zone) -> std::string
+    {
+        zone.to_lower();
+        return std::string(reinterpret_cast<char const *>(zone.data()), zone.size());
+    }
+
+    static bool expired(span const & s, std::uint32_t now) { return static_cast<std::int32_t>(s._expires - now) <= 0; }
+    static auto bytes(std::vector<std::uint8_t> const & v) -> byte_span { return {v.data(), v.size()}; }
+
+    // the span owned by 'key' or the one before it, the last one wrapping
+    // around to those before the first
+    template<typename Map, typename Key>
+    static auto at_or_before(Map const & spans, Key const & key) -> span const *
+    {
+        if (spans.empty())
+            return nullptr;
+        auto it = spans.upper_bound(key);
+        if (it == spans.begin())
+            it = spans.end();
+        return &std::prev(it)->second;
+    }
+
+    void make_room(std::uint32_t now)
+    {
+        if (_size <= _capacity)
+            return;
+        for (auto & [key, z] : _zones)
+        {
+            _size -= std::erase_if(z._nsec,  [now] (auto const & e) { return expired(e.second, now); });
+            _size -= std::erase_if(z._nsec3, [now] (auto const & e) { return expired(e.second, now); });
+        }
+        std::erase_if(_zones, [] (auto const & e) { return e.second._nsec.empty() and e.second._nsec3.empty(); });
+        while (_size > _capacity and not _zones.empty())
+        {
+            _size -= _zones.begin()->second._nsec.size() + _zones.begin()->second._nsec3.size();
+            _zones.erase(_zones.begin());
+        }
+    }
+
+public:
+    // a denial prove() made: what it shows, for how long, and its records
+    // laid out as a negative rrset keeps them, pointing into the cache
+    // until it changes
+    struct proof
+    {
+        denial _result = denial::unproven;
+        std::uint32_t _TTL = 0;
+        std::vector<byte_span> _parts;
+    };
+
+    explicit denial_cache(std::size_t capacity = 16384): _capacity{capacity} {}
+
+    // Keeps the records of 'checked', which proved a denial of 'zone' and
+    // whose signatures held, as 'negative' (the rrset_cache entry they came
+    // in) has them, with its SOA and their RRSIGs and those of the SOA.
+    void insert(wire_name const & zone, rrset const & negative, std::vector<denial_record> const & checked, std::uint32_t now)
+    {
+        std::vector<byte_span> parts;
+        negative.for_each([&parts] (byte_span part) { parts.push_back(part); });
+        wire_name soa_owner;
+        if (parts.size() < 2 or checked.empty() or read_name(parts[0].data(), parts[0].size(), 0, soa_owner) == 0)
+            return;
+
+        std::vector<std::vector<std::uint8_t>> soa_signatures;
+        for (std::size_t i = 2; i < parts.size(); i++)
+            if (denial_record p; parse_negative_part(parts[i], p) and p._owner == soa_owner and
+                p._type == query_type::RRSIG and p._rdata.size() >= sizeof(query_type) and
+                readnet<query_type>(p._rdata.data()) == query_type::SOA)
+                soa_signatures.emplace_back(parts[i].begin(), parts[i].end());
+
+        zone_spans & z = _zones[zone_key(zone)];
+        for (denial_record const & r : checked)
+        {
+            span s;
+            s._soa_owner.assign(parts[0].begin(), parts[0].end());
+            s._soa.assign(parts[1].begin(), parts[1].end());
+            s._soa_signatures = soa_signatures;
+            s._expires = now + negative._TTL;
+            for (std::size_t i = 2; i < parts.size(); i++)
+            {
+                denial_record p;
+                if (not parse_negative_part(parts[i], p) or p._owner != r._owner)
+                    continue;
+                if (p._type == r._type and std::equal(p._rdata.begin(), p._rdata.end(), r._rdata.begin(), r._rdata.end()))
+                    s._record.assign(parts[i].begin(), parts[i].end());
+                else if (p._type == query_type::RRSIG and p._rdata.size() >= sizeof(query_type) and
+                         readnet<query_type>(p._rdata.data()) == r._type)
+                    s._signatures.emplace_back(parts[i].begin(), parts[i].end());
+            }
+            if (s._record.empty())
+                continue;
+
+            nsec3_digest owner;
+            if (r._type == query_type::NSEC)
+                _size += z._nsec.insert_or_assign(r._owner, std::move(s)).second;
+            else if (r._type == query_type::NSEC3 and nsec3_owner_hash(r._owner, owner))
+                _size += z._nsec3.insert_or_assign(owner, std::move(s)).second;
+        }
+        make_room(now);
+    }
+
+    // What the spans kept for the deepest zone above 'name' prove about
+    // 'type' there: for NSEC those around the name and around the wildcard
+    // at each of its ancestors in the zone, for NSEC3 those around the
+    // hashes of the same names.
+    auto prove(wire_name const & name, query_type type, std::uint32_t now) const -> proof
+    {
+        wire_name zone = name;
+        zone_spans const * z = nullptr;
+        for (;; zone.to_parent())
+        {
+            if (auto it = _zones.find(zone_key(zone)); it != _zones.end())
+            {
+                z = &it->second;
+                break;
+            }
+            if (zone.is_root())
+                return {};
+        }
+
+        std::vector<span const *> used;
+        auto use = [&] (span const * s) {
+            if (s and not expired(*s, now) and std::find(used.begin(), used.end(), s) == used.end())
+                used.push_back(s);
+        };
+
+        use(at_or_before(z->_nsec, name));
+        for (wire_name above = name; above != zone;)
+        {
+            above.to_parent();
+            use(at_or_before(z->_nsec, wildcard_of(above)));
+        }
+
+        denial_record first;
+        nsec3 params;
+        if (not z->_nsec3.empty() and parse_negative_part(bytes(z->_nsec3.begin()->second._record), first) and
+            parse_nsec3(first._rdata, params) and params._algorithm == 1)
+        {
+            // not worth hashing: asked for, the denial is insecure anyway
+            if (params._iterations > MAX_NSEC3_ITERATIONS)
+                return {denial::too_costly, 0, {}};
+            for (wire_name at = name;; at.to_parent())
+            {
+                use(at_or_before(z->_nsec3, nsec3_hash(at, params._salt, params._iterations)));
+                use(at_or_before(z->_nsec3, nsec3_hash(wildcard_of(at), params._salt, params._iterations)));
+                if (at == zone)
+                    break;
+            }
+        }
+
+        std::vector<denial_record> records;
+        for (span const * s : used)
+            if (denial_record r; parse_negative_part(bytes(s->_record), r))
+                records.push_back(r);
+
+        proof p;
+        p._result = prove_denial(zone, name, type, records);
+        if (p._result != denial::nxdomain and p._result != denial::nodata)
+            return p;
+        p._TTL = used.front()->_expires - now;
+        p._parts = {bytes(used.front()->_soa_owner), bytes(used.front()->_soa)};
+        for (auto const & sig : used.front()->_soa_signatures)
+            p._parts.push_back(bytes(sig));
+        for (span const * s : used)
+        {
+            p._TTL = std::min(p._TTL, s->_expires - now);
+            p._parts.push_back(bytes(s->_record));
+            for (auto const & sig : s->_signatures)
+                p._parts.push_back(bytes(sig));
+        }
+        return p;
+    }
+
+    auto size() const -> std::size_t { return _size; }
+};
 
 #endif // HAREDNS_SEC_HPP_
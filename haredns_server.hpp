@@ -0,0 +1,392 @@
+#ifndef HAREDNS_SERVER_HPP_
+#define HAREDNS_SERVER_HPP_
+
+// DNS:          https://www.ietf.org/rfc/rfc1035.txt
+// EDNS(0):      https://tools.ietf.org/html/rfc6891
+// DNS over TCP: https://tools.ietf.org/html/rfc7766
+// Payload size: https://www.dnsflagday.net/2020/
+// SO_REUSEPORT: https://lwn.net/Articles/542629/
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cctype>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// posix headers
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include "haredns_def.hpp"
+#include "haredns_net.hpp"
+#include "haredns_wire.hpp"
+#include "haredns_cache.hpp"
+
+// what we accept and advertise over UDP with EDNS(0); larger responses are
+// truncated and left to TCP
+constexpr std::uint16_t SERVER_UDP_PAYLOAD_SIZE = 1232;
+constexpr std::uint16_t CLASSIC_UDP_PAYLOAD_SIZE = 512;
+constexpr std::size_t   MAX_TCP_MESSAGE_SIZE = 65535;
+
+// What a client asked: its header, its one question, and its EDNS(0) OPT
+// record if it sent one.
+struct dns_request
+{
+    dns::header _header{}; // host byte order
+    wire_name _name;
+    query_type _type = query_type::A;
+    std::uint16_t _class = 1;
+    bool _asked = false; // the question was readable
+    bool _edns = false;
+    bool _dnssec_ok = false;
+    std::uint16_t _udp_size = CLASSIC_UDP_PAYLOAD_SIZE;
+
+    bool recursion_desired() const { return _header._control & (1 << 8); }
+    bool checking_disabled() const { return _header._control & (1 << 4); }
+    bool authentic_data()    const { return _header._control & (1 << 5); }
+    auto opcode() const -> std::uint16_t { return (_header._control >> 11) & 0xf; }
+
+    // the largest response it can take over UDP
+    auto udp_limit() const -> std::size_t
+    {
+        if (not _edns)
+            return CLASSIC_UDP_PAYLOAD_SIZE;
+        return std::clamp(_udp_size, CLASSIC_UDP_PAYLOAD_SIZE, SERVER_UDP_PAYLOAD_SIZE);
+    }
+};
+
+// Reads a query. noerror: 'request' is complete. formerr or notimp: only the
+// header (and the question, if it was readable) is, and that is the answer.
+// plain: not worth answering at all (a response, or no header).
+auto parse_request(std::uint8_t const * msg, std::size_t size, dns_request & request) -> error_type
+{
+    if (size < sizeof(dns::header))
+        return error_type::plain;
+
+    std::memcpy(&request._header, msg, sizeof(dns::header));
+    request._header.to_ntohs();
+    if (request._header._control & (1 << 15))
+        return error_type::plain; // QR: a response
+    if (request.opcode() != 0)
+        return error_type::notimp;
+    if (request._header._question != 1)
+        return error_type::formerr;
+
+    std::size_t const end = read_name(msg, size, sizeof(dns::header), request._name);
+    if (end == 0 or end + 4 > size)
+        return error_type::formerr;
+    request._type  = readnet<query_type>(msg + end);
+    request._class = readnet<std::uint16_t>(msg + end + 2);
+    request._asked = true;
+
+    // the OPT record, anywhere among the others
+    std::size_t pos = end + 4;
+    std::size_t const records = std::size_t{request._header._answer} + request._header._authority + request._header._additional;
+    for (std::size_t i = 0; i < records; i++)
+    {
+        pos = skip_name(msg, size, pos);
+        if (pos == 0 or pos + 10 > size)
+            return error_type::formerr;
+        query_type const type = readnet<query_type>(msg + pos);
+        std::uint16_t const rd_size = readnet<std::uint16_t>(msg + pos + 8);
+        if (type == query_type::OPT)
+        {
+            request._edns      = true;
+            request._udp_size  = readnet<std::uint16_t>(msg + pos + 2);
+            request._dnssec_ok = readnet<std::uint32_t>(msg + pos + 4) & (1 << 15);
+        }
+        pos += 10 + rd_size;
+        if (pos > size)
+            return error_type::formerr;
+    }
+    return error_type::noerror;
+}
+
+// The start of the response to 'request' in 'buf', no larger than 'limit':
+// the header with its ID and flags, the question as it was asked (case
+// preserved) and room for our OPT record if it sent one. 'authentic' sets
+// AD: every record in it was validated.
+auto start_response(dns_request const & request, error_type rcode, std::uint8_t * buf, std::size_t limit,
+                    bool authentic = false) -> message_builder
+{
+    dns d;
+    d._header._id = request._header._id;
+    d.set(1, dns::control_code::QR, dns::control_code::RA);
+    d.set(request.recursion_desired(), dns::control_code::RD);
+    d.set(request.checking_disabled(), dns::control_code::CD);
+    d.set(authentic, dns::control_code::AD);
+    d.set(static_cast<int>(rcode) & 0xf, dns::control_code::RCODE);
+
+    message_builder out{buf, limit, d._header};
+    if (request._edns)
+        out.edns(SERVER_UDP_PAYLOAD_SIZE, request._dnssec_ok);
+    if (request._asked)
+        out.question(request._name, request._type, request._class);
+    return out;
+}
+
+// Whole responses kept in wire format, for the queries asked again and
+// again. A hit is answered without resolving, parsing a record or touching
+// the heap: the stored packet is copied out and only the ID, the RD flag,
+// the question name (to echo its case) and every TTL, decremented by the
+// time spent here, are patched. Keyed by (name, type, class, EDNS, DO, AD,
+// CD), the bits that change what is answered;
+// what the client's payload size does not fit is left to the slow path,
+// which truncates. Bounded by an approximate memory budget, expired
+// entries dropped first. Not thread safe: one per worker.
+class packet_cache
+{
+    struct entry
+    {
+        std::vector<std::uint8_t> _packet;
+        std::vector<std::uint16_t> _ttls; // offsets of the TTL fields in _packet
+        cache_clock::time_point _stored;
+        cache_clock::time_point _expires; // when the smallest TTL runs out
+
+        auto cost() const -> std::size_t { return sizeof(entry) + _packet.capacity() + 2 * _ttls.capacity() + 64; }
+    };
+
+    std::unordered_map<std::string, entry> _entries;
+    std::string _key; // scratch, so a lookup does not allocate
+    std::size_t _bytes = 0;
+    std::size_t _capacity;
+
+    // The key of the query in 'msg' into _key, and its UDP payload limit.
+    // Only the plain shape the fast path serves is accepted: one
+    // uncompressed question and at most an OPT record.
+    auto make_key(std::uint8_t const * msg, std::size_t size, std::size_t & udp_limit) -> bool
+    {
+        if (size < sizeof(dns::header) + 5 or
+            (msg[2] & 0xf8) != 0 or                              // QR, opcode
+            readnet<std::uint16_t>(msg + 4) != 1 or              // QDCOUNT
+            readnet<std::uint32_t>(msg + 6) != 0 or              // ANCOUNT, NSCOUNT
+            readnet<std::uint16_t>(msg + 10) > 1)                // ARCOUNT
+            return false;
+
+        _key.clear();
+        std::size_t pos = sizeof(dns::header);
+        for (;;)
+        {
+            if (pos >= size or msg[pos] > MAX_LABEL_SIZE or pos + 1 + msg[pos] > size)
+                return false;
+            std::uint8_t const len = msg[pos];
+            _key.push_back(static_cast<char>(len));
+            for (std::size_t i = pos + 1; i <= pos + len; i++)
+                _key.push_back(static_cast<char>(std::tolower(msg[i])));
+            pos += 1 + len;
+            if (len == 0)
+                break;
+        }
+        if (_key.size() > MAX_NAME_SIZE or pos + 4 > size)
+            return false;
+        _key.append(reinterpret_cast<char const *>(msg + pos), 4); // type, class
+        pos += 4;
+
+        std::uint8_t edns = ((msg[3] & 0x20) ? 4 : 0) | ((msg[3] & 0x10) ? 8 : 0); // AD, CD
+        udp_limit = CLASSIC_UDP_PAYLOAD_SIZE;
+        if (readnet<std::uint16_t>(msg + 10) == 1)
+        {
+            if (pos + 11 > size or msg[pos] != 0 or readnet<query_type>(msg + pos + 1) != query_type::OPT or
+                pos + 11 + readnet<std::uint16_t>(msg + pos + 9) != size)
+                return false;
+            edns |= 1 | ((msg[pos + 7] & 0x80) ? 2 : 0); // DO
+            udp_limit = std::clamp(readnet<std::uint16_t>(msg + pos + 3), CLASSIC_UDP_PAYLOAD_SIZE, SERVER_UDP_PAYLOAD_SIZE);
+        }
+        else if (pos != size)
+            return false;
+        _key.push_back(static_cast<char>(edns));
+        return true;
+    }
+
+    void make_room(std::size_t need, cache_clock::time_point now)
+    {
+        if (_bytes + need <= _capacity)
+            return;
+        for (auto it = _entries.begin(); it != _entries.end();)
+            if (it->second._expires <= now)
+            {
+                _bytes -= it->second.cost();
+                it = _entries.erase(it);
+            }
+            else
+                ++it;
+        while (_bytes + need > _capacity and not _entries.empty())
+        {
+            _bytes -= _entries.begin()->second.cost();
+            _entries.erase(_entries.begin());
+        }
+    }
+
+public:
+    explicit packet_cache(std::size_t capacity = 4 << 20): _capacity{capacity} {}
+
+    auto size() const -> std::size_t { return _entries.size(); }
+
+    // The stored response to the query 'msg' into 'out', patched for it.
+    // false on a miss, or when it would not fit a UDP response and 'tcp' is
+    // not set.
+    auto answer(std::uint8_t const * msg, std::size_t size, bool tcp, std::vector<std::uint8_t> & out,
+                cache_clock::time_point now = cache_clock::now()) -> bool
+    {
+        std::size_t udp_limit;
+        if (not make_key(msg, size, udp_limit))
+            return false;
+        auto it = _entries.find(_key);
+        if (it == _entries.end())
+            return false;
+
+        entry const & e = it->second;
+        if (e._expires <= now)
+        {
+            _bytes -= e.cost();
+            _entries.erase(it);
+            return false;
+        }
+        if (not tcp and e._packet.size() > udp_limit)
+            return false;
+
+        out.assign(e._packet.begin(), e._packet.end());
+        std::memcpy(out.data(), msg, sizeof(std::uint16_t));  // ID
+        out[2] = (out[2] & ~0x01) | (msg[2] & 0x01);          // RD
+        std::memcpy(out.data() + sizeof(dns::header), msg + sizeof(dns::header), _key.size() - 5);
+
+        auto const elapsed = static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(now - e._stored).count());
+        for (std::uint16_t at : e._ttls)
+        {
+            std::uint32_t const ttl = htonl(readnet<std::uint32_t>(e._packet.data() + at) - elapsed);
+            std::memcpy(out.data() + at, &ttl, sizeof ttl);
+        }
+        return true;
+    }
+
+    // Keeps 'packet', a whole (not truncated) response to 'request'. Only
+    // NOERROR and NXDOMAIN responses with records to age are kept.
+    void store(dns_request const & request, byte_span packet,
+               cache_clock::time_point now = cache_clock::now())
+    {
+        std::size_t const size = packet.size();
+        if (size < sizeof(dns::header) or (packet.data()[2] & 0x02) /* TC */ or
+            ((packet.data()[3] & 0x0f) != 0 and (packet.data()[3] & 0x0f) != 3))
+            return;
+
+        entry e;
+        std::uint32_t smallest = UINT32_MAX;
+        std::size_t pos = skip_name(packet.data(), size, sizeof(dns::header));
+        std::size_t const records = std::size_t{readnet<std::uint16_t>(packet.data() + 6)}
+                                  + readnet<std::uint16_t>(packet.data() + 8) + readnet<std::uint16_t>(packet.data() + 10);
+        if (pos == 0)
+            return;
+        pos += 4;
+        for (std::size_t i = 0; i < records; i++)
+        {
+            pos = skip_name(packet.data(), size, pos);
+            if (pos == 0 or pos + 10 > size)
+                return;
+            if (readnet<query_type>(packet.data() + pos) != query_type::OPT) // its "TTL" holds flags
+            {
+                e._ttls.push_back(static_cast<std::uint16_t>(pos + 4));
+                smallest = std::min(smallest, readnet<std::uint32_t>(packet.data() + pos + 4));
+            }
+            pos += 10 + readnet<std::uint16_t>(packet.data() + pos + 8);
+        }
+        if (e._ttls.empty() or smallest == 0 or smallest > INT32_MAX)
+            return;
+
+        e._packet.assign(packet.begin(), packet.end());
+        e._stored  = now;
+        e._expires = now + std::chrono::seconds(smallest);
+
+        wire_name name = request._name;
+        name.to_lower();
+        std::string key(reinterpret_cast<char const *>(name.data()), name.size());
+        std::uint16_t const t = +request._type;
+        key.push_back(static_cast<char>(t >> 8));
+        key.push_back(static_cast<char>(t & 0xff));
+        key.push_back(static_cast<char>(request._class >> 8));
+        key.push_back(static_cast<char>(request._class & 0xff));
+        key.push_back(static_cast<char>((request._edns ? (1 | (request._dnssec_ok ? 2 : 0)) : 0) |
+                                        (request.authentic_data() ? 4 : 0) | (request.checking_disabled() ? 8 : 0)));
+
+        if (auto old = _entries.find(key); old != _entries.end())
+        {
+            _bytes -= old->second.cost();
+            _entries.erase(old);
+        }
+        make_room(e.cost(), now);
+        _bytes += e.cost();
+        _entries.emplace(std::move(key), std::move(e));
+    }
+};
+
+// "address:port", "address" or "port" -> 'addr', the missing parts from
+// what 'addr' holds already
+bool parse_endpoint(std::string const & text, sockaddr_in & addr)
+{
+    addr.sin_family = AF_INET;
+    std::string host = text, port;
+    if (auto colon = text.rfind(':'); colon != std::string::npos)
+    {
+        host = text.substr(0, colon);
+        port = text.substr(colon + 1);
+    }
+    else if (not text.empty() and text.find_first_not_of("0123456789") == std::string::npos)
+    {
+        host.clear();
+        port = text;
+    }
+
+    if (not port.empty())
+    {
+        if (port.size() > 5 or port.find_first_not_of("0123456789") != std::string::npos or std::stoul(port) > 65535)
+            return false;
+        addr.sin_port = htons(std::stoul(port));
+    }
+    if (not host.empty() and inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+        return false;
+    return true;
+}
+
+// A non-blocking UDP (SOCK_DGRAM) or listening TCP (SOCK_STREAM) socket on
+// 'addr', with SO_REUSEPORT so every worker thread binds its own and the
+// kernel spreads clients over them. -1 on failure.
+auto listen_socket(sockaddr_in const & addr, int type) -> int
+{
+    int const fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket failed: ");
+        return -1;
+    }
+
+    int const on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0 or
+        bind(fd, reinterpret_cast<sockaddr const *>(&addr), sizeof addr) < 0 or
+        (type == SOCK_STREAM and listen(fd, SOMAXCONN) < 0))
+    {
+        perror("listen failed: ");
+        close(fd);
+        return -1;
+    }
+    if (type == SOCK_STREAM)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    else
+    {
+        // room for a burst of queries while the worker is busy; the default
+        // holds only a few hundred
+        int const size = 4 << 20;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    }
+    return fd;
+}
+
+#endif // HAREDNS_SERVER_HPP_
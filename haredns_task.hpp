@@ -0,0 +1,145 @@
+#ifndef HAREDNS_TASK_HPP_
+#define HAREDNS_TASK_HPP_
+
+// Coroutines: https://en.cppreference.com/w/cpp/language/coroutines
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// A lazily started coroutine returning T. Awaiting it starts it and resumes
+// the awaiter with its result when it finishes; finishing hands control
+// straight to the awaiter (symmetric transfer), so long co_await chains do
+// not grow the stack. Exceptions are not used here: one escaping a task
+// terminates.
+template<typename T>
+class task
+{
+public:
+    struct promise_type
+    {
+        std::optional<T> _value;
+        std::coroutine_handle<> _continuation = std::noop_coroutine();
+
+        auto get_return_object() -> task { return task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        auto initial_suspend() noexcept -> std::suspend_always { return {}; }
+
+        struct final_awaiter
+        {
+            bool await_ready() noexcept { return false; }
+            auto await_suspend(std::coroutine_handle<promise_type> h) noexcept -> std::coroutine_handle<>
+            {
+                return h.promise()._continuation;
+            }
+            void await_resume() noexcept {}
+        };
+        auto final_suspend() noexcept -> final_awaiter { return {}; }
+
+        void return_value(T value) { _value.emplace(std::move(value)); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+private:
+    std::coroutine_handle<promise_type> _handle;
+
+    explicit task(std::coroutine_handle<promise_type> handle): _handle{handle} {}
+
+public:
+    task(task const &) = delete;
+    task& operator = (task const &) = delete;
+    task(task && other) noexcept: _handle{std::exchange(other._handle, {})} {}
+    task& operator = (task && other) noexcept
+    {
+        if (this != &other)
+        {
+            if (_handle)
+                _handle.destroy();
+            _handle = std::exchange(other._handle, {});
+        }
+        return *this;
+    }
+
+    ~task()
+    {
+        if (_handle)
+            _handle.destroy();
+    }
+
+    auto operator co_await () && noexcept
+    {
+        struct awaiter
+        {
+            std::coroutine_handle<promise_type> _handle;
+
+            bool await_ready() noexcept { return false; }
+            auto await_suspend(std::coroutine_handle<> awaiting) noexcept -> std::coroutine_handle<>
+            {
+                _handle.promise()._continuation = awaiting;
+                return _handle;
+            }
+            auto await_resume() -> T { return std::move(*_handle.promise()._value); }
+        };
+        return awaiter{_handle};
+    }
+};
+
+// A coroutine nobody awaits: starts at once and frees itself when done.
+struct detached
+{
+    struct promise_type
+    {
+        auto get_return_object() -> detached { return {}; }
+        auto initial_suspend() noexcept -> std::suspend_never { return {}; }
+        auto final_suspend() noexcept -> std::suspend_never { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Runs 't' in the background and calls 'done' with its result.
+template<typename T, typename Callable>
+auto spawn(task<T> t, Callable done) -> detached
+{
+    done(co_await std::move(t));
+}
+
+// Values handed from any number of producers to one coroutine waiting on
+// them, in the order they were sent.
+template<typename T>
+class mailbox
+{
+    std::deque<T> _items;
+    std::coroutine_handle<> _waiter;
+
+public:
+    void send(T value)
+    {
+        _items.push_back(std::move(value));
+        if (_waiter)
+            std::exchange(_waiter, {}).resume();
+    }
+
+    bool empty() const { return _items.empty(); }
+
+    auto receive()
+    {
+        struct awaiter
+        {
+            mailbox & _box;
+
+            bool await_ready() const noexcept { return not _box._items.empty(); }
+            void await_suspend(std::coroutine_handle<> waiting) noexcept { _box._waiter = waiting; }
+            auto await_resume() -> T
+            {
+                T value = std::move(_box._items.front());
+                _box._items.pop_front();
+                return value;
+            }
+        };
+        return awaiter{*this};
+    }
+};
+
+#endif // HAREDNS_TASK_HPP_
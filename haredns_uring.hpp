@@ -0,0 +1,429 @@
+#ifndef HAREDNS_URING_HPP_
+#define HAREDNS_URING_HPP_
+
+// io_uring:          https://man7.org/linux/man-pages/man7/io_uring.7.html
+// Multishot recvmsg: https://man7.org/linux/man-pages/man3/io_uring_prep_recvmsg_multishot.3.html
+// Provided buffers:  https://man7.org/linux/man-pages/man3/io_uring_register_buf_ring.3.html
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+// posix headers
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "haredns_def.hpp"
+#include "haredns_net.hpp"
+
+#if !defined(HAREDNS_NO_URING) && __has_include(<linux/io_uring.h>)
+#define HAREDNS_HAVE_URING 1
+#include <csignal>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#else
+#define HAREDNS_HAVE_URING 0
+#endif
+
+#if HAREDNS_HAVE_URING
+
+// UDP sockets serviced through io_uring, spoken with raw syscalls. Every
+// socket has one multishot recvmsg armed that fills buffers the kernel
+// takes from a ring of provided buffers, so receiving costs no syscall per
+// datagram. Sends are queued as sendmsg SQEs and reach the kernel together
+// on the next enter. Needs Linux 6.0; open() returns nullptr on kernels
+// without it. Not thread safe.
+class uring
+{
+    static constexpr std::uint64_t KIND_MASK = 3ull << 62;
+    static constexpr std::uint64_t POLL      = 0;
+    static constexpr std::uint64_t RECV      = 1ull << 62;
+    static constexpr std::uint64_t SEND      = 2ull << 62;
+    static constexpr std::uint64_t CANCEL    = 3ull << 62;
+    static constexpr std::uint16_t GROUP     = 0; // provided buffer group
+
+    // what a multishot recvmsg writes into a provided buffer
+    static constexpr std::size_t BUFFER_SIZE =
+        sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + MAX_UDP_PAYLOAD_SIZE;
+
+    struct send_slot
+    {
+        outgoing _datagram;
+        std::string _tag;
+        iovec _iov;
+        msghdr _msg;
+    };
+
+    int _fd = -1;
+    unsigned _features = 0;
+
+    void * _sq_map = MAP_FAILED;
+    void * _cq_map = MAP_FAILED;
+    std::size_t _sq_map_size = 0;
+    std::size_t _cq_map_size = 0;
+    io_uring_sqe * _sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    std::size_t _sqes_size = 0;
+
+    unsigned * _sq_head;
+    unsigned * _sq_tail;
+    unsigned * _sq_array;
+    unsigned   _sq_mask;
+    unsigned   _sq_entries;
+    unsigned   _sq_local_tail = 0; // SQEs filled in, not all submitted yet
+    unsigned * _cq_head;
+    unsigned * _cq_tail;
+    unsigned   _cq_mask;
+    io_uring_cqe * _cqes;
+
+    io_uring_buf_ring * _buf_ring = static_cast<io_uring_buf_ring *>(MAP_FAILED);
+    std::size_t _buf_ring_size = 0;
+    unsigned _buf_entries = 0;
+    std::unique_ptr<std::uint8_t[]> _buffers;
+
+    msghdr _recv_template{};
+    std::vector<std::unique_ptr<send_slot>> _slots;
+    std::vector<std::uint32_t> _free_slots;
+
+    static auto enter(int fd, unsigned submit, unsigned complete, unsigned flags, void * arg, std::size_t size) -> int
+    {
+        return syscall(__NR_io_uring_enter, fd, submit, complete, flags, arg, size);
+    }
+
+    auto buffer(std::uint16_t id) const -> std::uint8_t * { return _buffers.get() + std::size_t{id} * BUFFER_SIZE; }
+
+    // hands provided buffer 'id' back to the kernel
+    void recycle(std::uint16_t id)
+    {
+        std::uint16_t const tail = __atomic_load_n(&_buf_ring->tail, __ATOMIC_RELAXED);
+        // not _buf_ring->bufs: in C++ the header's flexible array sits 8
+        // bytes past where the kernel reads it
+        io_uring_buf & b = reinterpret_cast<io_uring_buf *>(_buf_ring)[tail & (_buf_entries - 1)];
+        b.addr = reinterpret_cast<std::uint64_t>(buffer(id));
+        b.len  = BUFFER_SIZE;
+        b.bid  = id;
+        __atomic_store_n(&_buf_ring->tail, static_cast<std::uint16_t>(tail + 1), __ATOMIC_RELEASE);
+    }
+
+    // the next free SQE, submitting what is queued first if the ring is full
+    auto next_sqe() -> io_uring_sqe *
+    {
+        if (_sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries)
+            submit();
+
+        unsigned const index = _sq_local_tail & _sq_mask;
+        io_uring_sqe * sqe = &_sqes[index];
+        std::memset(sqe, 0, sizeof *sqe);
+        _sq_array[index] = index;
+        _sq_local_tail++;
+        return sqe;
+    }
+
+    bool setup(unsigned entries, unsigned buffers)
+    {
+        // a CQ big enough for a burst of responses: a multishot recvmsg
+        // that finds it full stops and has to be armed again
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = std::max(buffers, entries) * 4;
+        _fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (_fd < 0 and errno == EINVAL)
+        {
+            params = {};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = std::max(buffers, entries) * 4;
+            _fd = syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (_fd < 0)
+            return false;
+        _features = params.features;
+        if (not (_features & IORING_FEAT_SINGLE_MMAP) or not (_features & IORING_FEAT_EXT_ARG))
+            return false;
+
+        _sq_map_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                params.cq_off.cqes  + params.cq_entries * sizeof(io_uring_cqe));
+        _sq_map = mmap(nullptr, _sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        if (_sq_map == MAP_FAILED)
+            return false;
+        _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        _sqes = static_cast<io_uring_sqe *>(mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                 _fd, IORING_OFF_SQES));
+        if (_sqes == MAP_FAILED)
+            return false;
+
+        auto * sq = static_cast<std::uint8_t *>(_sq_map);
+        _sq_head    = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        _sq_tail    = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        _sq_array   = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        _sq_mask    = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        _sq_entries = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+        _sq_local_tail = *_sq_tail;
+        _cq_head = reinterpret_cast<unsigned *>(sq + params.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned *>(sq + params.cq_off.tail);
+        _cq_mask = *reinterpret_cast<unsigned *>(sq + params.cq_off.ring_mask);
+        _cqes    = reinterpret_cast<io_uring_cqe *>(sq + params.cq_off.cqes);
+
+        // provided buffers: a power of two of them, the ring page aligned
+        _buf_entries = 1;
+        while (_buf_entries < buffers and _buf_entries < 32768)
+            _buf_entries <<= 1;
+        _buf_ring_size = _buf_entries * sizeof(io_uring_buf);
+        _buf_ring = static_cast<io_uring_buf_ring *>(mmap(nullptr, _buf_ring_size, PROT_READ | PROT_WRITE,
+                                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (_buf_ring == MAP_FAILED)
+            return false;
+        _buffers = std::make_unique<std::uint8_t[]>(_buf_entries * BUFFER_SIZE);
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr    = reinterpret_cast<std::uint64_t>(_buf_ring);
+        reg.ring_entries = _buf_entries;
+        reg.bgid         = GROUP;
+        if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            return false;
+        for (unsigned id = 0; id < _buf_entries; id++)
+            recycle(id);
+
+        _recv_template.msg_namelen = sizeof(sockaddr_in);
+        return true;
+    }
+
+    // Kernels between 5.19 and 6.0 take provided buffer rings but refuse
+    // multishot recvmsg at once with EINVAL. Arms one on a scratch socket to
+    // find out.
+    bool probe()
+    {
+        int const fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+        if (fd < 0)
+            return false;
+        recv(fd, 0);
+        cancel(0);
+        wait(100);
+
+        bool supported = true;
+        for (int turn = 0; turn < 10; turn++)
+        {
+            bool done = false;
+            reap([] (std::uint64_t, sockaddr_in const &, std::uint8_t const *, std::size_t) {},
+                 [&] (std::uint64_t, int error) { supported = (error != -EINVAL); done = true; },
+                 [] (std::string const &, int) {},
+                 [] (std::uint64_t, bool) {});
+            if (done)
+                break;
+            wait(10);
+        }
+        close(fd);
+        return supported;
+    }
+
+    uring() = default;
+
+public:
+    uring(uring const &) = delete;
+    uring& operator = (uring const &) = delete;
+
+    ~uring()
+    {
+        if (_fd >= 0)
+            close(_fd);
+        if (_sqes != MAP_FAILED)
+            munmap(_sqes, _sqes_size);
+        if (_sq_map != MAP_FAILED)
+            munmap(_sq_map, _sq_map_size);
+        if (_buf_ring != MAP_FAILED)
+            munmap(_buf_ring, _buf_ring_size);
+    }
+
+    // a ring of 'entries' SQEs and 'buffers' provided receive buffers, or
+    // nullptr when the kernel cannot do what this class needs
+    static auto open(unsigned entries = 256, unsigned buffers = 512) -> std::unique_ptr<uring>
+    {
+        std::unique_ptr<uring> ring{new uring};
+        if (not ring->setup(entries, buffers) or not ring->probe())
+            return nullptr;
+        return ring;
+    }
+
+    // Arms a multishot recvmsg on 'fd'. Datagrams and its end are reported
+    // by reap() under 'tag', which must fit in 62 bits.
+    void recv(int fd, std::uint64_t tag)
+    {
+        io_uring_sqe * sqe = next_sqe();
+        sqe->opcode    = IORING_OP_RECVMSG;
+        sqe->fd        = fd;
+        sqe->addr      = reinterpret_cast<std::uint64_t>(&_recv_template);
+        sqe->len       = 1;
+        sqe->ioprio    = IORING_RECV_MULTISHOT;
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = GROUP;
+        sqe->user_data = RECV | tag;
+    }
+
+    // Arms a multishot poll for 'fd' becoming readable, reported by reap()
+    // under 'tag' (62 bits).
+    void poll(int fd, std::uint64_t tag)
+    {
+        io_uring_sqe * sqe = next_sqe();
+        sqe->opcode        = IORING_OP_POLL_ADD;
+        sqe->fd            = fd;
+        sqe->len           = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data     = POLL | tag;
+    }
+
+    // stops the recvmsg armed under 'tag'; reap() reports its end
+    void cancel(std::uint64_t tag)
+    {
+        io_uring_sqe * sqe = next_sqe();
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->fd        = -1;
+        sqe->addr      = RECV | tag;
+        sqe->user_data = CANCEL;
+    }
+
+    // Queues 'datagram' on 'fd'. It goes out on the next submit() or
+    // wait(); a failure is reported by reap() under 'tag'.
+    void send(int fd, outgoing && datagram, std::string tag)
+    {
+        std::uint32_t index;
+        if (_free_slots.empty())
+        {
+            index = _slots.size();
+            _slots.push_back(std::make_unique<send_slot>());
+        }
+        else
+        {
+            index = _free_slots.back();
+            _free_slots.pop_back();
+        }
+
+        send_slot & slot = *_slots[index];
+        slot._datagram = std::move(datagram);
+        slot._tag      = std::move(tag);
+        slot._iov      = { slot._datagram._packet.data(), slot._datagram._packet.size() };
+        slot._msg      = {};
+        slot._msg.msg_name    = &slot._datagram._to;
+        slot._msg.msg_namelen = sizeof slot._datagram._to;
+        slot._msg.msg_iov     = &slot._iov;
+        slot._msg.msg_iovlen  = 1;
+
+        io_uring_sqe * sqe = next_sqe();
+        sqe->opcode    = IORING_OP_SENDMSG;
+        sqe->fd        = fd;
+        sqe->addr      = reinterpret_cast<std::uint64_t>(&slot._msg);
+        sqe->len       = 1;
+        sqe->user_data = SEND | index;
+    }
+
+    // hands every queued SQE to the kernel in one enter
+    void submit()
+    {
+        unsigned const pending = _sq_local_tail - *_sq_tail;
+        if (pending == 0)
+            return;
+        __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+        while (enter(_fd, pending, 0, 0, nullptr, 0) < 0 and errno == EINTR)
+            ;
+    }
+
+    // Submits what is queued and waits up to 'timeout_ms' (-1: forever) for
+    // a completion, all in one enter. Also runs the completion work the kernel deferred
+    // to this thread, so it must be called even when not waiting.
+    void wait(int timeout_ms)
+    {
+        unsigned const pending = _sq_local_tail - *_sq_tail;
+        __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+        bool const ready = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE) != *_cq_head;
+
+        __kernel_timespec ts{};
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (timeout_ms < 0) ? 0 : reinterpret_cast<std::uint64_t>(&ts);
+
+        unsigned const complete = (ready or timeout_ms == 0) ? 0 : 1;
+        enter(_fd, pending, complete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg); // ETIME, EINTR: fine
+    }
+
+    // Goes through the completions: on_datagram(tag, from, data, size) for
+    // every datagram received (the data is only valid during the call),
+    // on_recv_end(tag, -errno) when a recvmsg stopped and needs arming again
+    // if still wanted, on_send_error(tag, -errno) for every failed send, and
+    // on_ready(tag, armed) when a polled fd is readable; the poll needs
+    // arming again unless 'armed'.
+    template<typename OnDatagram, typename OnRecvEnd, typename OnSendError, typename OnReady>
+    void reap(OnDatagram && on_datagram, OnRecvEnd && on_recv_end, OnSendError && on_send_error, OnReady && on_ready)
+    {
+        for (;;)
+        {
+            unsigned const head = *_cq_head;
+            if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+                return;
+            io_uring_cqe const cqe = _cqes[head & _cq_mask];
+            __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+
+            std::uint64_t const kind = cqe.user_data & KIND_MASK;
+            std::uint64_t const tag  = cqe.user_data & ~KIND_MASK;
+            if (kind == RECV)
+            {
+                if (cqe.flags & IORING_CQE_F_BUFFER)
+                {
+                    std::uint16_t const id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                    std::uint8_t const * buf = buffer(id);
+                    io_uring_recvmsg_out out;
+                    std::memcpy(&out, buf, sizeof out);
+                    std::size_t const offset = sizeof out + _recv_template.msg_namelen + out.controllen;
+                    if (cqe.res >= 0 and not (out.flags & MSG_TRUNC) and out.namelen >= sizeof(sockaddr_in) and
+                        offset + out.payloadlen <= BUFFER_SIZE)
+                    {
+                        sockaddr_in from;
+                        std::memcpy(&from, buf + sizeof out, sizeof from);
+                        on_datagram(tag, from, buf + offset, out.payloadlen);
+                    }
+                    recycle(id);
+                }
+                if (not (cqe.flags & IORING_CQE_F_MORE))
+                    on_recv_end(tag, cqe.res < 0 ? cqe.res : 0);
+            }
+            else if (kind == POLL)
+                on_ready(tag, (cqe.flags & IORING_CQE_F_MORE) != 0);
+            else if (kind == SEND)
+            {
+                send_slot & slot = *_slots[tag];
+                if (cqe.res < 0)
+                    on_send_error(slot._tag, cqe.res);
+                slot._datagram._packet.clear();
+                _free_slots.push_back(tag);
+            }
+        }
+    }
+};
+
+#else
+
+// Built without io_uring: open() always fails and callers stay on epoll.
+class uring
+{
+public:
+    static auto open(unsigned = 256, unsigned = 512) -> std::unique_ptr<uring> { return nullptr; }
+
+    void recv(int, std::uint64_t) {}
+    void poll(int, std::uint64_t) {}
+    void cancel(std::uint64_t) {}
+    void send(int, outgoing &&, std::string) {}
+    void submit() {}
+    void wait(int) {}
+
+    template<typename OnDatagram, typename OnRecvEnd, typename OnSendError, typename OnReady>
+    void reap(OnDatagram &&, OnRecvEnd &&, OnSendError &&, OnReady &&) {}
+};
+
+#endif // HAREDNS_HAVE_URING
+
+#endif // HAREDNS_URING_HPP_
@@ -0,0 +1,1137 @@
+#ifndef HAREDNS_WIRE_HPP_
+#define HAREDNS_WIRE_HPP_
+
+// Name encoding: https://tools.ietf.org/html/rfc1035#section-3.1
+// Compression:   https://tools.ietf.org/html/rfc1035#section-4.1.4
+// Truncation:    https://tools.ietf.org/html/rfc2181#section-9
+
+#include <iterator>
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <bitset>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+#include "haredns_def.hpp"
+#include "haredns_net.hpp"
+
+constexpr std::size_t MAX_NAME_SIZE  = 255;
+constexpr std::size_t MAX_LABEL_SIZE = 63;
+
+// A domain name decoded to uncompressed wire format ('\3www\7example\3com\0'),
+// stored inline so decoding never touches the heap.
+struct wire_name
+{
+    std::array<std::uint8_t, MAX_NAME_SIZE> _data{}; // default constructs the root name
+    std::uint8_t _size   = 1; // bytes used in _data, including the root label
+    std::uint8_t _labels = 0; // number of labels, not counting the root
+
+    auto data() const -> std::uint8_t const * { return _data.data(); }
+    auto size() const -> std::size_t { return _size; }
+    bool is_root() const { return _labels == 0; }
+
+    // drops the leftmost label, "www.example.com." -> "example.com."
+    void to_parent()
+    {
+        if (is_root())
+            return;
+        std::size_t const skip = _data[0] + 1;
+        std::memmove(_data.data(), _data.data() + skip, _size - skip);
+        _size -= skip;
+        _labels--;
+    }
+
+    // ASCII-only case folding; names compare case-insensitively (RFC 4343)
+    void to_lower()
+    {
+        for (std::size_t i = 0; _data[i] != 0; i += _data[i] + 1)
+            for (std::size_t j = i + 1; j <= i + _data[i]; j++)
+                if (_data[j] >= 'A' and _data[j] <= 'Z')
+                    _data[j] += 'a' - 'A';
+    }
+
+    // presentation format. root is "", everything else ends with '.'
+    auto to_string() const -> std::string
+    {
+        std::string s;
+        s.reserve(_size);
+        for (std::size_t i = 0; _data[i] != 0; i += _data[i] + 1)
+        {
+            s.append(reinterpret_cast<char const *>(&_data[i + 1]), _data[i]);
+            s += '.';
+        }
+        return s;
+    }
+};
+
+// case-insensitive, as names compare in DNS
+bool operator == (wire_name const & a, wire_name const & b)
+{
+    if (a._size != b._size)
+        return false;
+    for (std::size_t i = 0; i < a._size; i++)
+        if (std::tolower(a._data[i]) != std::tolower(b._data[i]))
+            return false;
+    return true;
+}
+
+bool operator != (wire_name const & a, wire_name const & b) { return not (a == b); }
+
+// true if 'name' is 'zone' or below it
+bool is_subdomain(wire_name const & name, wire_name const & zone)
+{
+    if (zone._labels > name._labels)
+        return false;
+
+    std::size_t i = 0;
+    for (std::size_t skip = name._labels - zone._labels; skip > 0; skip--)
+        i += name._data[i] + 1;
+
+    if (name._size - i != zone._size)
+        return false;
+    for (std::size_t j = 0; j < zone._size; j++)
+        if (std::tolower(name._data[i + j]) != std::tolower(zone._data[j]))
+            return false;
+    return true;
+}
+
+auto operator << (std::ostream& os, wire_name const & n) -> std::ostream&
+{
+    for (std::size_t i = 0; n._data[i] != 0; i += n._data[i] + 1)
+        os.write(reinterpret_cast<char const *>(&n._data[i + 1]), n._data[i]) << '.';
+    return os;
+}
+
+// Decodes the name at offset 'pos' of the packet 'msg' into 'name', iteratively,
+// following compression pointers.
+//
+// Every pointer must jump strictly before the previous jump target, which is
+// how a compressing writer lays names out and guarantees termination on
+// malicious loops.
+//
+// Returns the offset just past the name at its original position, or 0 if the
+// name is malformed (out of bounds, looping pointer, or longer than 255 bytes).
+auto read_name(std::uint8_t const * msg, std::size_t size, std::size_t pos,
+               wire_name & name) -> std::size_t
+{
+    name._size = name._labels = 0;
+    std::size_t end   = 0;   // set on the first jump
+    std::size_t limit = pos; // pointers must target below this
+
+    for (;;)
+    {
+        if (pos >= size)
+            return 0;
+
+        std::uint8_t const len = msg[pos];
+        if ((len & 0b1100'0000) == 0b1100'0000)
+        {
+            if (pos + 1 >= size)
+                return 0;
+
+            std::size_t target = ((len & 0b0011'1111) << 8) | msg[pos + 1];
+            if (end == 0)
+                end = pos + 2;
+            if (target >= limit)
+                return 0;
+            limit = pos = target;
+            continue;
+        }
+        else if (len > MAX_LABEL_SIZE) // 0b01 and 0b10 label types are not in use
+            return 0;
+
+        if (name._size + len + 1u > MAX_NAME_SIZE or pos + 1 + len > size)
+            return 0;
+
+        name._data[name._size++] = len;
+        if (len == 0)
+            return end != 0 ? end : pos + 1;
+
+        std::memcpy(&name._data[name._size], msg + pos + 1, len);
+        name._size += len;
+        name._labels++;
+        pos += len + 1;
+    }
+}
+
+// Encodes a presentation format name ("www.example.com" or "www.example.com.")
+// into 'name'. Returns false on empty labels or a name longer than 255 bytes.
+bool parse_name(std::string const & host, wire_name & name)
+{
+    name._size = name._labels = 0;
+    std::size_t start = (host == ".") ? host.size() : 0; // the root
+    while (start < host.size())
+    {
+        std::size_t dot = std::min(host.find('.', start), host.size());
+        std::size_t len = dot - start;
+        if (len == 0 or len > MAX_LABEL_SIZE or name._size + len + 2u > MAX_NAME_SIZE)
+            return false;
+
+        name._data[name._size++] = len;
+        std::memcpy(&name._data[name._size], host.data() + start, len);
+        name._size += len;
+        name._labels++;
+        start = dot + 1;
+    }
+    name._data[name._size++] = 0;
+    return true;
+}
+
+// Returns the offset just past the name at 'pos' without decoding it or
+// following pointers, or 0 if it runs out of the message.
+auto skip_name(std::uint8_t const * msg, std::size_t size, std::size_t pos) -> std::size_t
+{
+    for (;;)
+    {
+        if (pos >= size)
+            return 0;
+
+        std::uint8_t const len = msg[pos];
+        if ((len & 0b1100'0000) == 0b1100'0000)
+            return pos + 2 <= size ? pos + 2 : 0;
+        else if (len > MAX_LABEL_SIZE)
+            return 0;
+        else if (len == 0)
+            return pos + 1;
+        pos += len + 1;
+    }
+}
+
+struct dns
+{
+    struct header
+    {
+        std::uint16_t _id;
+        std::uint16_t _control;
+        std::uint16_t _question;
+        std::uint16_t _answer;
+        std::uint16_t _authority;
+        std::uint16_t _additional;
+
+        void to_htons()
+        {
+            _id        = htons(_id);
+            _control   = htons(_control);
+            _question  = htons(_question);
+            _answer    = htons(_answer);
+            _authority = htons(_authority);
+            _additional= htons(_additional);
+        }
+
+        void to_ntohs()
+        {
+            _id        = ntohs(_id);
+            _control   = ntohs(_control);
+            _question  = ntohs(_question);
+            _answer    = ntohs(_answer);
+            _authority = ntohs(_authority);
+            _additional= ntohs(_additional);
+        }
+
+        bool ok() const { return get_error_code() == error_type::noerror; }
+        auto get_error_code() const -> error_type { return static_cast<error_type>(0b0000'0000'00001111 & _control); };
+    };
+    header _header{};
+    std::vector<std::uint8_t> _body;
+
+    enum class control_code : std::uint16_t {
+        QR     = 1,      // 1 bit // Query or Response    // 0 -> request, 1 -> response
+        OPCODE = QR + 4, // 4 bits// Message Purpose      // 0 -> QUERY, ...
+        AA,              // 1 bit // Authoritative Answer // 0 -> cache, 1 -> authoritative
+        TC,              // 1 bit // Truncated            // 0 -> false, 1 -> true
+        RD,              // 1 bit // Recursion Desired    // 0 -> iterative, 1 -> recursive
+        RA,              // 1 bit // Recursion Available  // 0 -> not recursive, 1 -> recursive (server support)
+        Z,               // 1 bit // Zeros
+        AD,              // 1 bit // Authenticated data   // DNSSEC
+        CD,              // 1 bit // Checking Disabled    // DNSSEC
+        RCODE = CD + 4   // 4 bits// Error Codes          // See enum class return_code
+    };
+
+    dns() = default;
+
+    template<typename ... OtherCodes>
+    void set(int val, control_code const & cc, OtherCodes && ... codes)
+    {
+        _header._control |= val << (16 - static_cast<std::uint16_t>(cc));
+
+        if constexpr (sizeof...(OtherCodes) > 0)
+            set(val, std::forward<OtherCodes>(codes)...);
+    }
+
+    void set_query(std::string const & host, query_type qt)
+    {
+        _body = to_dns_format(host);
+        _header._question = 1;
+        _header._id = random_query_id();
+
+        std::size_t size = _body.size();
+        _body.insert(_body.end(), { 0, 0, 0, 0 });
+
+        std::uint8_t * end = _body.data() + size;
+        std::uint16_t query_val = htons(static_cast<std::uint16_t>(qt));
+        std::memcpy(end, &query_val, sizeof query_val);
+
+        end += sizeof query_val;
+        std::uint16_t in_addr = htons(static_cast<std::uint16_t>(1 /* IN */));
+        std::memcpy(end, &in_addr, sizeof in_addr);
+
+        // EDNS(0) and OPT pseudo-RR
+        _header._additional = 1;
+        size = _body.size();
+        _body.insert(_body.end(), { 0,          // NAME  -> ROOT
+                                    0, 0,       // TYPE  -> quert_type::OPT
+                                    0, 0,       // CLASS -> sender's UDP payload size
+                                    0, 0, 0, 0, // TTL   -> extended RCODE and flags
+                                    0, 0 });    // RDLEN -> describes RDATA
+        end = _body.data() + size + 1;
+
+        std::uint16_t opt = htons(static_cast<std::uint16_t>(query_type::OPT));
+        std::memcpy(end, &opt, sizeof opt);
+        end += sizeof opt;
+
+        std::uint16_t udp_size = htons(MAX_UDP_PAYLOAD_SIZE);
+        std::memcpy(end, &udp_size, sizeof udp_size);
+        end += sizeof udp_size;
+
+        // set 'extended RCODE and flags'. DO bit is on the first bit of 3rd bytes
+        // see https://tools.ietf.org/html/rfc6891#section-6.1.3
+        end += 2;
+        *end = 1 << 7;
+    }
+
+    auto create_packet() -> std::vector<std::uint8_t>
+    {
+        std::vector<std::uint8_t> packet(sizeof(header));
+        header h = _header;
+        h.to_htons();
+        std::memcpy(packet.data(), &h, sizeof(header));
+        std::copy(_body.begin(), _body.end(), std::back_inserter(packet));
+        return packet;
+    }
+
+    bool ok() const { return _header.ok(); }
+
+    static
+    auto to_dns_format(std::string host) -> std::vector<std::uint8_t>
+    {
+        if (host.empty() or host == ".")
+            return {0};
+        if (host.back() != '.')
+            host += '.';
+        std::vector<std::uint8_t> buf;
+
+        for (auto it = host.begin(); it != host.end();)
+        {
+            auto dot = std::find(it, host.end(), '.');
+            buf.push_back(std::distance(it, dot));
+            std::copy(it, dot, std::back_inserter(buf));
+            it = std::next(dot);
+        }
+        buf.push_back('\0');
+        return buf;
+    }
+};
+
+// the bit of 'cc' in the header's control word
+constexpr auto flag_bit(dns::control_code cc) -> std::uint16_t
+{
+    return static_cast<std::uint16_t>(1 << (16 - static_cast<std::uint16_t>(cc)));
+}
+
+// What a query says about EDNS(0) in its OPT record
+struct edns_options
+{
+    bool _enabled = true;
+    std::uint16_t _udp_size = MAX_UDP_PAYLOAD_SIZE;
+    bool _dnssec_ok = true;
+};
+
+// Queries with 'Flags' in the header and the OPT record of 'Edns', class IN.
+// Everything but the ID, the name and the type is laid out at compile time;
+// write() copies that and splices those in, straight into the send buffer.
+// The type stays a runtime argument as every caller picks it at runtime.
+template<std::uint16_t Flags, edns_options Edns = edns_options{}>
+struct query_encoder
+{
+    static constexpr std::size_t OPT_SIZE = Edns._enabled ? 11 : 0;
+    static constexpr std::size_t MAX_SIZE = sizeof(dns::header) + MAX_NAME_SIZE + 4 + OPT_SIZE;
+
+    // ID left zero; one question, and the OPT record in the additional section
+    static constexpr std::array<std::uint8_t, sizeof(dns::header)> HEADER {
+        0, 0, Flags >> 8, Flags & 0xff, 0, 1, 0, 0, 0, 0, 0, Edns._enabled ? 1 : 0
+    };
+
+    // after the type: the class, then the OPT record
+    static constexpr auto TRAILER = [] {
+        std::array<std::uint8_t, 2 + OPT_SIZE> t{ 0, 1 /* IN */ };
+        if constexpr (Edns._enabled)
+        {
+            t[2] = 0;                        // NAME  -> ROOT
+            t[3] = 0;                        // TYPE  -> OPT
+            t[4] = static_cast<std::uint8_t>(query_type::OPT);
+            t[5] = Edns._udp_size >> 8;      // CLASS -> UDP payload size
+            t[6] = Edns._udp_size & 0xff;
+            t[7] = t[8] = 0;                 // TTL   -> extended RCODE, version
+            t[9] = Edns._dnssec_ok ? 0x80 : 0; //       and the DO bit
+            t[10] = t[11] = t[12] = 0;       // RDLEN
+        }
+        return t;
+    }();
+
+    // The query for 'name' 'type' into 'out', which has room for MAX_SIZE
+    // bytes; returns its size.
+    static auto write(std::uint8_t * out, std::uint16_t id, wire_name const & name, query_type type) -> std::size_t
+    {
+        std::memcpy(out, HEADER.data(), HEADER.size());
+        out[0] = id >> 8;
+        out[1] = id & 0xff;
+        std::memcpy(out + HEADER.size(), name.data(), name.size());
+
+        std::size_t pos = HEADER.size() + name.size();
+        out[pos++] = +type >> 8;
+        out[pos++] = +type & 0xff;
+        std::memcpy(out + pos, TRAILER.data(), TRAILER.size());
+        return pos + TRAILER.size();
+    }
+};
+
+auto operator << (std::ostream& os, dns::header const & h) -> std::ostream&
+{
+    os << "id: "         << h._id         << "\n"
+       << "control: "    << std::bitset<16>(h._control) << "\n"
+       << "question: "   << h._question   << "\n"
+       << "answer: "     << h._answer     << "\n"
+       << "authority: "  << h._authority  << "\n"
+       << "additional: " << h._additional << "\n";
+    return os;
+}
+
+// Contiguous bytes inside a response. Never owns memory.
+struct byte_span
+{
+    std::uint8_t const * _data = nullptr;
+    std::size_t          _size = 0;
+
+    auto data()  const -> std::uint8_t const * { return _data; }
+    auto size()  const -> std::size_t { return _size; }
+    auto begin() const -> std::uint8_t const * { return _data; }
+    auto end()   const -> std::uint8_t const * { return _data + _size; }
+    bool empty() const { return _size == 0; }
+};
+
+// Writes a DNS message straight into a caller's buffer: questions first,
+// then records in section order. Names are compressed (RFC 1035 4.1.4)
+// against a fixed table of the suffixes written so far, owners and the
+// names in the RDATA of the types that allow it (NS, CNAME, SOA, PTR, MX).
+// Nothing is written past 'limit': an answer or authority record that does
+// not fit drops its whole rrset, sets TC and ends the message; one in the
+// additional section is just left out. The OPT record, if asked for, is
+// kept room for from the start.
+class message_builder
+{
+public:
+    enum class section : std::uint8_t { answer = 1, authority = 2, additional = 3 };
+
+private:
+    static constexpr std::size_t MAX_SUFFIXES = 64;
+    static constexpr std::size_t OPT_SIZE = 11;
+
+    struct suffix
+    {
+        std::uint16_t _offset;
+        std::uint8_t  _labels;
+    };
+
+    std::uint8_t * _buf;
+    std::size_t _limit;
+    std::size_t _size = sizeof(dns::header);
+    dns::header _header; // host byte order, counts kept here
+    std::uint8_t _section = 0; // 0: questions
+
+    std::array<suffix, MAX_SUFFIXES> _suffixes;
+    std::size_t _suffix_count = 0;
+
+    // the rrset being written, to take back whole
+    wire_name _rrset_owner;
+    query_type _rrset_type = query_type::OPT;
+    std::size_t _rrset_start = 0;
+    std::uint16_t _rrset_records = 0;
+
+    bool _full = false;
+    bool _truncated = false;
+    bool _edns = false;
+    bool _dnssec_ok = false;
+    std::uint16_t _udp_size = 0;
+
+    auto reserved() const -> std::size_t { return _edns ? OPT_SIZE : 0; }
+    bool room(std::size_t n) const { return _size + n + reserved() <= _limit; }
+
+    auto count(std::uint8_t s) -> std::uint16_t &
+    {
+        switch (s)
+        {
+        case 0:  return _header._question;
+        case 1:  return _header._answer;
+        case 2:  return _header._authority;
+        default: return _header._additional;
+        }
+    }
+
+    void put16(std::uint16_t v)
+    {
+        v = htons(v);
+        std::memcpy(_buf + _size, &v, sizeof v);
+        _size += sizeof v;
+    }
+
+    // is the name at 'offset' the same as 'name' from its byte 'at' on
+    bool same_name(std::size_t offset, wire_name const & name, std::size_t at) const
+    {
+        for (;;)
+        {
+            std::uint8_t const len = _buf[offset];
+            if ((len & 0b1100'0000) == 0b1100'0000)
+            {
+                offset = ((len & 0b0011'1111) << 8) | _buf[offset + 1];
+                continue;
+            }
+            if (len != name._data[at])
+                return false;
+            if (len == 0)
+                return true;
+            for (std::size_t i = 1; i <= len; i++)
+                if (std::tolower(_buf[offset + i]) != std::tolower(name._data[at + i]))
+                    return false;
+            offset += len + 1;
+            at += len + 1;
+        }
+    }
+
+    // 'name', its longest suffix already in the message replaced by a pointer
+    bool write_name(wire_name const & name)
+    {
+        std::size_t prefix = 0;
+        std::uint16_t pointer = 0;
+        bool found = false;
+        for (std::size_t labels = name._labels; labels > 0 and not found; labels--)
+        {
+            for (std::size_t i = 0; i < _suffix_count; i++)
+                if (_suffixes[i]._labels == labels and same_name(_suffixes[i]._offset, name, prefix))
+                {
+                    pointer = _suffixes[i]._offset;
+                    found = true;
+                    break;
+                }
+            if (not found)
+                prefix += name._data[prefix] + 1;
+        }
+
+        if (not room(prefix + (found ? 2 : 1)))
+            return false;
+
+        std::uint8_t labels = name._labels;
+        for (std::size_t i = 0; i < prefix and _suffix_count < MAX_SUFFIXES; i += name._data[i] + 1, labels--)
+            if (_size + i < 0x4000)
+                _suffixes[_suffix_count++] = {static_cast<std::uint16_t>(_size + i), labels};
+
+        std::memcpy(_buf + _size, name.data(), prefix);
+        _size += prefix;
+        if (found)
+            put16(0xc000 | pointer);
+        else
+            _buf[_size++] = 0;
+        return true;
+    }
+
+    // 'rdata' of 'type', uncompressed, with its names compressed if allowed
+    bool write_rdata(query_type type, byte_span rdata)
+    {
+        std::size_t names = 0, skip = 0; // how many names, after 'skip' bytes
+        switch (type)
+        {
+        case query_type::NS:
+        case query_type::CNAME:
+        case query_type::PTR: names = 1; break;
+        case query_type::SOA: names = 2; break;
+        case query_type::MX:  names = 1; skip = 2; break;
+        default: break;
+        }
+
+        std::size_t pos = 0;
+        if (names > 0)
+        {
+            if (not room(skip) or rdata.size() < skip)
+                return false;
+            std::memcpy(_buf + _size, rdata.data(), skip);
+            _size += skip;
+            pos = skip;
+            for (; names > 0; names--)
+            {
+                wire_name name;
+                std::size_t const end = read_name(rdata.data(), rdata.size(), pos, name);
+                if (end == 0 or not write_name(name))
+                    return false;
+                pos = end;
+            }
+        }
+        if (not room(rdata.size() - pos))
+            return false;
+        std::memcpy(_buf + _size, rdata.data() + pos, rdata.size() - pos);
+        _size += rdata.size() - pos;
+        return true;
+    }
+
+    // back to 'size', forgetting the suffixes written past it
+    void rewind(std::size_t size)
+    {
+        _size = size;
+        while (_suffix_count > 0 and _suffixes[_suffix_count - 1]._offset >= size)
+            _suffix_count--;
+    }
+
+public:
+    // 'header' gives the ID and flags; the counts are filled in as records
+    // are added
+    message_builder(std::uint8_t * buf, std::size_t limit, dns::header const & header):
+        _buf{buf}, _limit{std::max(limit, sizeof(dns::header))}, _header{header}
+    {
+        _header._question = _header._answer = _header._authority = _header._additional = 0;
+    }
+
+    // an OPT record goes at the end of the message; call before adding anything
+    bool edns(std::uint16_t udp_size, bool dnssec_ok)
+    {
+        if (_edns or _size + OPT_SIZE > _limit)
+            return false;
+        _edns = true;
+        _udp_size = udp_size;
+        _dnssec_ok = dnssec_ok;
+        return true;
+    }
+
+    void set_rcode(error_type rcode)
+    {
+        _header._control = (_header._control & ~0xf) | (static_cast<std::uint16_t>(rcode) & 0xf);
+    }
+
+    void set_authentic(bool authentic) // AD
+    {
+        std::uint16_t const AD = 1 << 5;
+        _header._control = authentic ? (_header._control | AD) : (_header._control & ~AD);
+    }
+
+    bool question(wire_name const & name, query_type type, std::uint16_t class_type = 1)
+    {
+        std::size_t const start = _size;
+        if (_section != 0 or _full or not write_name(name) or not room(4))
+        {
+            rewind(start);
+            return false;
+        }
+        put16(+type);
+        put16(class_type);
+        _header._question++;
+        return true;
+    }
+
+    // false if it was left out
+    bool add(section s, wire_name const & owner, query_type type, std::uint16_t class_type,
+             std::uint32_t TTL, byte_span rdata)
+    {
+        auto const sec = static_cast<std::uint8_t>(s);
+        if (_full or sec < _section)
+            return false;
+        if (sec != _section or type != _rrset_type or owner != _rrset_owner)
+        {
+            _section = sec;
+            _rrset_owner = owner;
+            _rrset_type = type;
+            _rrset_start = _size;
+            _rrset_records = 0;
+        }
+
+        bool fits = write_name(owner) and room(10);
+        if (fits)
+        {
+            put16(+type);
+            put16(class_type);
+            put16(TTL >> 16);
+            put16(TTL & 0xffff);
+            std::size_t const rd_length = _size;
+            _size += sizeof(std::uint16_t);
+            fits = write_rdata(type, rdata) and _size - rd_length - 2 <= UINT16_MAX;
+            if (fits)
+            {
+                std::uint16_t const rd_size = htons(static_cast<std::uint16_t>(_size - rd_length - 2));
+                std::memcpy(_buf + rd_length, &rd_size, sizeof rd_size);
+            }
+        }
+        if (not fits)
+        {
+            rewind(_rrset_start);
+            count(sec) -= _rrset_records;
+            _rrset_records = 0;
+            _full = true;
+            _truncated = _truncated or s != section::additional;
+            return false;
+        }
+        count(sec)++;
+        _rrset_records++;
+        return true;
+    }
+
+    bool truncated() const { return _truncated; }
+    auto data() const -> std::uint8_t const * { return _buf; }
+    auto size() const -> std::size_t { return _size + reserved(); }
+
+    // Writes the OPT record and the header; returns the message size. Call
+    // once, last.
+    auto finish() -> std::size_t
+    {
+        if (_edns)
+        {
+            _buf[_size++] = 0; // root
+            put16(+query_type::OPT);
+            put16(_udp_size);
+            put16(0);          // extended RCODE, version
+            put16(_dnssec_ok ? 0x8000 : 0);
+            put16(0);          // RDLEN
+            _header._additional++;
+            _edns = false;
+        }
+
+        dns::header h = _header;
+        if (_truncated)
+            h._control |= 1 << 9; // TC
+        h.to_htons();
+        std::memcpy(_buf, &h, sizeof h);
+        return _size;
+    }
+};
+
+// A resource record inside a received packet. Fields are decoded only when
+// asked for and the RDATA is handed out as a span into the packet, so a record
+// is just three offsets and a pointer. It must not outlive the packet it was
+// created from.
+struct resource_record
+{
+    std::uint8_t const * _packet;
+    std::uint16_t        _packet_size;
+    std::uint16_t        _offset;    // owner name
+    std::uint16_t        _rd_offset; // RDATA
+
+    auto at(std::size_t pos) const -> std::uint8_t const * { return _packet + pos; }
+
+    // false if the owner name does not decode
+    auto name(wire_name & n) const -> bool { return read_name(_packet, _packet_size, _offset, n) != 0; }
+    auto type()       const -> query_type    { return readnet<query_type>   (at(_rd_offset - 10)); }
+    auto class_type() const -> std::uint16_t { return readnet<std::uint16_t>(at(_rd_offset - 8));  }
+    auto TTL()        const -> std::uint32_t { return readnet<std::uint32_t>(at(_rd_offset - 6));  }
+    auto rd_size()    const -> std::uint16_t { return readnet<std::uint16_t>(at(_rd_offset - 2));  }
+    auto rd_data()    const -> byte_span     { return {at(_rd_offset), rd_size()}; }
+
+    // decodes the name 'offset' bytes into the RDATA, returns the RDATA offset
+    // past it, or 0 if it is malformed or runs out of the RDATA
+    auto rd_name(std::size_t offset, wire_name & name) const -> std::size_t
+    {
+        std::size_t const end = read_name(_packet, _packet_size, _rd_offset + offset, name);
+        if (end == 0 or end > _rd_offset + std::size_t{rd_size()})
+            return 0;
+        return end - _rd_offset;
+    }
+
+    auto show_rd_data(std::ostream & os = std::cout) const -> std::ostream&
+    {
+        byte_span const rd = rd_data();
+        switch(type())
+        {
+        case query_type::A:
+        {
+            if (ipv4 ip; rd_data_as_ip(ip))
+                os << ip_to_string(ip);
+            else
+                os << "malformed";
+            break;
+        }
+        case query_type::NS:
+        case query_type::CNAME:
+        {
+            wire_name name;
+            if (rd_name(0, name) != 0)
+                os << name;
+            else
+                os << "malformed";
+            break;
+        }
+        case query_type::AAAA:
+        {
+            if (rd.size() != 16)
+            {
+                os << "malformed";
+                break;
+            }
+            if constexpr (is_big_endian())
+                for (auto it = rd.begin(); it != rd.end(); std::advance(it, 1))
+                    os << std::dec << std::setw(1) << static_cast<int>(*it) << ":";
+            else
+                for (auto it = std::make_reverse_iterator(rd.end()); it != std::make_reverse_iterator(rd.begin()); std::advance(it, 1))
+                    os << std::dec << std::setw(1) << static_cast<int>(*it) << ":";
+            break;
+        }
+        case query_type::SOA:
+        {
+            wire_name m_name, r_name;
+            std::size_t offset = rd_name(0, m_name);
+            if (offset != 0)
+                offset = rd_name(offset, r_name);
+            if (offset == 0 or offset + 20 > rd.size())
+            {
+                os << "malformed";
+                break;
+            }
+            os << m_name << " " << r_name << " ";
+            auto it = std::next(rd.begin(), offset);
+            for (int i = 0; i < 5; i++)
+                os << readnet<std::uint32_t>(it) << " ";
+            break;
+        }
+        case query_type::MX:
+        {
+            wire_name mailname;
+            if (rd.size() < sizeof(std::uint16_t) or rd_name(sizeof(std::uint16_t), mailname) == 0)
+            {
+                os << "malformed";
+                break;
+            }
+            os << readnet<std::uint16_t>(rd.begin()) << "\t" << mailname;
+            break;
+        }
+        case query_type::OPT:
+        {
+            os << "exRCODE & flags: " << std::bitset<32>(TTL());
+            break;
+        }
+        case query_type::DS:
+        {
+            if (rd.size() < 4)
+            {
+                os << "malformed";
+                break;
+            }
+            auto it      = rd.begin();
+            auto key_tag = readnet<std::uint16_t>(it);
+            auto algo    = readnet<dnssec_algorithm>(it);
+            auto digest_type = readnet<std::uint8_t>(it); // 0 -> Reserved, 1 -> SHA-1, other: NotIMP
+
+            os << key_tag << " " << +algo << " " << +digest_type << " ";
+            os << "size: " << std::distance(it, rd.end()) << " ";
+            break;
+        }
+        case query_type::RRSIG:
+        {
+            if (rd.size() < 18)
+            {
+                os << "malformed";
+                break;
+            }
+            auto it      = rd.begin();
+            auto covered = readnet<query_type>(it);
+            auto algo    = readnet<dnssec_algorithm>(it);
+            auto labels  = readnet<std::uint8_t> (it);
+            auto oTTL    = readnet<std::uint32_t>(it);
+
+            auto sig_exp = readnet<std::uint32_t>(it);
+            auto sig_inc = readnet<std::uint32_t>(it);
+            auto key_tag = readnet<std::uint16_t>(it);
+
+            wire_name signer_name;
+            std::size_t const end = rd_name(std::distance(rd.begin(), it), signer_name);
+            if (end == 0)
+            {
+                os << "malformed";
+                break;
+            }
+            it = std::next(rd.begin(), end);
+
+            os << +covered << " "
+               << +algo << " "
+               << std::bitset<8>(labels)  << " "
+               << oTTL << " "
+               << sig_exp << " "
+               << sig_inc << " "
+               << key_tag << " "
+               << signer_name;
+            os << " size: " << std::distance(it, rd.end()) << " ";
+            break;
+        }
+        case query_type::DNSKEY:
+        {
+            // https://tools.ietf.org/html/rfc4034#section-2.1
+            if (rd.size() < 4)
+            {
+                os << "malformed";
+                break;
+            }
+            auto it       = rd.begin();
+            auto flags    = readnet<std::uint16_t>(it);
+            auto protocal = readnet<std::uint8_t>(it); // must be 3
+            auto algo     = readnet<dnssec_algorithm>(it);
+
+            os << std::bitset<16>(flags) << " "
+               << +protocal << " "
+               << +algo << " ";
+            os << "size: " << std::distance(it, rd.end()) << " ";
+            break;
+        }
+        default:
+            os << "enum: [" << type() << "] Not Impl";
+            break;
+        }
+        return os;
+    }
+
+    // appends the RDATA to 'out' with every embedded domain name expanded, so
+    // the bytes stay meaningful once the packet is gone. False, with 'out'
+    // as it was, if the RDATA is malformed.
+    auto rd_data_uncompressed(std::vector<std::uint8_t> & out) const -> bool
+    {
+        byte_span const rd = rd_data();
+        std::size_t const start = out.size();
+        auto append_name = [&](std::size_t offset) {
+            wire_name name;
+            offset = rd_name(offset, name);
+            if (offset != 0)
+                out.insert(out.end(), name.data(), name.data() + name.size());
+            return offset;
+        };
+
+        bool ok = true;
+        switch(type())
+        {
+        case query_type::NS:
+        case query_type::CNAME:
+        case query_type::PTR:
+            ok = append_name(0) == rd.size();
+            break;
+        case query_type::MX:
+            ok = rd.size() > 2;
+            if (ok)
+            {
+                out.insert(out.end(), rd.begin(), std::next(rd.begin(), 2));
+                ok = append_name(2) == rd.size();
+            }
+            break;
+        case query_type::SOA:
+        {
+            std::size_t offset = append_name(0);
+            if (offset != 0)
+                offset = append_name(offset);
+            ok = offset != 0 and offset + 20 == rd.size();
+            if (ok)
+                out.insert(out.end(), std::next(rd.begin(), offset), rd.end());
+            break;
+        }
+        default: // no compression allowed in RDATA of newer types (RFC 3597)
+            out.insert(out.end(), rd.begin(), rd.end());
+            break;
+        }
+        if (not ok)
+            out.resize(start);
+        return ok;
+    }
+
+    // the address of an A record; false if this is none, or its RDATA is
+    // not 4 bytes
+    auto rd_data_as_ip(ipv4 & ip) const -> bool
+    {
+        if (type() != query_type::A or rd_size() != sizeof(ipv4))
+            return false;
+        ip = readnet<std::uint32_t>(at(_rd_offset));
+        return true;
+    }
+
+    // "" if the RDATA does not start with a name
+    auto rd_data_as_hostname() const -> std::string
+    {
+        wire_name name;
+        if (rd_name(0, name) == 0)
+            return {};
+        return name.to_string();
+    }
+};
+
+auto operator << (std::ostream& os, resource_record const & h) -> std::ostream&
+{
+    if (wire_name name; h.name(name))
+        os << name;
+    else
+        os << "malformed";
+    os << "\t" << h.type() << "\t" << h.TTL() << "\t";
+    return h.show_rd_data(os);
+}
+
+// The ID and the one question of a raw message, read without indexing the
+// rest of it, so responses nobody waits for are dropped cheaply. False if
+// there is not exactly one question.
+bool peek_question(std::uint8_t const * msg, std::size_t size,
+                   std::uint16_t & id, wire_name & name, query_type & type)
+{
+    if (size < sizeof(dns::header))
+        return false;
+
+    dns::header h;
+    std::memcpy(&h, msg, sizeof(dns::header));
+    h.to_ntohs();
+    if (h._question != 1)
+        return false;
+
+    std::size_t const end = read_name(msg, size, sizeof(dns::header), name);
+    if (end == 0 or end + 4 > size)
+        return false;
+
+    id   = h._id;
+    type = readnet<query_type>(msg + end);
+    return true;
+}
+
+// Index over a whole received packet, built in one pass: the offset of every
+// question and record is recorded once, into the receive slab itself, and
+// records are decoded lazily through resource_record. The header stays in
+// place; _header is just a host byte order copy of it.
+class dns_message_view
+{
+public:
+    enum class section : std::uint8_t { question, answer, authority, additional };
+
+    using entry = record_offsets;
+
+    class records
+    {
+        dns_message_view const * _view;
+        entry const * _first;
+        entry const * _last;
+    public:
+        records(dns_message_view const * view, entry const * first, entry const * last):
+            _view{view}, _first{first}, _last{last} {}
+
+        struct iterator
+        {
+            dns_message_view const * _view;
+            entry const * _it;
+
+            auto operator * () const -> resource_record { return _view->record(*_it); }
+            auto operator ++ () -> iterator& { ++_it; return *this; }
+            bool operator != (iterator const & other) const { return _it != other._it; }
+        };
+
+        auto begin() const -> iterator { return {_view, _first}; }
+        auto end()   const -> iterator { return {_view, _last};  }
+        auto size()  const -> std::size_t { return std::distance(_first, _last); }
+        bool empty() const { return _first == _last; }
+        auto operator [] (std::size_t i) const -> resource_record { return _view->record(_first[i]); }
+    };
+
+private:
+    buffer_pool::buffer _packet;
+    dns::header _header{};
+    entry * _index = nullptr; // lives in _packet's slab
+    std::array<std::uint16_t, 5> _section_begin{}; // into _index, one past the end for the last
+    bool _complete = false;
+
+    auto record(entry const & e) const -> resource_record
+    {
+        return {_packet.data(), static_cast<std::uint16_t>(_packet.size()), e._offset, e._rd_offset};
+    }
+
+public:
+    dns_message_view() = default;
+    explicit dns_message_view(buffer_pool::buffer && packet): _packet{std::move(packet)}
+    {
+        std::uint8_t const * msg = _packet.data();
+        std::size_t const size   = _packet.size();
+        if (size < sizeof(dns::header))
+            return;
+
+        std::memcpy(&_header, msg, sizeof(dns::header));
+        _header.to_ntohs();
+        _index = _packet.slab()->_index.data();
+
+        std::array<std::uint16_t, 4> const counts = { _header._question, _header._answer, _header._authority, _header._additional };
+        std::size_t pos = sizeof(dns::header), n = 0;
+        _complete = true;
+        for (std::size_t s = 0; s < counts.size(); s++)
+        {
+            _section_begin[s] = n;
+            for (std::size_t i = 0; _complete and i < counts[s]; i++)
+            {
+                std::size_t name_end = skip_name(msg, size, pos);
+                std::size_t fixed    = (s == 0) ? 4 : 10;
+                if (name_end == 0 or name_end + fixed > size or n == receive_slab::max_records)
+                {
+                    _complete = false;
+                    break;
+                }
+
+                std::size_t next = name_end + fixed;
+                if (s != 0)
+                    next += readnet<std::uint16_t>(msg + name_end + 8);
+                if (next > size)
+                {
+                    _complete = false;
+                    break;
+                }
+
+                _index[n++] = {static_cast<std::uint16_t>(pos),
+                               static_cast<std::uint16_t>(s == 0 ? name_end : name_end + 10)};
+                pos = next;
+            }
+        }
+        _section_begin[4] = n;
+    }
+
+    dns_message_view(dns_message_view &&) = default;
+    dns_message_view& operator = (dns_message_view &&) = default;
+
+    // false if the message was cut short or malformed; the records parsed
+    // before the problem are still available
+    bool complete() const { return _complete; }
+    auto header() const -> dns::header const & { return _header; }
+    auto packet() const -> buffer_pool::buffer const & { return _packet; }
+    bool ok() const { return _header.ok(); }
+
+    auto get(section s) const -> records
+    {
+        auto i = static_cast<std::size_t>(s);
+        return {this, _index + _section_begin[i], _index + _section_begin[i + 1]};
+    }
+
+    auto answers()     const -> records { return get(section::answer); }
+    auto authorities() const -> records { return get(section::authority); }
+    auto additionals() const -> records { return get(section::additional); }
+
+    // the name and type of the i-th question
+    auto question(std::size_t i, wire_name & name) const -> query_type
+    {
+        entry const & e = _index[_section_begin[0] + i];
+        read_name(_packet.data(), _packet.size(), e._offset, name);
+        return readnet<query_type>(_packet.data() + e._rd_offset);
+    }
+
+    auto question_count() const -> std::size_t { return _section_begin[1] - _section_begin[0]; }
+
+    // true if this is the answer to exactly this one question
+    bool answers(wire_name const & name, query_type type) const
+    {
+        if (question_count() != 1)
+            return false;
+        wire_name asked;
+        return question(0, asked) == type and asked == name;
+    }
+};
+
+#endif // HAREDNS_WIRE_HPP_